@@ -6,6 +6,7 @@ MKFILEPATTERN=../tools/mkfilepattern
 DIRTOTEST=../tools/dirtotest.py
 MKSAMEHASH=../tools/mksamehash
 MKDIRRANGE=../tools/mkdirrange
+MKRAWZST=../tools/mkrawzst.py
 
 MKFS_XFS="sudo mkfs.xfs"
 XFS_MIN_DISK_SIZE="302MiB"
@@ -1086,6 +1087,84 @@ iso9660_s2k_dir_all.qcow2 () {
     rm $img_raw
 }
 
+vdisk_s05k.raw () {
+    local img=$FUNCNAME
+    $MKFILEPATTERN $img 0 8388608
+}
+
+vdisk_empty_c4k.qcow2 () {
+    local img=$FUNCNAME
+    qemu-img create -f qcow2 -o $QCOW2_OPTS,cluster_size=4096 $img 16M > /dev/null
+}
+
+vdisk_s05k.qcow2 () {
+    local img=$FUNCNAME
+    qemu-img convert -O qcow2 -o $QCOW2_OPTS vdisk_s05k.raw $img
+}
+
+vdisk_backing_mid_s05k.qcow2 () {
+    local img=$FUNCNAME
+    qemu-img create -f qcow2 -o $QCOW2_OPTS -b vdisk_s05k.qcow2 -F qcow2 \
+        $img > /dev/null
+    qemu-io -c "write -P 0x11 1M 1M" $img > /dev/null
+}
+
+vdisk_backing_top_s05k.qcow2 () {
+    local img=$FUNCNAME
+    qemu-img create -f qcow2 -o $QCOW2_OPTS -b vdisk_backing_mid_s05k.qcow2 \
+        -F qcow2 $img > /dev/null
+    qemu-io -c "write -P 0x22 1536K 1M" -c "write -z 4M 1M" $img > /dev/null
+}
+
+vdisk_zlib_s05k.qcow2 () {
+    local img=$FUNCNAME
+    qemu-img convert -c -O qcow2 -o $QCOW2_OPTS vdisk_s05k.raw $img
+}
+
+vdisk_zstd_s05k.qcow2 () {
+    local img=$FUNCNAME
+    qemu-img convert -c -O qcow2 -o ${QCOW2_OPTS/zlib/zstd} vdisk_s05k.raw \
+        $img
+}
+
+vdisk_s05k.raw.zst () {
+    local img=$FUNCNAME
+    $MKRAWZST -f 65536 vdisk_s05k.raw $img
+}
+
+vdisk_sparse_s05k.raw () {
+    local img=$FUNCNAME
+    truncate -s 8MiB $img
+    $MKFILEPATTERN $img 1048576 1048576
+    $MKFILEPATTERN $img 4194304 2097152
+    $MKFILEPATTERN $img 8384512 4096
+}
+
+vdisk_s05k.trace () {
+    local img=$FUNCNAME
+    python3 - $img <<'EOF'
+import struct, sys
+READ, WRITE, FLUSH, DISCARD = range(4)
+records = [(READ, 0, 8), (READ, 100, 64), (WRITE, 96, 16), (FLUSH, 0, 0),
+           (READ, 2048, 2048), (WRITE, 4000, 8), (DISCARD, 5000, 128),
+           (READ, 16380, 8), (WRITE, 20000, 1)]
+with open(sys.argv[1], "wb") as f:
+    f.write(b"UMKAIOTR" + struct.pack("<IIQQ", 1, 512, 16384, 0))
+    for i, (op, sector, cnt) in enumerate(records):
+        f.write(struct.pack("<QQIHBB", i * 1000000, sector, cnt, 0, op, 0))
+EOF
+}
+
+vdisk_discard_s05k.raw () {
+    local img=$FUNCNAME
+    truncate -s 8MiB $img
+}
+
+vdisk_readahead_s05k.raw () {
+    local img=$FUNCNAME
+    truncate -s 8MiB $img
+}
+
 images=(gpt_large.qcow2 gpt_partitions_s05k.qcow2 gpt_partitions_s4k.qcow2
         kolibri.raw jfs.qcow2 xfs_lookup_v4.qcow2 xfs_lookup_v5.qcow2
         xfs_nrext64.qcow2 xfs_bigtime.qcow2 xfs_borg_bit.qcow2
@@ -1097,7 +1176,12 @@ images=(gpt_large.qcow2 gpt_partitions_s05k.qcow2 gpt_partitions_s4k.qcow2
         xfs_v5_files_s05k_b4k_n8k.qcow2 fat32_test0.raw
         exfat_s05k_c16k_b16k.qcow2 exfat_s05k_c8k_b8k.qcow2
         xfs_samehash_s05k.raw ext2_s05k.qcow2 ext4_s05k.qcow2 fat12_s05k.qcow2
-        fat16_s05k.qcow2 iso9660_s2k_dir_all.qcow2)
+        fat16_s05k.qcow2 iso9660_s2k_dir_all.qcow2
+        vdisk_s05k.raw vdisk_empty_c4k.qcow2 vdisk_s05k.qcow2
+        vdisk_backing_mid_s05k.qcow2 vdisk_backing_top_s05k.qcow2
+        vdisk_zlib_s05k.qcow2 vdisk_zstd_s05k.qcow2 vdisk_s05k.raw.zst
+        vdisk_sparse_s05k.raw vdisk_s05k.trace vdisk_discard_s05k.raw
+        vdisk_readahead_s05k.raw)
 
 TEMP_DIR=$(mktemp -d)
 LOOP_DEV=$(losetup --find)
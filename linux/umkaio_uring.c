@@ -0,0 +1,291 @@
+/*
+    SPDX-License-Identifier: GPL-2.0-or-later
+
+    UMKa - User-Mode KolibriOS developer tools
+    io_uring - input/output platform specific code, io_uring backend
+
+    Copyright (C) 2023  Ivan Baravy <dunkaist@gmail.com>
+*/
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include "umkaio_uring.h"
+
+// Raw syscalls are used to avoid a dependency on liburing
+
+struct iou {
+    int fd;
+    unsigned sq_entries;
+    unsigned cq_entries;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    _Atomic unsigned *sq_head;
+    _Atomic unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    _Atomic unsigned *cq_head;
+    _Atomic unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    struct iovec fixed[IOU_MAX_FIXED_BUFFERS];
+    size_t fixed_cnt;
+};
+
+static int
+iou_sys_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+iou_sys_enter(int fd, unsigned to_submit, unsigned min_complete,
+              unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                        flags, NULL, 0);
+}
+
+static int
+iou_sys_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+struct iou *
+iou_init(size_t entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = iou_sys_setup(entries, &p);
+    if (fd == -1) {
+        fprintf(stderr, "[io_uring] setup failed: %s\n", strerror(errno));
+        return NULL;
+    }
+    struct iou *iou = calloc(1, sizeof(struct iou));
+    if (!iou) {
+        close(fd);
+        return NULL;
+    }
+    iou->fd = fd;
+    iou->sq_entries = p.sq_entries;
+    iou->cq_entries = p.cq_entries;
+    iou->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    iou->cq_ring_size = p.cq_off.cqes
+                        + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (iou->cq_ring_size > iou->sq_ring_size) {
+            iou->sq_ring_size = iou->cq_ring_size;
+        }
+        iou->cq_ring_size = iou->sq_ring_size;
+    }
+    iou->sq_ring = mmap(NULL, iou->sq_ring_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (iou->sq_ring == MAP_FAILED) {
+        fprintf(stderr, "[io_uring] can't map sq ring: %s\n", strerror(errno));
+        close(fd);
+        free(iou);
+        return NULL;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        iou->cq_ring = iou->sq_ring;
+    } else {
+        iou->cq_ring = mmap(NULL, iou->cq_ring_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (iou->cq_ring == MAP_FAILED) {
+            fprintf(stderr, "[io_uring] can't map cq ring: %s\n",
+                    strerror(errno));
+            munmap(iou->sq_ring, iou->sq_ring_size);
+            close(fd);
+            free(iou);
+            return NULL;
+        }
+    }
+    iou->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                     IORING_OFF_SQES);
+    if (iou->sqes == MAP_FAILED) {
+        fprintf(stderr, "[io_uring] can't map sqes: %s\n", strerror(errno));
+        if (iou->cq_ring != iou->sq_ring) {
+            munmap(iou->cq_ring, iou->cq_ring_size);
+        }
+        munmap(iou->sq_ring, iou->sq_ring_size);
+        close(fd);
+        free(iou);
+        return NULL;
+    }
+    uint8_t *sq = iou->sq_ring;
+    uint8_t *cq = iou->cq_ring;
+    iou->sq_head = (_Atomic unsigned*)(sq + p.sq_off.head);
+    iou->sq_tail = (_Atomic unsigned*)(sq + p.sq_off.tail);
+    iou->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    iou->sq_array = (unsigned*)(sq + p.sq_off.array);
+    iou->cq_head = (_Atomic unsigned*)(cq + p.cq_off.head);
+    iou->cq_tail = (_Atomic unsigned*)(cq + p.cq_off.tail);
+    iou->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    iou->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    return iou;
+}
+
+void
+iou_close(struct iou *iou) {
+    munmap(iou->sqes, iou->sq_entries * sizeof(struct io_uring_sqe));
+    if (iou->cq_ring != iou->sq_ring) {
+        munmap(iou->cq_ring, iou->cq_ring_size);
+    }
+    munmap(iou->sq_ring, iou->sq_ring_size);
+    close(iou->fd);
+    free(iou);
+}
+
+// Replaces the registered table with fixed[0..cnt), the previous table stays
+// registered if the new one can't be
+static int
+iou_set_buffers(struct iou *iou, const struct iovec *fixed, size_t cnt) {
+    // the table is small and only changes when a disk is added or removed
+    if (iou->fixed_cnt) {
+        iou_sys_register(iou->fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+    }
+    if (cnt && iou_sys_register(iou->fd, IORING_REGISTER_BUFFERS,
+                                (void*)(uintptr_t)fixed, cnt)) {
+        int err = errno;
+        fprintf(stderr, "[io_uring] can't register buffers: %s\n",
+                strerror(err));
+        if (iou->fixed_cnt && iou_sys_register(iou->fd,
+                                               IORING_REGISTER_BUFFERS,
+                                               iou->fixed, iou->fixed_cnt)) {
+            fprintf(stderr, "[io_uring] can't restore registered buffers:"
+                    " %s\n", strerror(errno));
+            iou->fixed_cnt = 0;
+        }
+        errno = err;
+        return -1;
+    }
+    memmove(iou->fixed, fixed, cnt * sizeof(struct iovec));
+    iou->fixed_cnt = cnt;
+    return 0;
+}
+
+int
+iou_register_buffer(struct iou *iou, void *buf, size_t len) {
+    if (iou->fixed_cnt == IOU_MAX_FIXED_BUFFERS) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    struct iovec fixed[IOU_MAX_FIXED_BUFFERS];
+    memcpy(fixed, iou->fixed, iou->fixed_cnt * sizeof(struct iovec));
+    fixed[iou->fixed_cnt] = (struct iovec){.iov_base = buf, .iov_len = len};
+    return iou_set_buffers(iou, fixed, iou->fixed_cnt + 1);
+}
+
+int
+iou_unregister_buffer(struct iou *iou, void *buf) {
+    for (size_t i = 0; i < iou->fixed_cnt; i++) {
+        if (iou->fixed[i].iov_base == buf) {
+            struct iovec fixed[IOU_MAX_FIXED_BUFFERS];
+            memcpy(fixed, iou->fixed, i * sizeof(struct iovec));
+            memcpy(fixed + i, iou->fixed + i + 1,
+                   (iou->fixed_cnt - i - 1) * sizeof(struct iovec));
+            if (iou_set_buffers(iou, fixed, iou->fixed_cnt - 1)) {
+                // the buffer is about to be freed, it can't stay registered
+                iou_sys_register(iou->fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+                iou->fixed_cnt = 0;
+                return -1;
+            }
+            return 0;
+        }
+    }
+    return 0;
+}
+
+static int
+iou_find_fixed(const struct iou *iou, const void *buf, size_t count) {
+    const uint8_t *b = buf;
+    for (size_t i = 0; i < iou->fixed_cnt; i++) {
+        const uint8_t *base = iou->fixed[i].iov_base;
+        if (b >= base && b + count <= base + iou->fixed[i].iov_len) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void
+iou_prep(struct iou *iou, int op, int fd, void *buf, size_t count,
+         off_t offset, uint64_t tag) {
+    unsigned tail = atomic_load_explicit(iou->sq_tail, memory_order_relaxed);
+    unsigned idx = tail & *iou->sq_mask;
+    struct io_uring_sqe *sqe = iou->sqes + idx;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = fd;
+    sqe->user_data = tag;
+    if (op == IOU_OP_FSYNC) {
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    } else {
+        int buf_index = iou_find_fixed(iou, buf, count);
+        if (buf_index != -1) {
+            sqe->opcode = op == IOU_OP_WRITE ? IORING_OP_WRITE_FIXED
+                                             : IORING_OP_READ_FIXED;
+            sqe->buf_index = buf_index;
+        } else {
+            sqe->opcode = op == IOU_OP_WRITE ? IORING_OP_WRITE : IORING_OP_READ;
+        }
+        sqe->addr = (uintptr_t)buf;
+        sqe->len = count;
+        sqe->off = offset;
+    }
+    iou->sq_array[idx] = idx;
+    atomic_store_explicit(iou->sq_tail, tail + 1, memory_order_release);
+}
+
+int
+iou_submit(struct iou *iou) {
+    unsigned tail = atomic_load_explicit(iou->sq_tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(iou->sq_head, memory_order_acquire);
+    unsigned to_submit = tail - head;
+    if (!to_submit) {
+        return 0;
+    }
+    int ret;
+    do {
+        ret = iou_sys_enter(iou->fd, to_submit, 0, 0);
+        if (ret > 0) {
+            to_submit -= ret;
+        }
+    } while (to_submit && (ret > 0 || (ret == -1 && errno == EINTR)));
+    if (to_submit) {
+        if (ret != -1) {
+            errno = EAGAIN;
+        }
+        return -1;
+    }
+    return 0;
+}
+
+size_t
+iou_discard(struct iou *iou) {
+    unsigned tail = atomic_load_explicit(iou->sq_tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(iou->sq_head, memory_order_acquire);
+    atomic_store_explicit(iou->sq_tail, head, memory_order_release);
+    return tail - head;
+}
+
+size_t
+iou_reap(struct iou *iou, iou_complete_t complete, void *arg) {
+    unsigned head = atomic_load_explicit(iou->cq_head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(iou->cq_tail, memory_order_acquire);
+    size_t cnt = 0;
+    for (; head != tail; head++, cnt++) {
+        struct io_uring_cqe *cqe = iou->cqes + (head & *iou->cq_mask);
+        complete(arg, cqe->user_data, cqe->res);
+    }
+    atomic_store_explicit(iou->cq_head, head, memory_order_release);
+    return cnt;
+}
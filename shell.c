@@ -32,6 +32,9 @@
 
 #include "shell.h"
 #include "vdisk.h"
+#include "vdisk/block_cache.h"
+#include "vdisk/iotrace.h"
+#include "vdisk/throttle.h"
 #include "vnet.h"
 #include "umka.h"
 #include "trace.h"
@@ -766,22 +769,107 @@ cmd_disk_add(struct shell_ctx *ctx, int argc, char **argv) {
         "usage: disk_add <file> <name> [option]...\n"
         "  <file>           absolute or relative path\n"
         "  <name>           disk name, e.g. hd0 or rd\n"
-        "  -c cache size    size of disk cache in bytes\n";
+        "  -c cache size    size of disk cache in bytes\n"
+        "  -C               resize disk cache on media change to fit the\n"
+        "                   working set, up to -c bytes if given\n"
+        "  -a bytes         read ahead sequential streams in the background,\n"
+        "                   windows up to this many bytes\n"
+        "  -A               read ahead with the default window of the format\n"
+        "  -m               map raw image into memory, read-only\n"
+        "  -w               keep writes in memory, discard them on close\n"
+        "  -W               write to the image, it is read-only otherwise\n"
+        "  -b bytes         keep up to this many bytes of writes to the image\n"
+        "                   in memory until flush\n"
+        "  -d delta file    keep writes in a sparse file, remove it on close\n"
+        "  -l l2 tables     number of qcow2 L2 tables to cache\n"
+        "  -k clusters      number of qcow2 standard clusters to cache\n"
+        "  -z clusters      number of qcow2 compressed clusters or .zst\n"
+        "                   frames to cache\n"
+        "  -e policy        qcow2 and .zst cache eviction policy: lru, clock\n"
+        "  -j threads       number of threads inflating qcow2 clusters or\n"
+        "                   .zst frames\n"
+        "  -t trace file    record requests to the disk, see disk_replay\n"
+        "  -p device        model latency and bandwidth of a device: hdd, ssd;\n"
+        "                   -L, -S and -B that follow override its values\n"
+        "  -L us            modelled latency of every request\n"
+        "  -S us            modelled seek, the request doesn't continue the\n"
+        "                   previous one\n"
+        "  -B bytes/s       modelled bandwidth\n";
     if (argc < 3) {
         fputs(usage, ctx->fout);
         return;
     }
-    size_t cache_size = 0;
-    int adjust_cache_size = 0;
+    struct vdisk_params params = {0};
     int opt;
     optparse_init(&ctx->opts, argv);
     const char *file_name = optparse_arg(&ctx->opts);
     const char *disk_name = optparse_arg(&ctx->opts);
-    while ((opt = optparse(&ctx->opts, "c:")) != -1) {
+    while ((opt = optparse(&ctx->opts, "a:Ab:B:c:Cd:e:j:k:l:L:mp:S:t:wWz:")) != -1) {
         switch (opt) {
+        case 'a':
+            params.flags |= VDISK_READAHEAD;
+            params.readahead_max = strtoul(ctx->opts.optarg, NULL, 0);
+            break;
+        case 'A':
+            params.flags |= VDISK_READAHEAD;
+            break;
+        case 'b':
+            params.writeback_size = strtoul(ctx->opts.optarg, NULL, 0);
+            break;
+        case 'B':
+            params.bandwidth = strtoull(ctx->opts.optarg, NULL, 0);
+            break;
         case 'c':
-            cache_size = strtoul(ctx->opts.optarg, NULL, 0);
-            adjust_cache_size = 1;
+            params.cache_size = strtoul(ctx->opts.optarg, NULL, 0);
+            params.adjust_cache_size = 1;
+            break;
+        case 'C':
+            params.flags |= VDISK_ADAPTIVE_CACHE;
+            break;
+        case 'd':
+            params.delta_fname = ctx->opts.optarg;
+            params.flags |= VDISK_OVERLAY;
+            break;
+        case 'e':
+            params.qcow2_cache_policy = ctx->opts.optarg;
+            break;
+        case 'j':
+            params.qcow2_inflate_thread_cnt = strtoul(ctx->opts.optarg, NULL,
+                                                      0);
+            break;
+        case 'k':
+            params.qcow2_std_cache_size = strtoul(ctx->opts.optarg, NULL, 0);
+            break;
+        case 'l':
+            params.qcow2_l2_cache_size = strtoul(ctx->opts.optarg, NULL, 0);
+            break;
+        case 'L':
+            params.latency_us = strtoul(ctx->opts.optarg, NULL, 0);
+            break;
+        case 'm':
+            params.flags |= VDISK_MMAP;
+            break;
+        case 'p':
+            if (vdisk_throttle_preset(ctx->opts.optarg, &params)) {
+                fprintf(ctx->fout, "umka: unknown device '%s'\n",
+                        ctx->opts.optarg);
+                return;
+            }
+            break;
+        case 'S':
+            params.seek_us = strtoul(ctx->opts.optarg, NULL, 0);
+            break;
+        case 't':
+            params.trace_fname = ctx->opts.optarg;
+            break;
+        case 'w':
+            params.flags |= VDISK_OVERLAY;
+            break;
+        case 'W':
+            params.flags |= VDISK_WRITABLE;
+            break;
+        case 'z':
+            params.qcow2_cmp_cache_size = strtoul(ctx->opts.optarg, NULL, 0);
             break;
         default:
             fputs(usage, ctx->fout);
@@ -789,8 +877,7 @@ cmd_disk_add(struct shell_ctx *ctx, int argc, char **argv) {
         }
     }
 
-    struct vdisk *umka_disk = vdisk_init(file_name, adjust_cache_size,
-                                         cache_size, ctx->io);
+    struct vdisk *umka_disk = vdisk_init(file_name, &params, ctx->io);
     if (umka_disk) {
         COVERAGE_ON();
         disk_t *disk = disk_add(&umka_disk->diskfunc, disk_name, umka_disk, 0);
@@ -835,6 +922,361 @@ cmd_disk_del(struct shell_ctx *ctx, int argc, char **argv) {
     return;
 }
 
+// Disks added with disk_add have their vdisk as userdata, and the vdisk
+// starts with its diskfunc
+static struct vdisk *
+shell_find_vdisk(struct shell_ctx *ctx, const char *name) {
+    for(disk_t *d = disk_list.next; d != &disk_list; d = d->next) {
+        if (!strcmp(d->name, name)) {
+            if (d->userdata != (void*)d->functions) {
+                fprintf(ctx->fout, "umka: disk '%s' isn't a vdisk\n", name);
+                return NULL;
+            }
+            return d->userdata;
+        }
+    }
+    fprintf(ctx->fout, "umka: can't find disk '%s'\n", name);
+    return NULL;
+}
+
+static void
+cmd_disk_extents(struct shell_ctx *ctx, int argc, char **argv) {
+    const char *usage = \
+        "usage: disk_extents <name>\n"
+        "  name             disk name, i.e. rd or hd0\n";
+    if (argc != 2) {
+        fputs(usage, ctx->fout);
+        return;
+    }
+    struct vdisk *disk = shell_find_vdisk(ctx, argv[1]);
+    if (!disk) {
+        return;
+    }
+    uint64_t sector = 0;
+    while (sector < disk->sect_cnt) {
+        uint64_t cnt = disk->sect_cnt - sector;
+        int status = 1;
+        if (disk->block_status) {
+            status = disk->block_status(disk, sector, &cnt);
+        }
+        if (status == -1 || !cnt) {
+            fprintf(ctx->fout, "umka: can't get status of sector %" PRIu64
+                    "\n", sector);
+            return;
+        }
+        fprintf(ctx->fout, "%" PRIu64 " +%" PRIu64 " %s\n", sector, cnt,
+                status ? "data" : "hole");
+        sector += cnt;
+    }
+}
+
+static void
+cmd_disk_discard(struct shell_ctx *ctx, int argc, char **argv) {
+    const char *usage = \
+        "usage: disk_discard <name> <sector> <count>\n"
+        "  name             disk name, i.e. rd or hd0\n"
+        "  sector           first sector of the range\n"
+        "  count            number of sectors to free in the image\n";
+    if (argc != 4) {
+        fputs(usage, ctx->fout);
+        return;
+    }
+    struct vdisk *disk = shell_find_vdisk(ctx, argv[1]);
+    if (!disk) {
+        return;
+    }
+    uint64_t sector = strtoull(argv[2], NULL, 0);
+    uint64_t cnt = strtoull(argv[3], NULL, 0);
+    if (!disk->discard) {
+        fprintf(ctx->fout, "umka: disk '%s' can't discard sectors\n",
+                argv[1]);
+        return;
+    }
+    int status = disk->discard(disk, sector, cnt);
+    if (status != KOS_ERROR_SUCCESS) {
+        fprintf(ctx->fout, "umka: can't discard sectors: %d\n", status);
+    }
+}
+
+static void
+cmd_disk_read(struct shell_ctx *ctx, int argc, char **argv) {
+    const char *usage = \
+        "usage: disk_read <name> <sector> <count> [-b] [-h]\n"
+        "  name             disk name, i.e. rd or hd0\n"
+        "  sector           first sector to read\n"
+        "  count            number of sectors\n"
+        "  -b               dump bytes in hex\n"
+        "  -h               print hash of data read\n";
+    if (argc < 4) {
+        fputs(usage, ctx->fout);
+        return;
+    }
+    bool dump_bytes = false, dump_hash = false;
+    for (int opt = 4; opt < argc; opt++) {
+        if (!strcmp(argv[opt], "-b")) {
+            dump_bytes = true;
+        } else if (!strcmp(argv[opt], "-h")) {
+            dump_hash = true;
+        } else {
+            fprintf(ctx->fout, "invalid option: '%s'\n", argv[opt]);
+            return;
+        }
+    }
+    struct vdisk *disk = shell_find_vdisk(ctx, argv[1]);
+    if (!disk) {
+        return;
+    }
+    uint64_t sector = strtoull(argv[2], NULL, 0);
+    size_t cnt = strtoull(argv[3], NULL, 0);
+    uint8_t *buf = malloc(cnt * disk->sect_size);
+    if (!buf) {
+        fprintf(ctx->fout, "umka: can't allocate memory\n");
+        return;
+    }
+    // the disk switches coverage on when it returns
+    int status = disk->diskfunc.read(disk, buf, sector, &cnt);
+    COVERAGE_OFF();
+    if (status != KOS_ERROR_SUCCESS) {
+        fprintf(ctx->fout, "umka: can't read sectors: %d\n", status);
+    } else {
+        if (dump_bytes) {
+            print_bytes(ctx, buf, cnt * disk->sect_size);
+        }
+        if (dump_hash) {
+            print_hash(ctx, buf, cnt * disk->sect_size);
+        }
+    }
+    free(buf);
+}
+
+static void
+cmd_disk_write(struct shell_ctx *ctx, int argc, char **argv) {
+    const char *usage = \
+        "usage: disk_write <name> <sector> <count> <byte>\n"
+        "  name             disk name, i.e. rd or hd0\n"
+        "  sector           first sector to write\n"
+        "  count            number of sectors\n"
+        "  byte             value every byte of the sectors is set to\n";
+    if (argc != 5) {
+        fputs(usage, ctx->fout);
+        return;
+    }
+    struct vdisk *disk = shell_find_vdisk(ctx, argv[1]);
+    if (!disk) {
+        return;
+    }
+    uint64_t sector = strtoull(argv[2], NULL, 0);
+    size_t cnt = strtoull(argv[3], NULL, 0);
+    uint8_t *buf = malloc(cnt * disk->sect_size);
+    if (!buf) {
+        fprintf(ctx->fout, "umka: can't allocate memory\n");
+        return;
+    }
+    memset(buf, strtoul(argv[4], NULL, 0), cnt * disk->sect_size);
+    // the disk switches coverage on when it returns
+    int status = disk->diskfunc.write(disk, buf, sector, &cnt);
+    COVERAGE_OFF();
+    if (status != KOS_ERROR_SUCCESS) {
+        fprintf(ctx->fout, "umka: can't write sectors: %d\n", status);
+    }
+    free(buf);
+}
+
+// Sizes are in binary units, times are in microseconds
+static void
+print_io_hist(struct shell_ctx *ctx, const char *name, const uint64_t *hist,
+              int size) {
+    static const char *const size_units[] = {"B", "KiB", "MiB", "GiB"};
+    for (unsigned i = 0; i < VDISK_STATS_HIST_SIZE; i++) {
+        if (!hist[i]) {
+            continue;
+        }
+        int last = i + 1 == VDISK_STATS_HIST_SIZE;
+        unsigned log = last ? i - 1 : i;
+        uint64_t bound = (uint64_t)1 << (size ? log % 10 : log);
+        fprintf(ctx->fout, "  %s %s%" PRIu64 " %s: %" PRIu64 "\n", name,
+                last ? ">" : "<=", bound, size ? size_units[log / 10] : "us",
+                hist[i]);
+    }
+}
+
+static void
+print_io_stats(struct shell_ctx *ctx, const char *name,
+               const struct vdisk_io_stats *s) {
+    fprintf(ctx->fout, "%s: %" PRIu64 " requests, %" PRIu64 " errors, %"
+            PRIu64 " sectors", name, s->cnt, s->errors, s->sectors);
+    if (!ctx->reproducible) {
+        fprintf(ctx->fout, ", %" PRIu64 " us", s->time_ns / 1000);
+    }
+    fputc('\n', ctx->fout);
+    print_io_hist(ctx, "size", s->size_hist, 1);
+    if (!ctx->reproducible) {
+        print_io_hist(ctx, "time", s->time_hist, 0);
+    }
+}
+
+static void
+cmd_disk_stats(struct shell_ctx *ctx, int argc, char **argv) {
+    const char *usage = \
+        "usage: disk_stats [-r] <name>\n"
+        "  name             disk name, i.e. rd or hd0\n"
+        "  -r               reset the counters\n";
+    if (argc < 2 || argc > 3) {
+        fputs(usage, ctx->fout);
+        return;
+    }
+    int reset = 0;
+    int opt;
+    optparse_init(&ctx->opts, argv);
+    while ((opt = optparse(&ctx->opts, "r")) != -1) {
+        switch (opt) {
+        case 'r':
+            reset = 1;
+            break;
+        default:
+            fputs(usage, ctx->fout);
+            return;
+        }
+    }
+    const char *name = optparse_arg(&ctx->opts);
+    if (!name) {
+        fputs(usage, ctx->fout);
+        return;
+    }
+    struct vdisk *disk = shell_find_vdisk(ctx, name);
+    if (!disk) {
+        return;
+    }
+    if (reset) {
+        disk->stats = (struct vdisk_stats){0};
+        for (size_t i = 0; i < VDISK_CACHES_MAX; i++) {
+            if (disk->caches[i].name) {
+                *disk->caches[i].stats = (struct cluster_cache_stats){0};
+            }
+        }
+        if (disk->working_set) {
+            working_set_reset(disk->working_set);
+        }
+    }
+    const struct vdisk_stats *s = &disk->stats;
+    print_io_stats(ctx, "read", &s->read);
+    print_io_stats(ctx, "write", &s->write);
+    fprintf(ctx->fout, "flush: %" PRIu64 " requests, %" PRIu64 " errors",
+            s->flush_cnt, s->flush_errors);
+    if (!ctx->reproducible) {
+        fprintf(ctx->fout, ", %" PRIu64 " us", s->flush_time_ns / 1000);
+    }
+    fputc('\n', ctx->fout);
+    if (disk->latency_us || disk->seek_us || disk->bandwidth) {
+        fprintf(ctx->fout, "throttle: %" PRIu32 " us latency, %" PRIu32
+                " us seek, %" PRIu64 " bytes/s\n", disk->latency_us,
+                disk->seek_us, disk->bandwidth);
+    }
+    for (size_t i = 0; i < VDISK_CACHES_MAX; i++) {
+        const struct vdisk_cache *c = disk->caches + i;
+        if (c->name) {
+            fprintf(ctx->fout, "%s cache: %" PRIu64 " hits, %" PRIu64
+                    " misses, %" PRIu64 " evictions\n", c->name,
+                    c->stats->hits, c->stats->misses, c->stats->evictions);
+        }
+    }
+    if (disk->working_set) {
+        fprintf(ctx->fout, "cache: %zu bytes, %zu recommended\n",
+                disk->kernel_cache_size,
+                working_set_recommend(disk->working_set,
+                                      disk->kernel_cache_size,
+                                      disk->sect_size));
+    }
+}
+
+static void
+cmd_disk_replay(struct shell_ctx *ctx, int argc, char **argv) {
+    const char *usage = \
+        "usage: disk_replay [-t] <name> <trace>\n"
+        "  name             disk name, i.e. rd or hd0\n"
+        "  trace            file recorded by disk_add -t\n"
+        "  -t               keep the recorded timing, as fast as possible\n"
+        "                   otherwise\n"
+        "note: recorded writes put zeroes to the disk, add it with -w\n";
+    if (argc < 3 || argc > 4) {
+        fputs(usage, ctx->fout);
+        return;
+    }
+    int timed = 0;
+    int opt;
+    optparse_init(&ctx->opts, argv);
+    while ((opt = optparse(&ctx->opts, "t")) != -1) {
+        switch (opt) {
+        case 't':
+            timed = 1;
+            break;
+        default:
+            fputs(usage, ctx->fout);
+            return;
+        }
+    }
+    const char *name = optparse_arg(&ctx->opts);
+    const char *trace_fname = optparse_arg(&ctx->opts);
+    if (!name || !trace_fname) {
+        fputs(usage, ctx->fout);
+        return;
+    }
+    struct vdisk *disk = shell_find_vdisk(ctx, name);
+    if (!disk) {
+        return;
+    }
+    struct iotrace_replay_stats s;
+    if (iotrace_replay(disk, trace_fname, timed, &s)) {
+        fprintf(ctx->fout, "umka: can't replay trace '%s'\n", trace_fname);
+        return;
+    }
+    fprintf(ctx->fout, "%" PRIu64 " requests, %" PRIu64 " errors, %" PRIu64
+            " skipped, %" PRIu64 " bytes", s.cnt, s.errors, s.skipped,
+            s.bytes);
+    if (!ctx->reproducible) {
+        uint64_t us = s.time_ns / 1000;
+        fprintf(ctx->fout, ", %" PRIu64 " us, %" PRIu64 " MiB/s", us,
+                us ? s.bytes * 1000000 / us / (1024*1024) : 0);
+    }
+    fputc('\n', ctx->fout);
+}
+
+static void
+cmd_disk_host_cache(struct shell_ctx *ctx, int argc, char **argv) {
+    const char *usage = \
+        "usage: disk_host_cache [-r] [size]\n"
+        "  size             host block cache size in MiB, shared by disks\n"
+        "                   added later, 0 disables it\n"
+        "  -r               reset hit, miss and eviction counters\n";
+    if (argc > 3) {
+        fputs(usage, ctx->fout);
+        return;
+    }
+    int opt;
+    optparse_init(&ctx->opts, argv);
+    while ((opt = optparse(&ctx->opts, "r")) != -1) {
+        switch (opt) {
+        case 'r':
+            block_cache_reset_stats();
+            break;
+        default:
+            fputs(usage, ctx->fout);
+            return;
+        }
+    }
+    const char *size = optparse_arg(&ctx->opts);
+    if (size && block_cache_set_size(strtoul(size, NULL, 0) << 20)) {
+        fprintf(ctx->fout, "umka: can't allocate host block cache\n");
+        return;
+    }
+    struct block_cache_stats stats;
+    block_cache_get_stats(&stats);
+    fprintf(ctx->fout, "size: %zu MiB\n", block_cache_get_size() >> 20);
+    fprintf(ctx->fout, "hits: %" PRIu64 "\n", stats.hits);
+    fprintf(ctx->fout, "misses: %" PRIu64 "\n", stats.misses);
+    fprintf(ctx->fout, "evictions: %" PRIu64 "\n", stats.evictions);
+}
+
 static void
 cmd_pwd(struct shell_ctx *ctx, int argc, char **argv) {
     (void)ctx;
@@ -4098,6 +4540,13 @@ func_table_t cmd_cmds[] = {
     { "get_key",                        cmd_get_key },
     { "disk_add",                       cmd_disk_add },
     { "disk_del",                       cmd_disk_del },
+    { "disk_discard",                   cmd_disk_discard },
+    { "disk_extents",                   cmd_disk_extents },
+    { "disk_host_cache",                cmd_disk_host_cache },
+    { "disk_read",                      cmd_disk_read },
+    { "disk_replay",                    cmd_disk_replay },
+    { "disk_stats",                     cmd_disk_stats },
+    { "disk_write",                     cmd_disk_write },
     { "display_number",                 cmd_display_number },
     { "draw_line",                      cmd_draw_line },
     { "draw_rect",                      cmd_draw_rect },
@@ -0,0 +1,57 @@
+#!/bin/env python3
+#
+#   SPDX-License-Identifier: GPL-2.0-or-later
+#
+#   UMKa - User-Mode KolibriOS developer tools
+#   mkrawzst - compress a raw disk image into seekable .raw.zst one
+#
+#   Copyright (C) 2023  Ivan Baravy <dunkaist@gmail.com>
+
+# Every frame of the image is compressed by zstd tool independently, with a
+# content checksum. The seek table of the zstd seekable format is appended, its
+# entries have no checksums.
+
+import argparse
+import struct
+import subprocess
+import sys
+
+SKIPPABLE_MAGIC = 0x184d2a5e
+SEEKABLE_MAGIC = 0x8f92eab1
+FOOTER_SIZE = 9
+
+def compress(data, level):
+    return subprocess.run(["zstd", "-q", "-c", f"-{level}"], input=data,
+                          stdout=subprocess.PIPE, check=True).stdout
+
+def main():
+    parser = argparse.ArgumentParser(description="Compress a raw disk image "
+                                     "into seekable .raw.zst one")
+    parser.add_argument("raw", help="raw image")
+    parser.add_argument("zst", help="compressed image, e.g. disk.raw.zst")
+    parser.add_argument("-f", "--frame-size", type=int, default=256 << 10,
+                        help="decompressed frame size, a multiple of 4096 "
+                        "(default: %(default)s)")
+    parser.add_argument("-l", "--level", type=int, default=19,
+                        help="zstd compression level (default: %(default)s)")
+    args = parser.parse_args()
+    if args.frame_size <= 0 or args.frame_size % 4096:
+        sys.exit("frame size must be a multiple of 4096")
+    entries = []
+    with open(args.raw, "rb") as fin, open(args.zst, "wb") as fout:
+        while True:
+            data = fin.read(args.frame_size)
+            if not data:
+                break
+            frame = compress(data, args.level)
+            fout.write(frame)
+            entries.append((len(frame), len(data)))
+        if not entries:
+            sys.exit("raw image is empty")
+        table = b"".join(struct.pack("<II", *e) for e in entries)
+        table += struct.pack("<IBI", len(entries), 0, SEEKABLE_MAGIC)
+        fout.write(struct.pack("<II", SKIPPABLE_MAGIC, len(table)))
+        fout.write(table)
+
+if __name__ == "__main__":
+    main()
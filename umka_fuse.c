@@ -36,7 +36,7 @@ static struct umka_fuse_ctx *
 umka_fuse_init(void) {
     struct umka_fuse_ctx *ctx = malloc(sizeof(struct umka_fuse_ctx));
     ctx->umka = umka_init(UMKA_RUNNING_NEVER);
-    ctx->io = io_init(&ctx->umka->running);
+    ctx->io = io_init(&ctx->umka->running, IO_BACKEND_THREAD, 0, 0);
     return ctx;
 }
 
@@ -170,7 +170,8 @@ main(int argc, char *argv[]) {
     struct umka_fuse_ctx *ctx = umka_fuse_init();
     umka_boot();
 
-    struct vdisk *umka_disk = vdisk_init(argv[2], 1, 0u, ctx->io);
+    struct vdisk_params params = {.adjust_cache_size = 1, .cache_size = 0u};
+    struct vdisk *umka_disk = vdisk_init(argv[2], &params, ctx->io);
     disk_t *disk = disk_add(&umka_disk->diskfunc, "hd0", umka_disk, 0);
     disk_media_changed(disk, 1);
     return fuse_main(argc-1, argv, &umka_oper, ctx);
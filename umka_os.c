@@ -55,11 +55,18 @@ hw_int_mouse(void *arg) {
 }
 
 struct umka_os_ctx *
-umka_os_init(FILE *fstartup, FILE *fboardlog) {
+umka_os_init(FILE *fstartup, FILE *fboardlog, int io_backend,
+             size_t io_queue_depth, size_t io_thread_cnt) {
     struct umka_os_ctx *ctx = malloc(sizeof(struct umka_os_ctx));
     ctx->fboardlog = fboardlog;
     ctx->umka = umka_init(UMKA_RUNNING_NOT_YET);
-    ctx->io = io_init(&ctx->umka->running);
+    ctx->io = io_init(&ctx->umka->running, io_backend, io_queue_depth,
+                      io_thread_cnt);
+    if (!ctx->io) {
+        umka_close(ctx->umka);
+        free(ctx);
+        return NULL;
+    }
     ctx->shell = shell_init(SHELL_LOG_NONREPRODUCIBLE, history_filename,
                             ctx->umka, ctx->io, fstartup);
     return ctx;
@@ -341,14 +348,31 @@ umka_thread_board(void) {
     }
 }
 
+static size_t
+parse_io_opt(const char *name, const char *str, size_t max) {
+    char *end;
+    errno = 0;
+    unsigned long long x = strtoull(str, &end, 0);
+    if (errno || end == str || *end || !x || x > max) {
+        fprintf(stderr, "[!] bad %s '%s', must be from 1 to %zu\n", name, str,
+                max);
+        exit(1);
+    }
+    return x;
+}
+
 int
 main(int argc, char *argv[]) {
     (void)argc;
     const char *usage = "umka_os [-i <infile>] [-o <outfile>]"
-                        " [-b <boardlog>] [-s <startupfile>] [-c covfile]\n";
+                        " [-b <boardlog>] [-s <startupfile>] [-c covfile]"
+                        " [-q <io_queue_depth>] [-t <io_thread_cnt>] [-u]\n";
 
     int coverage = 0;
     int show_display = 0;
+    int io_backend = IO_BACKEND_THREAD;
+    size_t io_queue_depth = IO_QUEUE_DEPTH_DEFAULT;
+    size_t io_thread_cnt = IO_THREAD_CNT_DEFAULT;
 
     umka_sti();
 
@@ -368,7 +392,7 @@ main(int argc, char *argv[]) {
     int opt;
     optparse_init(&options, argv);
 
-    while ((opt = optparse(&options, "b:c:di:o:s:")) != -1) {
+    while ((opt = optparse(&options, "b:c:di:o:q:s:t:u")) != -1) {
         switch (opt) {
         case 'b':
             boardlogfile = options.optarg;
@@ -386,9 +410,20 @@ main(int argc, char *argv[]) {
         case 'o':
             outfile = options.optarg;
             break;
+        case 'q':
+            io_queue_depth = parse_io_opt("i/o queue depth", options.optarg,
+                                          IO_QUEUE_DEPTH_MAX);
+            break;
         case 's':
             startupfile = options.optarg;
             break;
+        case 't':
+            io_thread_cnt = parse_io_opt("i/o thread count", options.optarg,
+                                         IO_THREAD_CNT_MAX);
+            break;
+        case 'u':
+            io_backend = IO_BACKEND_URING;
+            break;
         default:
             fprintf(stderr, "bad option: %c\n", opt);
             fputs(usage, stderr);
@@ -433,7 +468,12 @@ main(int argc, char *argv[]) {
         fboardlog = fout;
     }
 
-    os = umka_os_init(fstartup, fboardlog);
+    os = umka_os_init(fstartup, fboardlog, io_backend, io_queue_depth,
+                      io_thread_cnt);
+    if (!os) {
+        fprintf(stderr, "[!] can't start umka\n");
+        exit(1);
+    }
 
     struct sigaction sa;
     sa.sa_sigaction = irq0;
@@ -35,7 +35,7 @@ struct umka_shell_ctx *
 umka_shell_init(int reproducible, FILE *fin) {
     struct umka_shell_ctx *ctx = malloc(sizeof(struct umka_shell_ctx));
     ctx->umka = umka_init(UMKA_RUNNING_NEVER);
-    ctx->io = io_init(&ctx->umka->running);
+    ctx->io = io_init(&ctx->umka->running, IO_BACKEND_THREAD, 0, 0);
     ctx->shell = shell_init(reproducible, history_filename, ctx->umka, ctx->io,
                             fin);
     return ctx;
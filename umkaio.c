@@ -7,6 +7,8 @@
     Copyright (C) 2023  Ivan Baravy <dunkaist@gmail.com>
 */
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -15,8 +17,9 @@
 #include <inttypes.h>
 #include "umka.h"
 #include "umkaio.h"
+#include "umkaio_uring.h"
 
-#define IOT_QUEUE_DEPTH 1
+#define IOT_BATCH_MAX 16
 
 enum {
     IOT_CMD_STATUS_EMPTY,
@@ -27,16 +30,19 @@ enum {
 enum {
     IOT_CMD_READ,
     IOT_CMD_WRITE,
+    IOT_CMD_FSYNC,
 };
 
 struct iot_cmd_read_arg {
     int fd;
     void *buf;
     size_t count;
+    off_t offset;
 };
 
 struct iot_cmd_read_ret {
     ssize_t val;
+    int err;
 };
 
 union iot_cmd_read {
@@ -46,12 +52,14 @@ union iot_cmd_read {
 
 struct iot_cmd_write_arg {
     int fd;
-    void *buf;
+    const void *buf;
     size_t count;
+    off_t offset;
 };
 
 struct iot_cmd_write_ret {
     ssize_t val;
+    int err;
 };
 
 union iot_cmd_write {
@@ -60,9 +68,7 @@ union iot_cmd_write {
 };
 
 struct iot_cmd {
-    pthread_cond_t iot_cond;
-    pthread_mutex_t iot_mutex;
-    pthread_mutex_t mutex;
+    size_t tag;     // index in iot_queue.cmd_buf
     int type;
     atomic_int status;
     union {
@@ -71,128 +77,593 @@ struct iot_cmd {
     };
 };
 
-struct iot_cmd iot_cmd_buf[IOT_QUEUE_DEPTH];
+// Commands are claimed and submitted by kernel threads with the mutex held,
+// the mutex is taken in a wait test via trylock as kernel threads share one
+// host thread. With the thread backend workers pop tags from the submission
+// ring, with io_uring completions are reaped from the wait test. Every kernel
+// thread waits for completion of its own commands only.
+struct iot_queue {
+    int backend;
+    size_t depth;
+    size_t thread_cnt;
+    pthread_t *threads;
+    struct iou *iou;
+    struct iot_cmd *cmd_buf;
+    size_t *sq;         // tags of ready commands, depth entries
+    size_t sq_head;     // free-running, next to pop
+    size_t sq_tail;     // free-running, next to push
+    size_t next_tag;    // where to start looking for an empty command
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int stop;
+};
 
-static void *
-thread_io(void *arg) {
-    (void)arg;
-    for (size_t i = 0; i < IOT_QUEUE_DEPTH; i++) {
-        iot_cmd_buf[i].status = IOT_CMD_STATUS_EMPTY;
-        iot_cmd_buf[i].type = 0;
-        pthread_cond_init(&iot_cmd_buf[i].iot_cond, NULL);
-        pthread_mutex_init(&iot_cmd_buf[i].iot_mutex, NULL);
-        pthread_mutex_lock(&iot_cmd_buf[i].iot_mutex);
-        pthread_mutex_init(&iot_cmd_buf[i].mutex, NULL);
-    }
+struct iot_wait {
+    struct iot_queue *q;
+    int type;
+    const struct io_req *reqs;
+    struct iot_cmd *cmds[IOT_BATCH_MAX];
+    size_t want;
+    size_t got;
+};
 
-    struct iot_cmd *cmd = iot_cmd_buf;
+static void
+iot_cmd_exec(struct iot_cmd *cmd) {
     ssize_t ret;
+    switch (cmd->type) {
+    case IOT_CMD_READ:
+        ret = pread(cmd->read.arg.fd, cmd->read.arg.buf, cmd->read.arg.count,
+                    cmd->read.arg.offset);
+        cmd->read.ret.err = ret == -1 ? errno : 0;
+        cmd->read.ret.val = ret;
+        break;
+    case IOT_CMD_WRITE:
+        ret = pwrite(cmd->write.arg.fd, cmd->write.arg.buf,
+                     cmd->write.arg.count, cmd->write.arg.offset);
+        cmd->write.ret.err = ret == -1 ? errno : 0;
+        cmd->write.ret.val = ret;
+        break;
+    case IOT_CMD_FSYNC:
+        ret = fdatasync(cmd->write.arg.fd);
+        cmd->write.ret.err = ret == -1 ? errno : 0;
+        cmd->write.ret.val = ret;
+        break;
+    default:
+        break;
+    }
+}
+
+static void *
+thread_io(void *arg) {
+    struct iot_queue *q = arg;
+    pthread_mutex_lock(&q->mutex);
     while (1) {
-        pthread_cond_wait(&cmd->iot_cond, &cmd->iot_mutex);
-        // status must be ready
-        switch (cmd->type) {
-        case IOT_CMD_READ:
-            ret = read(cmd->read.arg.fd, cmd->read.arg.buf, cmd->read.arg.count);
-            cmd->read.ret.val = ret;
-            break;
-        case IOT_CMD_WRITE:
-            cmd->read.ret.val = write(cmd->read.arg.fd, cmd->read.arg.buf,
-                                      cmd->read.arg.count);
-            break;
-        default:
-            break;
+        while (q->sq_head == q->sq_tail && !q->stop) {
+            pthread_cond_wait(&q->cond, &q->mutex);
         }
-
-        atomic_store_explicit(&cmd->status, IOT_CMD_STATUS_DONE, memory_order_release);
+        if (q->sq_head == q->sq_tail) {
+            break;  // stop requested and nothing left to do
+        }
+        struct iot_cmd *cmd = q->cmd_buf + q->sq[q->sq_head++ % q->depth];
+        pthread_mutex_unlock(&q->mutex);
+        // status must be ready
+        iot_cmd_exec(cmd);
+        atomic_store_explicit(&cmd->status, IOT_CMD_STATUS_DONE,
+                              memory_order_release);
+        pthread_mutex_lock(&q->mutex);
     }
+    pthread_mutex_unlock(&q->mutex);
 
     return NULL;
 }
 
+static void
+iot_uring_complete(void *arg, uint64_t tag, int32_t res) {
+    struct iot_queue *q = arg;
+    struct iot_cmd *cmd = q->cmd_buf + tag;
+    // read and write ret have the same layout
+    cmd->read.ret.val = res < 0 ? -1 : res;
+    cmd->read.ret.err = res < 0 ? -res : 0;
+    atomic_store_explicit(&cmd->status, IOT_CMD_STATUS_DONE,
+                          memory_order_release);
+}
+
 static uint32_t
-io_async_submit_wait_test(void) {
-//    appdata_t *app;
-//    __asm__ __volatile__ ("":"=b"(app)::);
-//    struct io_uring_queue *q = app->wait_param;
-    int done = pthread_mutex_trylock(&iot_cmd_buf[0].mutex);
-    return done;
+io_async_lock_wait_test(void /* struct appdata * with wait_param is in ebx */) {
+    appdata_t *app;
+    __asm__ __volatile__ __inline__ ("":"=b"(app)::);
+    struct iot_queue *q = app->wait_param;
+    return !pthread_mutex_trylock(&q->mutex);
+}
+
+// Requests to the same file are ordered: a write doesn't overtake any
+// overlapping request submitted earlier and vice versa, fsync is a barrier
+// for all writes to the file
+static int
+iot_cmd_conflicts(const struct iot_cmd *cmd, int type,
+                  const struct io_req *req) {
+    if (cmd->read.arg.fd != req->fd
+        || (type == IOT_CMD_READ && cmd->type == IOT_CMD_READ)) {
+        return 0;
+    }
+    if (type == IOT_CMD_FSYNC || cmd->type == IOT_CMD_FSYNC) {
+        return type != IOT_CMD_READ && cmd->type != IOT_CMD_READ;
+    }
+    return cmd->read.arg.offset < req->offset + (off_t)req->count
+           && req->offset < cmd->read.arg.offset + (off_t)cmd->read.arg.count;
+}
+
+static int
+io_async_has_conflicts(struct iot_wait *w) {
+    struct iot_queue *q = w->q;
+    for (size_t i = 0; i < q->depth; i++) {
+        struct iot_cmd *cmd = q->cmd_buf + i;
+        if (atomic_load_explicit(&cmd->status, memory_order_acquire)
+            != IOT_CMD_STATUS_READY) {
+            continue;
+        }
+        for (size_t r = 0; r < w->want; r++) {
+            if (iot_cmd_conflicts(cmd, w->type, w->reqs + r)) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static uint32_t
+io_async_submit_wait_test(void /* struct appdata * with wait_param is in ebx */) {
+    appdata_t *app;
+    __asm__ __volatile__ __inline__ ("":"=b"(app)::);
+    struct iot_wait *w = app->wait_param;
+    struct iot_queue *q = w->q;
+    if (pthread_mutex_trylock(&q->mutex)) {
+        return 0;
+    }
+    if (q->backend == IO_BACKEND_URING) {
+        iou_reap(q->iou, iot_uring_complete, q);
+    }
+    if (io_async_has_conflicts(w)) {
+        pthread_mutex_unlock(&q->mutex);
+        return 0;
+    }
+    w->got = 0;
+    for (size_t i = 0; i < q->depth && w->got < w->want; i++) {
+        struct iot_cmd *cmd = q->cmd_buf + (q->next_tag + i) % q->depth;
+        if (atomic_load_explicit(&cmd->status, memory_order_acquire)
+            == IOT_CMD_STATUS_EMPTY) {
+            w->cmds[w->got++] = cmd;
+        }
+    }
+    if (!w->got) {
+        pthread_mutex_unlock(&q->mutex);
+        return 0;
+    }
+    q->next_tag = w->cmds[w->got-1]->tag + 1;
+    return 1;   // the mutex is unlocked by the submitter
 }
 
 static uint32_t
-io_async_complete_wait_test(void) {
-//    appdata_t *app;
-//    __asm__ __volatile__ ("":"=b"(app)::);
-//    struct io_uring_queue *q = app->wait_param;
-    int status = atomic_load_explicit(&iot_cmd_buf[0].status, memory_order_acquire);
-    return status == IOT_CMD_STATUS_DONE;
+io_async_complete_wait_test(void /* struct appdata * with wait_param is in ebx */) {
+    appdata_t *app;
+    __asm__ __volatile__ __inline__ ("":"=b"(app)::);
+    struct iot_wait *w = app->wait_param;
+    struct iot_queue *q = w->q;
+    // the ring is reaped under the mutex only, a thread preempted in the
+    // middle of reaping holds it
+    if (q->backend == IO_BACKEND_URING) {
+        if (pthread_mutex_trylock(&q->mutex)) {
+            return 0;
+        }
+        iou_reap(q->iou, iot_uring_complete, q);
+        pthread_mutex_unlock(&q->mutex);
+    }
+    for (size_t i = 0; i < w->got; i++) {
+        if (atomic_load_explicit(&w->cmds[i]->status, memory_order_acquire)
+            != IOT_CMD_STATUS_DONE) {
+            return 0;
+        }
+    }
+    return 1;
 }
 
-ssize_t
-io_async_read(int fd, void *buf, size_t count, void *arg) {
-    (void)arg;
-
-    kos_wait_events(io_async_submit_wait_test, NULL);
-    // status must be empty
-    struct iot_cmd *cmd = iot_cmd_buf;
-    cmd->type = IOT_CMD_READ;
-    cmd->read.arg.fd = fd;
-    cmd->read.arg.buf = buf;
-    cmd->read.arg.count = count;
-    atomic_store_explicit(&cmd->status, IOT_CMD_STATUS_READY, memory_order_release);
-    
-    pthread_cond_signal(&cmd->iot_cond);
-    kos_wait_events(io_async_complete_wait_test, NULL);
-
-    ssize_t res = cmd->read.ret.val;
-
-    atomic_store_explicit(&cmd->status, IOT_CMD_STATUS_EMPTY, memory_order_release);
-    pthread_mutex_unlock(&cmd->mutex);
+static void
+io_async_lock(const struct umka_io *io) {
+    if (*io->running == UMKA_RUNNING_YES) {
+        kos_wait_events(io_async_lock_wait_test, io->queue);
+    } else {
+        pthread_mutex_lock(&io->queue->mutex);
+    }
+}
 
-    return res;
+static void
+iot_cmd_prep_uring(struct iot_queue *q, struct iot_cmd *cmd) {
+    // read and write arg have the same layout
+    struct iot_cmd_read_arg *arg = &cmd->read.arg;
+    switch (cmd->type) {
+    case IOT_CMD_WRITE:
+        iou_prep(q->iou, IOU_OP_WRITE, arg->fd, arg->buf, arg->count,
+                 arg->offset, cmd->tag);
+        break;
+    case IOT_CMD_FSYNC:
+        iou_prep(q->iou, IOU_OP_FSYNC, arg->fd, NULL, 0, 0, cmd->tag);
+        break;
+    case IOT_CMD_READ:
+    default:
+        iou_prep(q->iou, IOU_OP_READ, arg->fd, arg->buf, arg->count,
+                 arg->offset, cmd->tag);
+        break;
+    }
 }
 
-ssize_t
-io_async_write(int fd, const void *buf, size_t count, void *arg) {
-    (void)fd;
-    (void)buf;
-    (void)count;
-    (void)arg;
-    return -1;
+// Queues the claimed commands and unlocks the mutex, doesn't wait
+static void
+io_async_post(struct iot_wait *w) {
+    struct iot_queue *q = w->q;
+    for (size_t i = 0; i < w->got; i++) {
+        struct iot_cmd *cmd = w->cmds[i];
+        atomic_store_explicit(&cmd->status, IOT_CMD_STATUS_READY,
+                              memory_order_release);
+        if (q->backend == IO_BACKEND_URING) {
+            iot_cmd_prep_uring(q, cmd);
+        } else {
+            q->sq[q->sq_tail++ % q->depth] = cmd->tag;
+        }
+    }
+    if (q->backend == IO_BACKEND_URING) {
+        if (iou_submit(q->iou) == -1) {
+            int err = errno;
+            // unconsumed entries are ours as the mutex is held
+            size_t failed = iou_discard(q->iou);
+            for (size_t i = w->got - failed; i < w->got; i++) {
+                iot_uring_complete(q, w->cmds[i]->tag, -err);
+            }
+        }
+    } else {
+        pthread_cond_broadcast(&q->cond);
+    }
+    pthread_mutex_unlock(&q->mutex);
+}
+
+// Claims commands for a prefix of reqs, fills and posts them. Returns with
+// the claimed commands in w, they are to be completed by io_async_finish.
+static void
+io_async_start(struct iot_wait *w, int type, struct io_req *reqs, size_t cnt) {
+    w->type = type;
+    w->reqs = reqs;
+    w->want = cnt < IOT_BATCH_MAX ? cnt : IOT_BATCH_MAX;
+    kos_wait_events(io_async_submit_wait_test, w);
+    // claimed commands' status must be empty, the mutex is locked
+    for (size_t i = 0; i < w->got; i++) {
+        struct iot_cmd *cmd = w->cmds[i];
+        cmd->type = type;
+        cmd->read.arg.fd = reqs[i].fd;
+        cmd->read.arg.buf = reqs[i].buf;
+        cmd->read.arg.count = reqs[i].count;
+        cmd->read.arg.offset = reqs[i].offset;
+    }
+    io_async_post(w);
+}
+
+// Waits for the commands of w and frees them, results go to reqs
+static void
+io_async_finish(struct iot_wait *w, struct io_req *reqs) {
+    kos_wait_events(io_async_complete_wait_test, w);
+    for (size_t i = 0; i < w->got; i++) {
+        struct iot_cmd *cmd = w->cmds[i];
+        reqs[i].res = cmd->read.ret.val;
+        reqs[i].err = cmd->read.ret.err;
+        atomic_store_explicit(&cmd->status, IOT_CMD_STATUS_EMPTY,
+                              memory_order_release);
+    }
+}
+
+static void
+io_async_rw_batch(int type, struct io_req *reqs, size_t cnt,
+                  struct iot_queue *q) {
+    struct iot_wait w = {.q = q};
+    while (cnt) {
+        io_async_start(&w, type, reqs, cnt);
+        io_async_finish(&w, reqs);
+        reqs += w.got;
+        cnt -= w.got;
+    }
+}
+
+static ssize_t
+io_async_read(int fd, void *buf, size_t count, off_t offset,
+              struct iot_queue *q) {
+    struct io_req req = {.fd = fd, .buf = buf, .count = count,
+                         .offset = offset};
+    io_async_rw_batch(IOT_CMD_READ, &req, 1, q);
+    if (req.res == -1) {
+        errno = req.err;
+    }
+    return req.res;
+}
+
+static ssize_t
+io_async_write(int fd, const void *buf, size_t count, off_t offset,
+               struct iot_queue *q) {
+    struct io_req req = {.fd = fd, .buf = (void*)(uintptr_t)buf,
+                         .count = count, .offset = offset};
+    io_async_rw_batch(IOT_CMD_WRITE, &req, 1, q);
+    if (req.res == -1) {
+        errno = req.err;
+    }
+    return req.res;
+}
+
+static int
+io_async_fsync(int fd, struct iot_queue *q) {
+    struct io_req req = {.fd = fd};
+    io_async_rw_batch(IOT_CMD_FSYNC, &req, 1, q);
+    if (req.res == -1) {
+        errno = req.err;
+    }
+    return req.res;
+}
+
+static void
+iot_queue_close(struct iot_queue *q);
+
+static struct iot_queue *
+iot_queue_init(int backend, size_t depth, size_t thread_cnt) {
+    struct iot_queue *q = calloc(1, sizeof(struct iot_queue));
+    if (!q) {
+        return NULL;
+    }
+    q->depth = depth ? depth : IO_QUEUE_DEPTH_DEFAULT;
+    q->cmd_buf = calloc(q->depth, sizeof(struct iot_cmd));
+    q->sq = calloc(q->depth, sizeof(size_t));
+    if (backend == IO_BACKEND_URING) {
+        q->iou = iou_init(q->depth);
+        if (!q->iou) {
+            fprintf(stderr, "[io] io_uring is not available,"
+                    " falling back to i/o threads\n");
+            backend = IO_BACKEND_THREAD;
+        }
+    }
+    q->backend = backend;
+    if (backend == IO_BACKEND_THREAD) {
+        q->thread_cnt = thread_cnt ? thread_cnt : IO_THREAD_CNT_DEFAULT;
+        q->threads = calloc(q->thread_cnt, sizeof(pthread_t));
+    }
+    if (!q->cmd_buf || !q->sq || (backend == IO_BACKEND_THREAD && !q->threads)) {
+        if (q->iou) {
+            iou_close(q->iou);
+        }
+        free(q->cmd_buf);
+        free(q->sq);
+        free(q->threads);
+        free(q);
+        return NULL;
+    }
+    for (size_t i = 0; i < q->depth; i++) {
+        q->cmd_buf[i].tag = i;
+        q->cmd_buf[i].status = IOT_CMD_STATUS_EMPTY;
+    }
+    pthread_mutex_init(&q->mutex, NULL);
+    pthread_cond_init(&q->cond, NULL);
+    for (size_t i = 0; i < q->thread_cnt; i++) {
+        int err = pthread_create(q->threads + i, NULL, thread_io, q);
+        if (err) {
+            fprintf(stderr, "[io] can't create i/o thread: %s\n",
+                    strerror(err));
+            // stop the ones already running
+            q->thread_cnt = i;
+            iot_queue_close(q);
+            return NULL;
+        }
+    }
+    return q;
+}
+
+static void
+iot_queue_close(struct iot_queue *q) {
+    pthread_mutex_lock(&q->mutex);
+    q->stop = 1;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->mutex);
+    for (size_t i = 0; i < q->thread_cnt; i++) {
+        pthread_join(q->threads[i], NULL);
+    }
+    if (q->iou) {
+        iou_close(q->iou);
+    }
+    pthread_cond_destroy(&q->cond);
+    pthread_mutex_destroy(&q->mutex);
+    free(q->threads);
+    free(q->sq);
+    free(q->cmd_buf);
+    free(q);
 }
 
 struct umka_io *
-io_init(atomic_int *running) {
+io_init(atomic_int *running, int backend, size_t queue_depth,
+        size_t thread_cnt) {
+    if (queue_depth > IO_QUEUE_DEPTH_MAX) {
+        fprintf(stderr, "[io] queue depth %zu is too big, max is %u\n",
+                queue_depth, IO_QUEUE_DEPTH_MAX);
+        return NULL;
+    }
+    if (thread_cnt > IO_THREAD_CNT_MAX) {
+        fprintf(stderr, "[io] %zu i/o threads are too many, max is %u\n",
+                thread_cnt, IO_THREAD_CNT_MAX);
+        return NULL;
+    }
     struct umka_io *io = malloc(sizeof(struct umka_io));
+    if (!io) {
+        fprintf(stderr, "[io] can't allocate memory\n");
+        return NULL;
+    }
     io->running = running;
-    if (running) {
-        pthread_create(&io->iot, NULL, thread_io, NULL);
+    io->queue = NULL;
+    if (*running != UMKA_RUNNING_NEVER) {
+        io->queue = iot_queue_init(backend, queue_depth, thread_cnt);
+        if (!io->queue) {
+            fprintf(stderr, "[io] can't start async i/o\n");
+            free(io);
+            return NULL;
+        }
     }
     return io;
 }
 
 void
 io_close(struct umka_io *io) {
+    if (io->queue) {
+        iot_queue_close(io->queue);
+    }
     free(io);
 }
 
+int
+io_register_buffer(const struct umka_io *io, void *buf, size_t len) {
+    if (!io->queue || io->queue->backend != IO_BACKEND_URING) {
+        return -1;
+    }
+    io_async_lock(io);
+    int ret = iou_register_buffer(io->queue->iou, buf, len);
+    pthread_mutex_unlock(&io->queue->mutex);
+    return ret;
+}
+
+int
+io_unregister_buffer(const struct umka_io *io, void *buf) {
+    if (!io->queue || io->queue->backend != IO_BACKEND_URING) {
+        return 0;
+    }
+    io_async_lock(io);
+    int ret = iou_unregister_buffer(io->queue->iou, buf);
+    pthread_mutex_unlock(&io->queue->mutex);
+    return ret;
+}
+
+static void
+io_sync_req(int type, struct io_req *req) {
+    if (type == IOT_CMD_WRITE) {
+        req->res = pwrite(req->fd, req->buf, req->count, req->offset);
+    } else {
+        req->res = pread(req->fd, req->buf, req->count, req->offset);
+    }
+    req->err = req->res == -1 ? errno : 0;
+}
+
 ssize_t
-io_read(int fd, void *buf, size_t count, const struct umka_io *io) {
+io_pread(int fd, void *buf, size_t count, off_t offset,
+         const struct umka_io *io) {
     ssize_t res;
-    if (*io->running < UMKA_RUNNING_YES) {
-        res = read(fd, buf, count);
+    if (*io->running < UMKA_RUNNING_YES || !io->queue) {
+        res = pread(fd, buf, count, offset);
     } else {
-        res = io_async_read(fd, buf, count, NULL);
+        res = io_async_read(fd, buf, count, offset, io->queue);
     }
     return res;
 }
 
+void
+io_pread_start(struct io_async *a, int fd, void *buf, size_t count,
+               off_t offset, const struct umka_io *io) {
+    a->req = (struct io_req){.fd = fd, .buf = buf, .count = count,
+                             .offset = offset};
+    a->cmd = NULL;
+    if (*io->running < UMKA_RUNNING_YES || !io->queue) {
+        io_sync_req(IOT_CMD_READ, &a->req);
+    } else {
+        struct iot_wait w = {.q = io->queue};
+        io_async_start(&w, IOT_CMD_READ, &a->req, 1);
+        a->cmd = w.cmds[0];
+    }
+}
+
+// The wait test reaps io_uring completions, so it is used to poll too
+int
+io_done(struct io_async *a, const struct umka_io *io) {
+    if (!a->cmd) {
+        return 1;
+    }
+    struct iot_queue *q = io->queue;
+    if (q->backend == IO_BACKEND_URING) {
+        io_async_lock(io);
+        iou_reap(q->iou, iot_uring_complete, q);
+        pthread_mutex_unlock(&q->mutex);
+    }
+    const struct iot_cmd *cmd = a->cmd;
+    return atomic_load_explicit(&cmd->status, memory_order_acquire)
+           == IOT_CMD_STATUS_DONE;
+}
+
 ssize_t
-io_write(int fd, const void *buf, size_t count, const struct umka_io *io) {
+io_wait(struct io_async *a, const struct umka_io *io) {
+    if (a->cmd) {
+        struct iot_wait w = {.q = io->queue, .got = 1, .cmds = {a->cmd}};
+        io_async_finish(&w, &a->req);
+        a->cmd = NULL;
+    }
+    if (a->req.res == -1) {
+        errno = a->req.err;
+    }
+    return a->req.res;
+}
+
+void
+io_pread_batch(struct io_req *reqs, size_t cnt, const struct umka_io *io) {
+    if (*io->running < UMKA_RUNNING_YES || !io->queue) {
+        for (size_t i = 0; i < cnt; i++) {
+            io_sync_req(IOT_CMD_READ, reqs + i);
+        }
+    } else {
+        io_async_rw_batch(IOT_CMD_READ, reqs, cnt, io->queue);
+    }
+}
+
+ssize_t
+io_pwrite(int fd, const void *buf, size_t count, off_t offset,
+          const struct umka_io *io) {
     ssize_t res;
-    if (*io->running < UMKA_RUNNING_YES) {
-        res = write(fd, buf, count);
+    if (*io->running < UMKA_RUNNING_YES || !io->queue) {
+        res = pwrite(fd, buf, count, offset);
     } else {
-        res = io_async_write(fd, buf, count, NULL);
+        res = io_async_write(fd, buf, count, offset, io->queue);
     }
     return res;
 }
+
+void
+io_pwrite_batch(struct io_req *reqs, size_t cnt, const struct umka_io *io) {
+    if (*io->running < UMKA_RUNNING_YES || !io->queue) {
+        for (size_t i = 0; i < cnt; i++) {
+            io_sync_req(IOT_CMD_WRITE, reqs + i);
+        }
+    } else {
+        io_async_rw_batch(IOT_CMD_WRITE, reqs, cnt, io->queue);
+    }
+}
+
+int
+io_fsync(int fd, const struct umka_io *io) {
+    int res;
+    if (*io->running < UMKA_RUNNING_YES || !io->queue) {
+        res = fdatasync(fd);
+    } else {
+        res = io_async_fsync(fd, io->queue);
+    }
+    return res;
+}
+
+// Freeing space is a metadata update, it isn't worth a trip to the i/o queue
+int
+io_punch_hole(int fd, off_t offset, off_t len, const struct umka_io *io) {
+    (void)io;
+#ifdef FALLOC_FL_PUNCH_HOLE
+    return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset,
+                     len);
+#else
+    (void)fd;
+    (void)offset;
+    (void)len;
+    errno = EOPNOTSUPP;
+    return -1;
+#endif
+}
@@ -13,26 +13,100 @@
 #include <stdatomic.h>
 #include <stddef.h>
 #include <pthread.h>
+#include <sys/types.h>
 
 #if !defined (O_BINARY)
 #define O_BINARY 0  // for Windows
 #endif
 
+#define IO_QUEUE_DEPTH_DEFAULT 32
+#define IO_QUEUE_DEPTH_MAX 4096
+#define IO_THREAD_CNT_DEFAULT 4
+#define IO_THREAD_CNT_MAX 256
+
+enum {
+    IO_BACKEND_THREAD,
+    IO_BACKEND_URING,
+};
+
+struct iot_queue;
+
+struct io_req {
+    int fd;
+    void *buf;
+    size_t count;
+    off_t offset;
+    ssize_t res;
+    int err;
+};
+
 struct umka_io {
     const atomic_int *running;
-    pthread_t iot;
+    struct iot_queue *queue;
 };
 
+// A read started by io_pread_start, it runs while the submitter goes on
+struct io_async {
+    struct io_req req;
+    void *cmd;      // of the queue, NULL if the request is complete
+};
+
+// Zero queue_depth or thread_cnt means default, returns NULL if they are too
+// big or the i/o threads can't be started
 struct umka_io *
-io_init(atomic_int *running);
+io_init(atomic_int *running, int backend, size_t queue_depth,
+        size_t thread_cnt);
 
 void
 io_close(struct umka_io *io);
 
+// Returns 0 or -1 if the buffer can't be registered, the buffer stays
+// registered until io_unregister_buffer; only io_uring backend makes use of
+// it, requests within the buffer are found by address
+int
+io_register_buffer(const struct umka_io *io, void *buf, size_t len);
+
+int
+io_unregister_buffer(const struct umka_io *io, void *buf);
+
 ssize_t
-io_read(int fd, void *buf, size_t count, const struct umka_io *io);
+io_pread(int fd, void *buf, size_t count, off_t offset,
+         const struct umka_io *io);
+
+// Submits the read and returns without waiting for it, buf must stay intact
+// until io_wait. When the kernel doesn't run, the read is done right away.
+void
+io_pread_start(struct io_async *a, int fd, void *buf, size_t count,
+               off_t offset, const struct umka_io *io);
+
+// Tells if a started request is complete, never waits
+int
+io_done(struct io_async *a, const struct umka_io *io);
+
+// Waits for a started request to complete, returns the same as io_pread
+ssize_t
+io_wait(struct io_async *a, const struct umka_io *io);
+
+// Submits all requests at once and waits for all of them to complete. The
+// batch is ordered after overlapping requests to the same file submitted
+// earlier, but requests of one batch run in any order, so a write batch
+// must not contain requests overlapping each other.
+void
+io_pread_batch(struct io_req *reqs, size_t cnt, const struct umka_io *io);
 
 ssize_t
-io_write(int fd, const void *buf, size_t count, const struct umka_io *io);
+io_pwrite(int fd, const void *buf, size_t count, off_t offset,
+          const struct umka_io *io);
+
+void
+io_pwrite_batch(struct io_req *reqs, size_t cnt, const struct umka_io *io);
+
+// Waits for all writes to fd submitted before and makes them durable
+int
+io_fsync(int fd, const struct umka_io *io);
+
+// Deallocates the range, it reads as zeroes then and the file size is kept
+int
+io_punch_hole(int fd, off_t offset, off_t len, const struct umka_io *io);
 
 #endif  // UMKAIO_H_INCLUDED
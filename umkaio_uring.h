@@ -0,0 +1,63 @@
+/*
+    SPDX-License-Identifier: GPL-2.0-or-later
+
+    UMKa - User-Mode KolibriOS developer tools
+    io_uring - input/output platform specific code, io_uring backend
+
+    Copyright (C) 2023  Ivan Baravy <dunkaist@gmail.com>
+*/
+
+#ifndef UMKAIO_URING_H_INCLUDED
+#define UMKAIO_URING_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define IOU_MAX_FIXED_BUFFERS 64
+
+enum {
+    IOU_OP_READ,
+    IOU_OP_WRITE,
+    IOU_OP_FSYNC,   // fdatasync, buf, count and offset are ignored
+};
+
+struct iou;
+
+typedef void (*iou_complete_t)(void *arg, uint64_t tag, int32_t res);
+
+// Returns NULL if io_uring is not available on the host
+struct iou *
+iou_init(size_t entries);
+
+void
+iou_close(struct iou *iou);
+
+// Returns 0 or -1 with errno set, the buffers registered before stay
+// registered on failure. Requests find their fixed buffer by address in
+// iou_prep, indices in the table change on every update. The caller must
+// serialize with iou_prep.
+int
+iou_register_buffer(struct iou *iou, void *buf, size_t len);
+
+int
+iou_unregister_buffer(struct iou *iou, void *buf);
+
+// Queues a positional request, fixed buffers are used automatically
+void
+iou_prep(struct iou *iou, int op, int fd, void *buf, size_t count,
+         off_t offset, uint64_t tag);
+
+// Submits all queued requests with a single syscall
+int
+iou_submit(struct iou *iou);
+
+// Drops queued requests the kernel refused to consume, returns their number
+size_t
+iou_discard(struct iou *iou);
+
+// Calls complete for every completion posted, never blocks
+size_t
+iou_reap(struct iou *iou, iou_complete_t complete, void *arg);
+
+#endif  // UMKAIO_URING_H_INCLUDED
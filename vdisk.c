@@ -13,11 +13,20 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "umka.h"
 #include "trace.h"
 #include "vdisk.h"
+#include "umkaio.h"
 #include "vdisk/raw.h"
 #include "vdisk/qcow2.h"
+#include "vdisk/zst.h"
+#include "vdisk/overlay.h"
+#include "vdisk/readahead.h"
+#include "vdisk/writeback.h"
+#include "vdisk/block_cache.h"
+#include "vdisk/iotrace.h"
+#include "vdisk/throttle.h"
 
 STDCALL int
 vdisk_querymedia(void *userdata, diskmediainfo_t *minfo) {
@@ -30,42 +39,257 @@ vdisk_querymedia(void *userdata, diskmediainfo_t *minfo) {
     return KOS_ERROR_SUCCESS;
 }
 
+// Called on media change, so an adaptive cache is resized to fit the working
+// set seen with the previous size
 STDCALL size_t
 vdisk_adjust_cache_size(void *userdata, size_t suggested_size) {
     struct vdisk *disk = userdata;
-    if (disk->adjust_cache_size) {
-        return disk->cache_size;
+    size_t size = disk->adjust_cache_size ? disk->cache_size : suggested_size;
+    if (disk->adaptive_cache_size && disk->working_set
+        && disk->kernel_cache_size) {
+        size_t recommended = working_set_recommend(disk->working_set,
+                                                   disk->kernel_cache_size,
+                                                   disk->sect_size);
+        if (!disk->adjust_cache_size || recommended < size) {
+            size = recommended;
+        }
+    }
+    if (disk->working_set) {
+        working_set_reset(disk->working_set);
+    }
+    disk->kernel_cache_size = size;
+    return size;
+}
+
+static uint64_t
+vdisk_time_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static unsigned
+vdisk_stats_bucket(uint64_t x) {
+    unsigned i = 0;
+    while (i + 1 < VDISK_STATS_HIST_SIZE && ((uint64_t)1 << i) < x) {
+        i++;
+    }
+    return i;
+}
+
+static void
+vdisk_stats_count(struct vdisk_io_stats *s, size_t bytes, size_t sectors,
+                  uint64_t time_ns, int status) {
+    s->cnt++;
+    s->errors += status != KOS_ERROR_SUCCESS;
+    s->sectors += sectors;
+    s->time_ns += time_ns;
+    s->size_hist[vdisk_stats_bucket(bytes)]++;
+    s->time_hist[vdisk_stats_bucket((time_ns + 999) / 1000)]++;
+}
+
+// The format's callback switches coverage on when it returns
+STDCALL int
+vdisk_read(void *userdata, void *buffer, off_t startsector,
+           size_t *numsectors) {
+    COVERAGE_OFF();
+    struct vdisk *disk = userdata;
+    size_t bytes = *numsectors * disk->sect_size;
+    uint64_t start = vdisk_time_ns();
+    int status = disk->read(userdata, buffer, startsector, numsectors);
+    COVERAGE_OFF();
+    vdisk_stats_count(&disk->stats.read, bytes, *numsectors,
+                      vdisk_time_ns() - start, status);
+    if (disk->working_set) {
+        working_set_access(disk->working_set, startsector, *numsectors);
+    }
+    COVERAGE_ON();
+    return status;
+}
+
+STDCALL int
+vdisk_write(void *userdata, void *buffer, off_t startsector,
+            size_t *numsectors) {
+    COVERAGE_OFF();
+    struct vdisk *disk = userdata;
+    size_t bytes = *numsectors * disk->sect_size;
+    uint64_t start = vdisk_time_ns();
+    int status = disk->write(userdata, buffer, startsector, numsectors);
+    COVERAGE_OFF();
+    vdisk_stats_count(&disk->stats.write, bytes, *numsectors,
+                      vdisk_time_ns() - start, status);
+    COVERAGE_ON();
+    return status;
+}
+
+STDCALL int
+vdisk_flush(void *userdata) {
+    COVERAGE_OFF();
+    struct vdisk *disk = userdata;
+    uint64_t start = vdisk_time_ns();
+    int status = disk->flush(userdata);
+    COVERAGE_OFF();
+    disk->stats.flush_cnt++;
+    disk->stats.flush_errors += status != KOS_ERROR_SUCCESS;
+    disk->stats.flush_time_ns += vdisk_time_ns() - start;
+    COVERAGE_ON();
+    return status;
+}
+
+static uint32_t
+vdisk_lock_wait_test(void /* struct appdata * with wait_param is in ebx */) {
+    appdata_t *app;
+    __asm__ __volatile__ __inline__ ("":"=b"(app)::);
+    int *lock = app->wait_param;
+    if (*lock) {
+        return 0;
+    }
+    *lock = 1;
+    return 1;
+}
+
+void
+vdisk_lock(int *lock, const void *io) {
+    const struct umka_io *uio = io;
+    if (*lock && *uio->running == UMKA_RUNNING_YES) {
+        kos_wait_events(vdisk_lock_wait_test, lock);
     } else {
-        return suggested_size;
+        *lock = 1;
     }
 }
 
+void
+vdisk_unlock(int *lock) {
+    *lock = 0;
+}
+
+STDCALL void
+vdisk_close(void *userdata) {
+    COVERAGE_OFF();
+    struct vdisk *disk = userdata;
+    working_set_free(disk->working_set);
+    // the format frees the disk and switches coverage on
+    disk->close(userdata);
+}
+
 struct vdisk*
-vdisk_init(const char *fname, const int adjust_cache_size,
-           const size_t cache_size, const void *io) {
+vdisk_init(const char *fname, const struct vdisk_params *params,
+           const void *io) {
     size_t fname_len = strlen(fname);
     size_t dot_raw_len = strlen(RAW_SUFFIX);
     size_t dot_iso_len = strlen(ISO_SUFFIX);
     size_t dot_qcow2_len = strlen(QCOW2_SUFFIX);
+    size_t dot_zst_len = strlen(ZST_SUFFIX);
     struct vdisk *disk;
+    size_t readahead_max = 0;   // format default
     if ((fname_len > dot_raw_len
          && !strcmp(fname + fname_len - dot_raw_len, RAW_SUFFIX))
         || (fname_len > dot_iso_len
             && !strcmp(fname + fname_len - dot_iso_len, ISO_SUFFIX))) {
-        disk = (struct vdisk*)vdisk_init_raw(fname, io);
+        disk = (struct vdisk*)vdisk_init_raw(fname, params->flags, io);
+        readahead_max = RAW_READAHEAD_MAX;
     } else if (fname_len > dot_qcow2_len
                && !strcmp(fname + fname_len - dot_qcow2_len, QCOW2_SUFFIX)) {
-        disk = (struct vdisk*)vdisk_init_qcow2(fname, io);
+        disk = (struct vdisk*)vdisk_init_qcow2(fname, params, io);
+        readahead_max = QCOW2_READAHEAD_MAX;
+    } else if ((fname_len > dot_zst_len
+                && !strcmp(fname + fname_len - dot_zst_len, ZST_SUFFIX))
+               || vdisk_zst_probe(fname)) {
+        disk = vdisk_init_zst(fname, params, io);
     } else {
         fprintf(stderr, "[vdisk] file has unknown format: %s\n", fname);
         return NULL;
     }
+    if (!disk) {
+        return NULL;
+    }
+    struct vdisk *format = disk;
+    // backing files of qcow2 images are only read through the top image
+    int top = !params->backing_depth;
+    if (top && (params->latency_us || params->seek_us || params->bandwidth)) {
+        struct vdisk *base = disk;
+        disk = vdisk_init_throttle(base, params->latency_us, params->seek_us,
+                                   params->bandwidth, io);
+        if (!disk) {
+            base->diskfunc.close(base);
+            return NULL;
+        }
+    }
+    if (params->readahead_max) {
+        readahead_max = params->readahead_max;
+    }
+    // mapped raw images, .zst images and throttled disks can't read ahead
+    if (top && (params->flags & VDISK_READAHEAD) && !disk->read_start) {
+        fprintf(stderr, "[vdisk] can't read ahead in the background: %s\n",
+                fname);
+    } else if (top && (params->flags & VDISK_READAHEAD)) {
+        struct vdisk *base = disk;
+        disk = vdisk_init_readahead(base, readahead_max, io);
+        if (!disk) {
+            base->diskfunc.close(base);
+            return NULL;
+        }
+    }
+    // writes never reach the image under an overlay
+    if (top && params->writeback_size && (params->flags & VDISK_WRITABLE)
+        && !(params->flags & VDISK_OVERLAY)) {
+        struct vdisk *base = disk;
+        disk = vdisk_init_writeback(base, params->writeback_size, io);
+        if (!disk) {
+            base->diskfunc.close(base);
+            return NULL;
+        }
+    }
+    if (params->flags & VDISK_OVERLAY) {
+        struct vdisk *base = disk;
+        disk = vdisk_init_overlay(base, params->delta_fname, io);
+        if (!disk) {
+            base->diskfunc.close(base);
+            return NULL;
+        }
+    }
+    if (top && block_cache_get_size()) {
+        struct vdisk *base = disk;
+        disk = vdisk_init_block_cache(base, io);
+        if (!disk) {
+            base->diskfunc.close(base);
+            return NULL;
+        }
+    }
+    if (top && params->trace_fname) {
+        struct vdisk *base = disk;
+        disk = vdisk_init_iotrace(base, params->trace_fname, io);
+        if (!disk) {
+            base->diskfunc.close(base);
+            return NULL;
+        }
+    }
+    // the working set is only estimated, the disk works without it
+    if (top && (params->flags & VDISK_ADAPTIVE_CACHE)) {
+        disk->working_set = working_set_init();
+    }
+    if (disk != format) {
+        memcpy(disk->caches, format->caches, sizeof(disk->caches));
+    }
+    disk->read = disk->diskfunc.read;
+    disk->write = disk->diskfunc.write;
+    disk->flush = disk->diskfunc.flush;
+    disk->close = disk->diskfunc.close;
+    disk->diskfunc.read = vdisk_read;
+    disk->diskfunc.write = vdisk_write;
+    disk->diskfunc.flush = vdisk_flush;
+    disk->diskfunc.close = vdisk_close;
     disk->diskfunc.closemedia = NULL;
     disk->diskfunc.querymedia = vdisk_querymedia;
-    disk->diskfunc.flush = NULL;
     disk->diskfunc.adjust_cache_size = vdisk_adjust_cache_size;
-    disk->adjust_cache_size = adjust_cache_size;
-    disk->cache_size = cache_size;
+    disk->adjust_cache_size = params->adjust_cache_size;
+    disk->adaptive_cache_size = !!(params->flags & VDISK_ADAPTIVE_CACHE);
+    disk->cache_size = params->cache_size;
+    if (top) {
+        disk->latency_us = params->latency_us;
+        disk->seek_us = params->seek_us;
+        disk->bandwidth = params->bandwidth;
+    }
     disk->io = io;
     return disk;
 }
@@ -12,6 +12,63 @@
 
 #include <inttypes.h>
 #include "umka.h"
+#include "umkaio.h"
+#include "vdisk/working_set.h"
+#include "vdisk/cluster_cache.h"
+
+#define VDISK_MMAP 0x1  // map raw image into memory, read-only
+#define VDISK_OVERLAY 0x2   // keep writes in a discardable copy-on-write delta
+#define VDISK_WRITABLE 0x4  // write to the image itself
+#define VDISK_READAHEAD 0x8  // read ahead sequential streams in the background
+#define VDISK_ADAPTIVE_CACHE 0x10   // size disk cache by the working set
+
+// Zero means default for every field
+struct vdisk_params {
+    int adjust_cache_size;
+    size_t cache_size;
+    unsigned flags;
+    const char *delta_fname;    // overlay delta file, in memory if NULL
+    size_t qcow2_l2_cache_size; // L2 tables, default if 0
+    size_t qcow2_std_cache_size;    // standard clusters, default if 0
+    size_t qcow2_cmp_cache_size;    // compressed clusters, default if 0
+    const char *qcow2_cache_policy; // cluster cache eviction, lru if NULL
+    size_t qcow2_inflate_thread_cnt;    // number of online cpus if 0
+    unsigned backing_depth; // images above this one in a qcow2 chain
+    size_t readahead_max;   // bytes, format default if 0, see VDISK_READAHEAD
+    size_t writeback_size;  // bytes of writes kept until flush, none if 0
+    const char *trace_fname;    // file to record requests to, none if NULL
+    uint32_t latency_us;    // modelled device, see vdisk_init_throttle
+    uint32_t seek_us;
+    uint64_t bandwidth;     // bytes per second, unlimited if 0
+};
+
+#define VDISK_STATS_HIST_SIZE 32
+#define VDISK_CACHES_MAX 4
+
+// A cache of the format, e.g. of its metadata tables
+struct vdisk_cache {
+    const char *name;   // NULL if the slot is unused
+    struct cluster_cache_stats *stats;
+};
+
+// Bucket i of a histogram counts values from 2^(i-1) exclusive to 2^i
+// inclusive, the last one counts everything above too
+struct vdisk_io_stats {
+    uint64_t cnt;
+    uint64_t errors;
+    uint64_t sectors;   // transferred
+    uint64_t time_ns;
+    uint64_t size_hist[VDISK_STATS_HIST_SIZE];  // bytes requested
+    uint64_t time_hist[VDISK_STATS_HIST_SIZE];  // microseconds
+};
+
+struct vdisk_stats {
+    struct vdisk_io_stats read;
+    struct vdisk_io_stats write;
+    uint64_t flush_cnt;
+    uint64_t flush_errors;
+    uint64_t flush_time_ns;
+};
 
 struct vdisk {
     diskfunc_t diskfunc;
@@ -19,11 +76,53 @@ struct vdisk {
     uint64_t sect_cnt;
     unsigned cache_size;
     int adjust_cache_size;
+    int adaptive_cache_size;    // cache_size is the limit if adjusted
+    size_t kernel_cache_size;   // bytes, as told to the kernel last time
+    struct working_set *working_set;    // of kernel reads, NULL if unknown
     const void *io;
+    // Tells if the sector is allocated in the image file (1), a hole (0) or
+    // -1 on error, sets cnt to the number of sectors from it in the same
+    // state. NULL if the format can't tell, then all sectors are allocated.
+    int (*block_status)(struct vdisk *disk, uint64_t sector, uint64_t *cnt);
+    // Tells that the sectors are no longer used so that their space in the
+    // image can be freed, they read as zeroes or as older data afterwards.
+    // Returns one of KOS_ERROR_*. NULL if the image can't free space.
+    int (*discard)(struct vdisk *disk, uint64_t sector, uint64_t cnt);
+    // Starts reading up to cnt sectors to buf and returns without waiting for
+    // them, io_wait of a completes the read. Returns the number of sectors
+    // started, it is 0 if none can be read so. NULL if the format can't read
+    // in the background.
+    uint64_t (*read_start)(struct vdisk *disk, struct io_async *a, void *buf,
+                           uint64_t sector, uint64_t cnt);
+    // Modelled device, all zero if requests aren't throttled
+    uint32_t latency_us;
+    uint32_t seek_us;
+    uint64_t bandwidth;
+    // Caches of the format, the top disk of the layers over it has them too
+    struct vdisk_cache caches[VDISK_CACHES_MAX];
+    // Requests the kernel sends to the disk, the callbacks of diskfunc count
+    // them and call the ones of the format saved here
+    struct vdisk_stats stats;
+    STDCALL int (*read)(void *userdata, void *buffer, off_t startsector,
+                        size_t *numsectors);
+    STDCALL int (*write)(void *userdata, void *buffer, off_t startsector,
+                         size_t *numsectors);
+    STDCALL int (*flush)(void *userdata);
+    STDCALL void (*close)(void *userdata);
 };
 
 struct vdisk*
-vdisk_init(const char *fname, const int adjust_cache_size,
-           const size_t cache_size, const void *io);
+vdisk_init(const char *fname, const struct vdisk_params *params,
+           const void *io);
+
+// Kernel threads share one host thread and a request waiting for i/o lets
+// another one run. Shared state of a disk that is used across such waits is
+// guarded by a lock, a plain int that is zero when free. When the kernel
+// doesn't run, requests can't overlap and the lock is always free.
+void
+vdisk_lock(int *lock, const void *io);
+
+void
+vdisk_unlock(int *lock);
 
 #endif  // VDISK_H_INCLUDED
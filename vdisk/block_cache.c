@@ -0,0 +1,566 @@
+/*
+    SPDX-License-Identifier: GPL-2.0-or-later
+
+    UMKa - User-Mode KolibriOS developer tools
+    vdisk - virtual disk, host block cache shared by all disks
+
+    Copyright (C) 2023  Ivan Baravy <dunkaist@gmail.com>
+*/
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../trace.h"
+#include "block_cache.h"
+
+// The cache is 2Q: blocks seen once are kept in a short FIFO queue A1in, if
+// they are requested again after they left it, while they are still
+// remembered by the ghost queue A1out, they go to the LRU queue Am. So a
+// single scan of a large file doesn't flush the blocks that are used often.
+#define BLOCK_CACHE_NONE SIZE_MAX
+#define BLOCK_CACHE_OWNER_SHIFT 40  // key is owner and block number
+#define BLOCK_CACHE_OWNER_MASK 0xffffffu
+#define BLOCK_CACHE_READ_MAX 64     // blocks read from the base at once
+
+enum block_cache_queue_id {
+    BLOCK_CACHE_FREE,
+    BLOCK_CACHE_A1IN,
+    BLOCK_CACHE_AM,
+    BLOCK_CACHE_A1OUT,
+    BLOCK_CACHE_GHOST_FREE,
+    BLOCK_CACHE_QUEUE_CNT,
+};
+
+struct block_cache_node {
+    uint64_t key;
+    size_t prev;    // towards the head, i.e. more recent
+    size_t next;
+    size_t hnext;   // hash chain
+    enum block_cache_queue_id queue;
+};
+
+struct block_cache_queue {
+    size_t head;
+    size_t tail;
+    size_t len;
+};
+
+// Nodes of cached blocks go first, ghost nodes of A1out keep keys only
+struct block_cache {
+    size_t size;
+    size_t cnt;
+    size_t ghost_cnt;
+    size_t a1in_max;
+    uint8_t *buf;
+    struct block_cache_node *nodes;
+    size_t *hash;
+    size_t hash_mask;
+    struct block_cache_queue queues[BLOCK_CACHE_QUEUE_CNT];
+    uint32_t last_owner;
+    struct block_cache_stats stats;
+};
+
+struct vdisk_block_cache {
+    struct vdisk vdisk;
+    struct vdisk *base;
+    uint32_t owner;
+    uint32_t block_sects;
+    uint64_t write_cnt; // writes and discards, see vdisk_block_cache_read
+};
+
+static struct block_cache block_cache;
+
+static uint64_t
+block_cache_key(uint32_t owner, uint64_t block) {
+    return ((uint64_t)owner << BLOCK_CACHE_OWNER_SHIFT) | block;
+}
+
+static size_t
+block_cache_bucket(uint64_t key) {
+    return (size_t)((key * 0x9e3779b97f4a7c15ULL) >> 32)
+           & block_cache.hash_mask;
+}
+
+static uint8_t *
+block_cache_data(size_t i) {
+    return block_cache.buf + i * BLOCK_CACHE_BLOCK_SIZE;
+}
+
+static size_t
+block_cache_find(uint64_t key) {
+    if (!block_cache.cnt) {
+        return BLOCK_CACHE_NONE;
+    }
+    size_t i = block_cache.hash[block_cache_bucket(key)];
+    while (i != BLOCK_CACHE_NONE && block_cache.nodes[i].key != key) {
+        i = block_cache.nodes[i].hnext;
+    }
+    return i;
+}
+
+static void
+block_cache_hash_add(size_t i) {
+    size_t *bucket = block_cache.hash
+                     + block_cache_bucket(block_cache.nodes[i].key);
+    block_cache.nodes[i].hnext = *bucket;
+    *bucket = i;
+}
+
+static void
+block_cache_hash_del(size_t i) {
+    size_t *p = block_cache.hash
+                + block_cache_bucket(block_cache.nodes[i].key);
+    while (*p != i) {
+        p = &block_cache.nodes[*p].hnext;
+    }
+    *p = block_cache.nodes[i].hnext;
+}
+
+static void
+block_cache_push(enum block_cache_queue_id id, size_t i) {
+    struct block_cache_queue *q = block_cache.queues + id;
+    struct block_cache_node *n = block_cache.nodes + i;
+    n->queue = id;
+    n->prev = BLOCK_CACHE_NONE;
+    n->next = q->head;
+    if (q->head != BLOCK_CACHE_NONE) {
+        block_cache.nodes[q->head].prev = i;
+    } else {
+        q->tail = i;
+    }
+    q->head = i;
+    q->len++;
+}
+
+static void
+block_cache_remove(size_t i) {
+    struct block_cache_node *n = block_cache.nodes + i;
+    struct block_cache_queue *q = block_cache.queues + n->queue;
+    if (n->prev != BLOCK_CACHE_NONE) {
+        block_cache.nodes[n->prev].next = n->next;
+    } else {
+        q->head = n->next;
+    }
+    if (n->next != BLOCK_CACHE_NONE) {
+        block_cache.nodes[n->next].prev = n->prev;
+    } else {
+        q->tail = n->prev;
+    }
+    q->len--;
+}
+
+static size_t
+block_cache_pop_tail(enum block_cache_queue_id id) {
+    size_t i = block_cache.queues[id].tail;
+    if (i != BLOCK_CACHE_NONE) {
+        block_cache_remove(i);
+    }
+    return i;
+}
+
+// The key of a block evicted from A1in is remembered in A1out
+static void
+block_cache_remember(uint64_t key) {
+    size_t g = block_cache_pop_tail(BLOCK_CACHE_GHOST_FREE);
+    if (g == BLOCK_CACHE_NONE) {
+        g = block_cache_pop_tail(BLOCK_CACHE_A1OUT);
+        if (g == BLOCK_CACHE_NONE) {
+            return;
+        }
+        block_cache_hash_del(g);
+    }
+    block_cache.nodes[g].key = key;
+    block_cache_hash_add(g);
+    block_cache_push(BLOCK_CACHE_A1OUT, g);
+}
+
+// Returns a node for a new block, it isn't in any queue
+static size_t
+block_cache_reclaim(void) {
+    size_t i = block_cache_pop_tail(BLOCK_CACHE_FREE);
+    if (i != BLOCK_CACHE_NONE) {
+        return i;
+    }
+    if (block_cache.queues[BLOCK_CACHE_A1IN].len > block_cache.a1in_max
+        || !block_cache.queues[BLOCK_CACHE_AM].len) {
+        i = block_cache_pop_tail(BLOCK_CACHE_A1IN);
+        block_cache_hash_del(i);
+        block_cache_remember(block_cache.nodes[i].key);
+    } else {
+        i = block_cache_pop_tail(BLOCK_CACHE_AM);
+        block_cache_hash_del(i);
+    }
+    block_cache.stats.evictions++;
+    return i;
+}
+
+static void
+block_cache_forget(size_t i) {
+    enum block_cache_queue_id free_id = i < block_cache.cnt
+                                        ? BLOCK_CACHE_FREE
+                                        : BLOCK_CACHE_GHOST_FREE;
+    block_cache_remove(i);
+    block_cache_hash_del(i);
+    block_cache_push(free_id, i);
+}
+
+static int
+block_cache_is_cached(size_t i) {
+    return i != BLOCK_CACHE_NONE && i < block_cache.cnt;
+}
+
+// Returns cached data or NULL, counts a hit or a miss. The data is valid
+// until the next insert.
+static const uint8_t *
+block_cache_lookup(uint32_t owner, uint64_t block) {
+    size_t i = block_cache_find(block_cache_key(owner, block));
+    if (!block_cache_is_cached(i)) {
+        block_cache.stats.misses++;
+        return NULL;
+    }
+    block_cache.stats.hits++;
+    if (block_cache.nodes[i].queue == BLOCK_CACHE_AM) {
+        block_cache_remove(i);
+        block_cache_push(BLOCK_CACHE_AM, i);
+    }
+    return block_cache_data(i);
+}
+
+static void
+block_cache_insert(uint32_t owner, uint64_t block, const uint8_t *data) {
+    if (!block_cache.cnt) {
+        return;
+    }
+    uint64_t key = block_cache_key(owner, block);
+    size_t i = block_cache_find(key);
+    if (block_cache_is_cached(i)) {
+        memcpy(block_cache_data(i), data, BLOCK_CACHE_BLOCK_SIZE);
+        return;
+    }
+    enum block_cache_queue_id id = BLOCK_CACHE_A1IN;
+    if (i != BLOCK_CACHE_NONE) {
+        // seen recently, so it is likely to be used again
+        block_cache_forget(i);
+        id = BLOCK_CACHE_AM;
+    }
+    i = block_cache_reclaim();
+    block_cache.nodes[i].key = key;
+    block_cache_hash_add(i);
+    block_cache_push(id, i);
+    memcpy(block_cache_data(i), data, BLOCK_CACHE_BLOCK_SIZE);
+}
+
+// Written data is copied to the block if it is cached
+static void
+block_cache_update(uint32_t owner, uint64_t block, size_t off,
+                   const uint8_t *data, size_t len) {
+    size_t i = block_cache_find(block_cache_key(owner, block));
+    if (block_cache_is_cached(i)) {
+        memcpy(block_cache_data(i) + off, data, len);
+    }
+}
+
+static void
+block_cache_invalidate(uint32_t owner, uint64_t block) {
+    size_t i = block_cache_find(block_cache_key(owner, block));
+    if (i != BLOCK_CACHE_NONE) {
+        block_cache_forget(i);
+    }
+}
+
+static void
+block_cache_drop_owner(uint32_t owner) {
+    for (size_t i = 0; i < block_cache.cnt + block_cache.ghost_cnt; i++) {
+        struct block_cache_node *n = block_cache.nodes + i;
+        if (n->queue != BLOCK_CACHE_FREE && n->queue != BLOCK_CACHE_GHOST_FREE
+            && n->key >> BLOCK_CACHE_OWNER_SHIFT == owner) {
+            block_cache_forget(i);
+        }
+    }
+}
+
+static void
+block_cache_free(void) {
+    free(block_cache.buf);
+    free(block_cache.nodes);
+    free(block_cache.hash);
+    block_cache.buf = NULL;
+    block_cache.nodes = NULL;
+    block_cache.hash = NULL;
+    block_cache.size = 0;
+    block_cache.cnt = 0;
+    block_cache.ghost_cnt = 0;
+}
+
+int
+block_cache_set_size(size_t size) {
+    block_cache_free();
+    size_t cnt = size / BLOCK_CACHE_BLOCK_SIZE;
+    if (!cnt) {
+        return 0;
+    }
+    size_t ghost_cnt = cnt / 2;
+    size_t node_cnt = cnt + ghost_cnt;
+    size_t hash_size = 1;
+    while (hash_size < node_cnt * 2) {
+        hash_size <<= 1;
+    }
+    block_cache.buf = malloc(cnt * BLOCK_CACHE_BLOCK_SIZE);
+    block_cache.nodes = malloc(node_cnt * sizeof(struct block_cache_node));
+    block_cache.hash = malloc(hash_size * sizeof(size_t));
+    if (!block_cache.buf || !block_cache.nodes || !block_cache.hash) {
+        fprintf(stderr, "[vdisk.block_cache] can't allocate %zu bytes\n",
+                size);
+        block_cache_free();
+        return -1;
+    }
+    block_cache.size = cnt * BLOCK_CACHE_BLOCK_SIZE;
+    block_cache.cnt = cnt;
+    block_cache.ghost_cnt = ghost_cnt;
+    block_cache.a1in_max = cnt / 4;
+    block_cache.hash_mask = hash_size - 1;
+    for (size_t i = 0; i < hash_size; i++) {
+        block_cache.hash[i] = BLOCK_CACHE_NONE;
+    }
+    for (size_t q = 0; q < BLOCK_CACHE_QUEUE_CNT; q++) {
+        block_cache.queues[q] = (struct block_cache_queue){
+                .head = BLOCK_CACHE_NONE, .tail = BLOCK_CACHE_NONE, .len = 0};
+    }
+    for (size_t i = 0; i < node_cnt; i++) {
+        block_cache_push(i < cnt ? BLOCK_CACHE_FREE : BLOCK_CACHE_GHOST_FREE,
+                         i);
+    }
+    return 0;
+}
+
+size_t
+block_cache_get_size(void) {
+    return block_cache.size;
+}
+
+void
+block_cache_get_stats(struct block_cache_stats *stats) {
+    *stats = block_cache.stats;
+}
+
+void
+block_cache_reset_stats(void) {
+    block_cache.stats = (struct block_cache_stats){0};
+}
+
+// The base disk switches coverage on when it returns
+static int
+block_cache_base_read(struct vdisk_block_cache *d, void *buf, uint64_t sector,
+                      size_t cnt) {
+    size_t numsectors = cnt;
+    int status = d->base->diskfunc.read(d->base, buf, sector, &numsectors);
+    COVERAGE_OFF();
+    return status;
+}
+
+STDCALL void
+vdisk_block_cache_close(void *userdata) {
+    COVERAGE_OFF();
+    struct vdisk_block_cache *d = userdata;
+    block_cache_drop_owner(d->owner);
+    d->base->diskfunc.close(d->base);
+    COVERAGE_OFF();
+    free(d);
+    COVERAGE_ON();
+}
+
+// Runs of missed blocks are read from the base at once, straight into the
+// buffer and cached from there. Only a run with a block that is partly out of
+// the request is read to a temporary buffer. Cached blocks are copied as soon
+// as they are found since the base may yield to other threads that evict
+// them. If the disk is written to while a run is read, the run may be older
+// than the write and isn't cached.
+STDCALL int
+vdisk_block_cache_read(void *userdata, void *buffer, off_t startsector,
+                       size_t *numsectors) {
+    COVERAGE_OFF();
+    struct vdisk_block_cache *d = userdata;
+    uint8_t *buf = buffer;
+    uint32_t sect_size = d->vdisk.sect_size;
+    uint32_t block_sects = d->block_sects;
+    uint64_t sector = startsector;
+    uint64_t end = sector + *numsectors;
+    if (end > d->vdisk.sect_cnt) {
+        end = d->vdisk.sect_cnt;
+    }
+    while (sector < end) {
+        uint64_t first = sector / block_sects;
+        uint64_t last = first;
+        const uint8_t *data = NULL;
+        while (last - first < BLOCK_CACHE_READ_MAX && last * block_sects < end
+               && !(data = block_cache_lookup(d->owner, last))) {
+            last++;
+        }
+        uint64_t run_start = first * block_sects;
+        uint64_t run_end = last * block_sects;
+        if (run_end > d->vdisk.sect_cnt) {
+            run_end = d->vdisk.sect_cnt;
+        }
+        uint64_t hit_end = (last + 1) * block_sects;
+        if (hit_end > end) {
+            hit_end = end;
+        }
+        // the hit block goes first, it may be evicted while the run is read
+        if (data) {
+            uint64_t hit_start = sector > run_end ? sector : run_end;
+            memcpy(buf + (hit_start - startsector) * sect_size,
+                   data + (hit_start - last * block_sects) * sect_size,
+                   (hit_end - hit_start) * sect_size);
+        }
+        if (last != first) {
+            int inside = run_start >= (uint64_t)startsector && run_end <= end;
+            uint8_t *blocks = buf + (run_start - startsector) * sect_size;
+            if (!inside) {
+                blocks = malloc((last - first) * BLOCK_CACHE_BLOCK_SIZE);
+            }
+            uint64_t write_cnt = d->write_cnt;
+            int status = KOS_ERROR_OUT_OF_MEMORY;
+            if (blocks) {
+                status = block_cache_base_read(d, blocks, run_start,
+                                               run_end - run_start);
+            }
+            if (status != KOS_ERROR_SUCCESS) {
+                if (!inside) {
+                    free(blocks);
+                }
+                *numsectors = sector - startsector;
+                COVERAGE_ON();
+                return status;
+            }
+            // the last block of the disk may be partial
+            uint64_t full_end = d->vdisk.sect_cnt / block_sects;
+            for (uint64_t b = first;
+                 b < last && b < full_end && write_cnt == d->write_cnt; b++) {
+                block_cache_insert(d->owner, b, blocks
+                                   + (b - first) * BLOCK_CACHE_BLOCK_SIZE);
+            }
+            uint64_t copy_end = run_end < end ? run_end : end;
+            if (!inside) {
+                memcpy(buf + (sector - startsector) * sect_size,
+                       blocks + (sector - run_start) * sect_size,
+                       (copy_end - sector) * sect_size);
+                free(blocks);
+            }
+            sector = copy_end;
+        }
+        if (data) {
+            sector = hit_end;
+        }
+    }
+    if (sector - startsector < *numsectors) {
+        *numsectors = sector - startsector;
+        COVERAGE_ON();
+        return KOS_ERROR_DEVICE;
+    }
+    COVERAGE_ON();
+    return KOS_ERROR_SUCCESS;
+}
+
+// Writes go through, cached blocks are updated. Blocks of a failed write are
+// dropped as it is unknown what reached the base.
+STDCALL int
+vdisk_block_cache_write(void *userdata, void *buffer, off_t startsector,
+                        size_t *numsectors) {
+    COVERAGE_OFF();
+    struct vdisk_block_cache *d = userdata;
+    const uint8_t *buf = buffer;
+    uint32_t sect_size = d->vdisk.sect_size;
+    uint32_t block_sects = d->block_sects;
+    uint64_t end = startsector + *numsectors;
+    d->write_cnt++;
+    int status = d->base->diskfunc.write(d->base, buffer, startsector,
+                                         numsectors);
+    COVERAGE_OFF();
+    uint64_t sector = startsector;
+    while (sector < end) {
+        uint64_t block = sector / block_sects;
+        uint64_t bend = (block + 1) * block_sects;
+        if (bend > end) {
+            bend = end;
+        }
+        if (status == KOS_ERROR_SUCCESS) {
+            block_cache_update(d->owner, block,
+                               (sector - block * block_sects) * sect_size,
+                               buf + (sector - startsector) * sect_size,
+                               (bend - sector) * sect_size);
+        } else {
+            block_cache_invalidate(d->owner, block);
+        }
+        sector = bend;
+    }
+    COVERAGE_ON();
+    return status;
+}
+
+STDCALL int
+vdisk_block_cache_flush(void *userdata) {
+    COVERAGE_OFF();
+    struct vdisk_block_cache *d = userdata;
+    // the base switches coverage on when it returns
+    return d->base->diskfunc.flush(d->base);
+}
+
+static int
+vdisk_block_cache_block_status(struct vdisk *vdisk, uint64_t sector,
+                               uint64_t *cnt) {
+    struct vdisk_block_cache *d = (struct vdisk_block_cache*)vdisk;
+    return d->base->block_status(d->base, sector, cnt);
+}
+
+static int
+vdisk_block_cache_discard(struct vdisk *vdisk, uint64_t sector,
+                          uint64_t cnt) {
+    struct vdisk_block_cache *d = (struct vdisk_block_cache*)vdisk;
+    uint64_t end = sector + cnt;
+    d->write_cnt++;
+    for (uint64_t block = sector / d->block_sects;
+         block * d->block_sects < end; block++) {
+        block_cache_invalidate(d->owner, block);
+    }
+    return d->base->discard(d->base, sector, cnt);
+}
+
+struct vdisk*
+vdisk_init_block_cache(struct vdisk *base, const struct umka_io *io) {
+    if (BLOCK_CACHE_BLOCK_SIZE % base->sect_size) {
+        fprintf(stderr, "[vdisk.block_cache] sector size %" PRIu32 " doesn't"
+                " divide block size, the disk isn't cached\n",
+                base->sect_size);
+        return base;
+    }
+    struct vdisk_block_cache *d = calloc(1, sizeof(struct vdisk_block_cache));
+    if (!d) {
+        fprintf(stderr, "[vdisk.block_cache] can't allocate memory\n");
+        return NULL;
+    }
+    d->vdisk = (struct vdisk){.diskfunc = {.strucsize = sizeof(diskfunc_t),
+                                           .close = vdisk_block_cache_close,
+                                           .read = vdisk_block_cache_read,
+                                           .write = vdisk_block_cache_write,
+                                           .flush = vdisk_block_cache_flush,
+                                          },
+                              .sect_size = base->sect_size,
+                              .sect_cnt = base->sect_cnt,
+                              .io = io,
+                             };
+    if (base->block_status) {
+        d->vdisk.block_status = vdisk_block_cache_block_status;
+    }
+    if (base->discard) {
+        d->vdisk.discard = vdisk_block_cache_discard;
+    }
+    d->base = base;
+    d->block_sects = BLOCK_CACHE_BLOCK_SIZE / base->sect_size;
+    do {
+        block_cache.last_owner = (block_cache.last_owner + 1)
+                                 & BLOCK_CACHE_OWNER_MASK;
+    } while (!block_cache.last_owner);
+    d->owner = block_cache.last_owner;
+    return (struct vdisk*)d;
+}
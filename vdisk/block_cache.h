@@ -0,0 +1,46 @@
+/*
+    SPDX-License-Identifier: GPL-2.0-or-later
+
+    UMKa - User-Mode KolibriOS developer tools
+    vdisk - virtual disk, host block cache shared by all disks
+
+    Copyright (C) 2023  Ivan Baravy <dunkaist@gmail.com>
+*/
+
+#ifndef VDISK_BLOCK_CACHE_H_INCLUDED
+#define VDISK_BLOCK_CACHE_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+#include "vdisk.h"
+#include "umkaio.h"
+
+#define BLOCK_CACHE_BLOCK_SIZE 4096
+
+struct block_cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+};
+
+// Drops all cached blocks and reallocates the cache, zero size disables it.
+// Returns -1 if memory can't be allocated, the cache is disabled then.
+int
+block_cache_set_size(size_t size);
+
+size_t
+block_cache_get_size(void);
+
+void
+block_cache_get_stats(struct block_cache_stats *stats);
+
+void
+block_cache_reset_stats(void);
+
+// Takes ownership of base. Blocks of the disk are kept in the shared cache,
+// writes go through to the base. The base is returned as is, with a
+// warning, if its sector size doesn't divide the block size.
+struct vdisk*
+vdisk_init_block_cache(struct vdisk *base, const struct umka_io *io);
+
+#endif  // VDISK_BLOCK_CACHE_H_INCLUDED
@@ -0,0 +1,218 @@
+/*
+    SPDX-License-Identifier: GPL-2.0-or-later
+
+    UMKa - User-Mode KolibriOS developer tools
+    vdisk - virtual disk, cache of decoded clusters
+
+    Copyright (C) 2023  Ivan Baravy <dunkaist@gmail.com>
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cluster_cache.h"
+
+#define CLUSTER_CACHE_NONE SIZE_MAX
+
+static size_t
+cluster_cache_bucket(const struct cluster_cache *c, uint64_t key) {
+    return (size_t)((key * 0x9e3779b97f4a7c15ULL) >> 32) & c->hash_mask;
+}
+
+static struct cluster_cache_entry *
+cluster_cache_find(struct cluster_cache *c, uint64_t key) {
+    size_t i = c->hash[cluster_cache_bucket(c, key)];
+    while (i != CLUSTER_CACHE_NONE) {
+        struct cluster_cache_entry *e = c->entries + i;
+        if (e->key == key) {
+            return e;
+        }
+        i = e->next;
+    }
+    return NULL;
+}
+
+static void
+cluster_cache_unlink(struct cluster_cache *c, struct cluster_cache_entry *e) {
+    size_t *i = c->hash + cluster_cache_bucket(c, e->key);
+    size_t idx = e - c->entries;
+    while (*i != idx) {
+        i = &c->entries[*i].next;
+    }
+    *i = e->next;
+    e->next = CLUSTER_CACHE_NONE;
+    e->valid = 0;
+}
+
+static void
+lru_touch(struct cluster_cache *c, struct cluster_cache_entry *e) {
+    e->last_use = ++c->clock;
+}
+
+static struct cluster_cache_entry *
+lru_victim(struct cluster_cache *c) {
+    struct cluster_cache_entry *victim = NULL;
+    for (size_t i = 0; i < c->cnt; i++) {
+        struct cluster_cache_entry *e = c->entries + i;
+        if (e->busy) {
+            continue;
+        }
+        if (!e->valid) {
+            return e;
+        }
+        if (!victim || e->last_use < victim->last_use) {
+            victim = e;
+        }
+    }
+    return victim;
+}
+
+const struct cluster_cache_policy cluster_cache_lru = {
+    .name = "lru",
+    .touch = lru_touch,
+    .victim = lru_victim,
+};
+
+static void
+clock_touch(struct cluster_cache *c, struct cluster_cache_entry *e) {
+    (void)c;
+    e->referenced = 1;
+}
+
+// Second chance: referenced entries are skipped once
+static struct cluster_cache_entry *
+clock_victim(struct cluster_cache *c) {
+    for (size_t n = 0; n < c->cnt * 2; n++) {
+        struct cluster_cache_entry *e = c->entries + c->hand;
+        c->hand = (c->hand + 1) % c->cnt;
+        if (e->busy) {
+            continue;
+        }
+        if (!e->valid || !e->referenced) {
+            return e;
+        }
+        e->referenced = 0;
+    }
+    return NULL;
+}
+
+const struct cluster_cache_policy cluster_cache_clock = {
+    .name = "clock",
+    .touch = clock_touch,
+    .victim = clock_victim,
+};
+
+static const struct cluster_cache_policy *cluster_cache_policies[] = {
+    &cluster_cache_lru,
+    &cluster_cache_clock,
+};
+
+const struct cluster_cache_policy *
+cluster_cache_policy_find(const char *name) {
+    size_t cnt = sizeof(cluster_cache_policies)
+                 / sizeof(cluster_cache_policies[0]);
+    for (size_t i = 0; i < cnt; i++) {
+        if (!strcmp(cluster_cache_policies[i]->name, name)) {
+            return cluster_cache_policies[i];
+        }
+    }
+    return NULL;
+}
+
+struct cluster_cache *
+cluster_cache_init(size_t cnt, size_t item_size,
+                   const struct cluster_cache_policy *policy) {
+    struct cluster_cache *c = calloc(1, sizeof(struct cluster_cache));
+    if (!c) {
+        return NULL;
+    }
+    size_t hash_size = 1;
+    while (hash_size < cnt * 2) {
+        hash_size <<= 1;
+    }
+    c->policy = policy;
+    c->cnt = cnt;
+    c->item_size = item_size;
+    c->hash_mask = hash_size - 1;
+    c->buf = malloc(cnt * item_size);
+    c->entries = calloc(cnt, sizeof(struct cluster_cache_entry));
+    c->hash = malloc(hash_size * sizeof(size_t));
+    if (!cnt || !c->buf || !c->entries || !c->hash) {
+        fprintf(stderr, "[vdisk] can't allocate cluster cache\n");
+        cluster_cache_close(c);
+        return NULL;
+    }
+    for (size_t i = 0; i < hash_size; i++) {
+        c->hash[i] = CLUSTER_CACHE_NONE;
+    }
+    for (size_t i = 0; i < cnt; i++) {
+        c->entries[i].data = c->buf + i * item_size;
+        c->entries[i].next = CLUSTER_CACHE_NONE;
+    }
+    return c;
+}
+
+void
+cluster_cache_close(struct cluster_cache *c) {
+    free(c->buf);
+    free(c->entries);
+    free(c->hash);
+    free(c);
+}
+
+uint8_t *
+cluster_cache_lookup(struct cluster_cache *c, uint64_t key) {
+    struct cluster_cache_entry *e = cluster_cache_find(c, key);
+    if (!e) {
+        c->stats.misses++;
+        return NULL;
+    }
+    c->stats.hits++;
+    c->policy->touch(c, e);
+    return e->data;
+}
+
+struct cluster_cache_entry *
+cluster_cache_reserve(struct cluster_cache *c) {
+    struct cluster_cache_entry *e = c->policy->victim(c);
+    if (!e) {
+        return NULL;
+    }
+    if (e->valid) {
+        cluster_cache_unlink(c, e);
+        c->stats.evictions++;
+    }
+    e->busy = 1;
+    return e;
+}
+
+void
+cluster_cache_insert(struct cluster_cache *c, struct cluster_cache_entry *e,
+                     uint64_t key) {
+    // somebody else may have filled the same cluster meanwhile
+    struct cluster_cache_entry *old = cluster_cache_find(c, key);
+    if (old) {
+        cluster_cache_unlink(c, old);
+    }
+    size_t *bucket = c->hash + cluster_cache_bucket(c, key);
+    e->key = key;
+    e->next = *bucket;
+    *bucket = e - c->entries;
+    e->valid = 1;
+    e->busy = 0;
+    c->policy->touch(c, e);
+}
+
+void
+cluster_cache_release(struct cluster_cache *c, struct cluster_cache_entry *e) {
+    (void)c;
+    e->busy = 0;
+}
+
+void
+cluster_cache_invalidate(struct cluster_cache *c, uint64_t key) {
+    struct cluster_cache_entry *e = cluster_cache_find(c, key);
+    if (e) {
+        cluster_cache_unlink(c, e);
+    }
+}
@@ -0,0 +1,89 @@
+/*
+    SPDX-License-Identifier: GPL-2.0-or-later
+
+    UMKa - User-Mode KolibriOS developer tools
+    vdisk - virtual disk, cache of decoded clusters
+
+    Copyright (C) 2023  Ivan Baravy <dunkaist@gmail.com>
+*/
+
+#ifndef VDISK_CLUSTER_CACHE_H_INCLUDED
+#define VDISK_CLUSTER_CACHE_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct cluster_cache_entry {
+    uint64_t key;
+    uint8_t *data;
+    int valid;          // data holds cluster key
+    int busy;           // being filled, never evicted
+    uint64_t last_use;  // lru
+    int referenced;     // clock
+    size_t next;        // hash chain
+};
+
+struct cluster_cache;
+
+// Eviction policy, victim must return a non-busy entry or NULL
+struct cluster_cache_policy {
+    const char *name;
+    void (*touch)(struct cluster_cache *c, struct cluster_cache_entry *e);
+    struct cluster_cache_entry *(*victim)(struct cluster_cache *c);
+};
+
+struct cluster_cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+};
+
+struct cluster_cache {
+    const struct cluster_cache_policy *policy;
+    size_t cnt;
+    size_t item_size;
+    uint8_t *buf;
+    struct cluster_cache_entry *entries;
+    size_t *hash;
+    size_t hash_mask;
+    uint64_t clock;
+    size_t hand;
+    struct cluster_cache_stats stats;
+};
+
+extern const struct cluster_cache_policy cluster_cache_lru;
+extern const struct cluster_cache_policy cluster_cache_clock;
+
+// Returns NULL if there is no policy with such a name
+const struct cluster_cache_policy *
+cluster_cache_policy_find(const char *name);
+
+struct cluster_cache *
+cluster_cache_init(size_t cnt, size_t item_size,
+                   const struct cluster_cache_policy *policy);
+
+void
+cluster_cache_close(struct cluster_cache *c);
+
+// Returns cached data or NULL, counts a hit or a miss
+uint8_t *
+cluster_cache_lookup(struct cluster_cache *c, uint64_t key);
+
+// Takes an entry out of the cache so that it can be filled, returns NULL if
+// all the entries are busy. The entry must be given back by either
+// cluster_cache_insert or cluster_cache_release.
+struct cluster_cache_entry *
+cluster_cache_reserve(struct cluster_cache *c);
+
+void
+cluster_cache_insert(struct cluster_cache *c, struct cluster_cache_entry *e,
+                     uint64_t key);
+
+void
+cluster_cache_release(struct cluster_cache *c, struct cluster_cache_entry *e);
+
+// Drops the cluster if it is cached
+void
+cluster_cache_invalidate(struct cluster_cache *c, uint64_t key);
+
+#endif  // VDISK_CLUSTER_CACHE_H_INCLUDED
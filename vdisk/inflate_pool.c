@@ -0,0 +1,221 @@
+/*
+    SPDX-License-Identifier: GPL-2.0-or-later
+
+    UMKa - User-Mode KolibriOS developer tools
+    vdisk - virtual disk, pool of threads decompressing clusters
+
+    Copyright (C) 2023  Ivan Baravy <dunkaist@gmail.com>
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "umka.h"
+#include "inflate_pool.h"
+
+struct inflate_worker {
+    struct inflate_pool *pool;
+    pthread_t thread;
+    uint8_t *scratch;
+    void *work;
+};
+
+// Workers claim jobs of the current batch one by one with the mutex held and
+// run them without it. The submitter is a kernel thread, kernel threads share
+// one host thread, so it takes the mutex via trylock in a wait test and waits
+// for the completion counter in a wait test too. Other submitters wait until
+// the batch is complete, it is marked busy till then.
+struct inflate_pool {
+    const struct umka_io *io;
+    inflate_func_t inflate;
+    size_t scratch_size;
+    size_t work_size;
+    size_t thread_cnt;
+    struct inflate_worker *workers;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;        // a batch is submitted or stop is requested
+    pthread_cond_t done_cond;   // the batch is complete
+    struct inflate_job *jobs;
+    size_t job_cnt;
+    size_t next;                // next job to claim
+    atomic_size_t done;
+    int busy;                   // a batch is submitted and not waited for yet
+    int stop;
+};
+
+static void
+inflate_job_exec(struct inflate_pool *p, struct inflate_job *job,
+                 uint8_t *scratch, void *work) {
+    size_t got = 0;
+    while (got < job->src_len) {
+        ssize_t res = pread(job->fd, scratch + got, job->src_len - got,
+                            job->offset + got);
+        if (res == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            job->res = -1;
+            job->err = errno;
+            return;
+        } else if (res == 0) {
+            break;  // compressed data may end before the last sector does
+        }
+        got += res;
+    }
+    size_t out = got ? p->inflate(work, scratch, got, job->dst, job->dst_len)
+                     : (size_t)-1;
+    if (out == (size_t)-1) {
+        job->res = -1;
+        job->err = 0;
+        return;
+    }
+    memset(job->dst + out, 0, job->dst_len - out);
+    job->res = out;
+    job->err = 0;
+}
+
+static void *
+inflate_worker_thread(void *arg) {
+    struct inflate_worker *w = arg;
+    struct inflate_pool *p = w->pool;
+    pthread_mutex_lock(&p->mutex);
+    while (1) {
+        while (p->next == p->job_cnt && !p->stop) {
+            pthread_cond_wait(&p->cond, &p->mutex);
+        }
+        if (p->stop) {
+            break;
+        }
+        struct inflate_job *job = p->jobs + p->next++;
+        size_t cnt = p->job_cnt;
+        pthread_mutex_unlock(&p->mutex);
+        inflate_job_exec(p, job, w->scratch, w->work);
+        size_t done = atomic_fetch_add_explicit(&p->done, 1,
+                                                memory_order_acq_rel) + 1;
+        pthread_mutex_lock(&p->mutex);
+        if (done == cnt) {
+            pthread_cond_broadcast(&p->done_cond);
+        }
+    }
+    pthread_mutex_unlock(&p->mutex);
+    return NULL;
+}
+
+static uint32_t
+inflate_pool_lock_wait_test(void /* struct appdata * with wait_param is in ebx */) {
+    appdata_t *app;
+    __asm__ __volatile__ __inline__ ("":"=b"(app)::);
+    struct inflate_pool *p = app->wait_param;
+    if (p->busy || pthread_mutex_trylock(&p->mutex)) {
+        return 0;
+    }
+    p->busy = 1;
+    return 1;
+}
+
+static uint32_t
+inflate_pool_done_wait_test(void /* struct appdata * with wait_param is in ebx */) {
+    appdata_t *app;
+    __asm__ __volatile__ __inline__ ("":"=b"(app)::);
+    struct inflate_pool *p = app->wait_param;
+    return atomic_load_explicit(&p->done, memory_order_acquire) == p->job_cnt;
+}
+
+void
+inflate_pool_run(struct inflate_pool *p, struct inflate_job *jobs, size_t cnt) {
+    int async = *p->io->running == UMKA_RUNNING_YES;
+    if (async) {
+        kos_wait_events(inflate_pool_lock_wait_test, p);
+    } else {
+        // nothing else is submitted while the kernel doesn't run
+        pthread_mutex_lock(&p->mutex);
+        p->busy = 1;
+    }
+    atomic_store_explicit(&p->done, 0, memory_order_relaxed);
+    p->jobs = jobs;
+    p->job_cnt = cnt;
+    p->next = 0;
+    pthread_cond_broadcast(&p->cond);
+    if (async) {
+        pthread_mutex_unlock(&p->mutex);
+        kos_wait_events(inflate_pool_done_wait_test, p);
+    } else {
+        while (atomic_load_explicit(&p->done, memory_order_acquire) != cnt) {
+            pthread_cond_wait(&p->done_cond, &p->mutex);
+        }
+        pthread_mutex_unlock(&p->mutex);
+    }
+    p->busy = 0;
+}
+
+struct inflate_pool *
+inflate_pool_init(size_t thread_cnt, size_t scratch_size, size_t work_size,
+                  inflate_func_t inflate, const struct umka_io *io) {
+    struct inflate_pool *p = calloc(1, sizeof(struct inflate_pool));
+    if (!p) {
+        return NULL;
+    }
+    p->io = io;
+    p->inflate = inflate;
+    p->scratch_size = scratch_size;
+    p->work_size = work_size;
+    p->workers = calloc(thread_cnt, sizeof(struct inflate_worker));
+    if (!p->workers) {
+        free(p);
+        return NULL;
+    }
+    pthread_mutex_init(&p->mutex, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    pthread_cond_init(&p->done_cond, NULL);
+#ifndef _WIN32
+    // the timer and irq signals must only be delivered to the kernel's thread
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+#endif
+    for (size_t i = 0; i < thread_cnt; i++) {
+        struct inflate_worker *w = p->workers + i;
+        w->pool = p;
+        w->scratch = malloc(scratch_size);
+        w->work = work_size ? malloc(work_size) : NULL;
+        if (!w->scratch || (work_size && !w->work)
+            || pthread_create(&w->thread, NULL, inflate_worker_thread, w)) {
+            free(w->scratch);
+            free(w->work);
+            break;
+        }
+        p->thread_cnt++;
+    }
+#ifndef _WIN32
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+#endif
+    if (p->thread_cnt != thread_cnt) {
+        fprintf(stderr, "[vdisk] can't start inflate threads\n");
+        inflate_pool_close(p);
+        return NULL;
+    }
+    return p;
+}
+
+void
+inflate_pool_close(struct inflate_pool *p) {
+    pthread_mutex_lock(&p->mutex);
+    p->stop = 1;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->mutex);
+    for (size_t i = 0; i < p->thread_cnt; i++) {
+        pthread_join(p->workers[i].thread, NULL);
+        free(p->workers[i].scratch);
+        free(p->workers[i].work);
+    }
+    pthread_cond_destroy(&p->done_cond);
+    pthread_cond_destroy(&p->cond);
+    pthread_mutex_destroy(&p->mutex);
+    free(p->workers);
+    free(p);
+}
@@ -0,0 +1,52 @@
+/*
+    SPDX-License-Identifier: GPL-2.0-or-later
+
+    UMKa - User-Mode KolibriOS developer tools
+    vdisk - virtual disk, pool of threads decompressing clusters
+
+    Copyright (C) 2023  Ivan Baravy <dunkaist@gmail.com>
+*/
+
+#ifndef VDISK_INFLATE_POOL_H_INCLUDED
+#define VDISK_INFLATE_POOL_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "umkaio.h"
+
+// Returns the number of bytes written to dst or (size_t)-1 on bad input. Work
+// is a private memory area of the decoder, it isn't shared between threads.
+typedef size_t (*inflate_func_t)(void *work, const void *src, size_t src_len,
+                                 uint8_t *dst, size_t dst_len);
+
+// Compressed data is read from the file to the worker's scratch buffer and
+// inflated to dst, the rest of dst is zeroed. On failure res is -1 and err is
+// errno of the failed read or 0 if the data can't be inflated.
+struct inflate_job {
+    int fd;
+    off_t offset;
+    size_t src_len;
+    uint8_t *dst;
+    size_t dst_len;
+    ssize_t res;
+    int err;
+};
+
+struct inflate_pool;
+
+// Every thread gets a scratch buffer of scratch_size bytes, src_len of a job
+// must not exceed it, and a work area of work_size bytes for the decoder
+struct inflate_pool *
+inflate_pool_init(size_t thread_cnt, size_t scratch_size, size_t work_size,
+                  inflate_func_t inflate, const struct umka_io *io);
+
+void
+inflate_pool_close(struct inflate_pool *p);
+
+// Runs all the jobs in parallel and waits for them to complete. A batch
+// submitted while another one runs waits for it first.
+void
+inflate_pool_run(struct inflate_pool *p, struct inflate_job *jobs, size_t cnt);
+
+#endif  // VDISK_INFLATE_POOL_H_INCLUDED
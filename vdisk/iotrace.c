@@ -0,0 +1,322 @@
+/*
+    SPDX-License-Identifier: GPL-2.0-or-later
+
+    UMKa - User-Mode KolibriOS developer tools
+    vdisk - virtual disk, block I/O trace recording and replay
+
+    Copyright (C) 2023  Ivan Baravy <dunkaist@gmail.com>
+*/
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../trace.h"
+#include "iotrace.h"
+
+struct vdisk_iotrace {
+    struct vdisk vdisk;
+    struct vdisk *base;
+    FILE *f;
+    uint64_t start_ns;
+};
+
+struct iotrace_record {
+    uint64_t time_ns;
+    uint64_t sector;
+    uint32_t cnt;
+    uint16_t slot;
+    uint8_t op;
+    uint8_t status;
+};
+
+static uint64_t
+iotrace_time_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+put_le(uint8_t *p, uint64_t x, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        p[i] = x >> (i * 8);
+    }
+}
+
+static uint64_t
+get_le(const uint8_t *p, size_t len) {
+    uint64_t x = 0;
+    for (size_t i = 0; i < len; i++) {
+        x |= (uint64_t)p[i] << (i * 8);
+    }
+    return x;
+}
+
+static void
+iotrace_record(struct vdisk_iotrace *d, uint64_t time_ns, int op,
+               uint64_t sector, size_t cnt, int status) {
+    if (!d->f) {
+        return;
+    }
+    uint8_t r[IOTRACE_RECORD_SIZE];
+    put_le(r + 0, time_ns - d->start_ns, 8);
+    put_le(r + 8, sector, 8);
+    put_le(r + 16, cnt, 4);
+    put_le(r + 20, kos_current_slot_idx, 2);
+    r[22] = op;
+    r[23] = status != KOS_ERROR_SUCCESS;
+    if (fwrite(r, sizeof(r), 1, d->f) != 1) {
+        fprintf(stderr, "[vdisk.iotrace] can't write to trace file: %s,"
+                " recording is stopped\n", strerror(errno));
+        fclose(d->f);
+        d->f = NULL;
+    }
+}
+
+STDCALL void
+vdisk_iotrace_close(void *userdata) {
+    COVERAGE_OFF();
+    struct vdisk_iotrace *d = userdata;
+    d->base->diskfunc.close(d->base);
+    COVERAGE_OFF();
+    if (d->f && fclose(d->f)) {
+        fprintf(stderr, "[vdisk.iotrace] can't write to trace file: %s\n",
+                strerror(errno));
+    }
+    free(d);
+    COVERAGE_ON();
+}
+
+// Requests are recorded when they complete, with the time they started at
+STDCALL int
+vdisk_iotrace_read(void *userdata, void *buffer, off_t startsector,
+                   size_t *numsectors) {
+    COVERAGE_OFF();
+    struct vdisk_iotrace *d = userdata;
+    size_t cnt = *numsectors;
+    uint64_t time_ns = iotrace_time_ns();
+    int status = d->base->diskfunc.read(d->base, buffer, startsector,
+                                        numsectors);
+    COVERAGE_OFF();
+    iotrace_record(d, time_ns, IOTRACE_OP_READ, startsector, cnt, status);
+    COVERAGE_ON();
+    return status;
+}
+
+STDCALL int
+vdisk_iotrace_write(void *userdata, void *buffer, off_t startsector,
+                    size_t *numsectors) {
+    COVERAGE_OFF();
+    struct vdisk_iotrace *d = userdata;
+    size_t cnt = *numsectors;
+    uint64_t time_ns = iotrace_time_ns();
+    int status = d->base->diskfunc.write(d->base, buffer, startsector,
+                                         numsectors);
+    COVERAGE_OFF();
+    iotrace_record(d, time_ns, IOTRACE_OP_WRITE, startsector, cnt, status);
+    COVERAGE_ON();
+    return status;
+}
+
+STDCALL int
+vdisk_iotrace_flush(void *userdata) {
+    COVERAGE_OFF();
+    struct vdisk_iotrace *d = userdata;
+    uint64_t time_ns = iotrace_time_ns();
+    int status = d->base->diskfunc.flush(d->base);
+    COVERAGE_OFF();
+    iotrace_record(d, time_ns, IOTRACE_OP_FLUSH, 0, 0, status);
+    COVERAGE_ON();
+    return status;
+}
+
+static int
+vdisk_iotrace_block_status(struct vdisk *vdisk, uint64_t sector,
+                           uint64_t *cnt) {
+    struct vdisk_iotrace *d = (struct vdisk_iotrace*)vdisk;
+    return d->base->block_status(d->base, sector, cnt);
+}
+
+static int
+vdisk_iotrace_discard(struct vdisk *vdisk, uint64_t sector, uint64_t cnt) {
+    struct vdisk_iotrace *d = (struct vdisk_iotrace*)vdisk;
+    uint64_t time_ns = iotrace_time_ns();
+    int status = d->base->discard(d->base, sector, cnt);
+    iotrace_record(d, time_ns, IOTRACE_OP_DISCARD, sector, cnt, status);
+    return status;
+}
+
+struct vdisk*
+vdisk_init_iotrace(struct vdisk *base, const char *trace_fname,
+                   const struct umka_io *io) {
+    struct vdisk_iotrace *d = calloc(1, sizeof(struct vdisk_iotrace));
+    if (!d) {
+        fprintf(stderr, "[vdisk.iotrace] can't allocate memory\n");
+        return NULL;
+    }
+    d->vdisk = (struct vdisk){.diskfunc = {.strucsize = sizeof(diskfunc_t),
+                                           .close = vdisk_iotrace_close,
+                                           .read = vdisk_iotrace_read,
+                                           .write = vdisk_iotrace_write,
+                                           .flush = vdisk_iotrace_flush,
+                                          },
+                              .sect_size = base->sect_size,
+                              .sect_cnt = base->sect_cnt,
+                              .io = io,
+                             };
+    if (base->block_status) {
+        d->vdisk.block_status = vdisk_iotrace_block_status;
+    }
+    if (base->discard) {
+        d->vdisk.discard = vdisk_iotrace_discard;
+    }
+    d->base = base;
+    d->f = fopen(trace_fname, "wb");
+    if (!d->f) {
+        fprintf(stderr, "[vdisk.iotrace] can't open trace file '%s': %s\n",
+                trace_fname, strerror(errno));
+        free(d);
+        return NULL;
+    }
+    uint8_t header[IOTRACE_HEADER_SIZE] = {0};
+    memcpy(header, IOTRACE_MAGIC, 8);
+    put_le(header + 8, IOTRACE_VERSION, 4);
+    put_le(header + 12, base->sect_size, 4);
+    put_le(header + 16, base->sect_cnt, 8);
+    if (fwrite(header, sizeof(header), 1, d->f) != 1) {
+        fprintf(stderr, "[vdisk.iotrace] can't write to trace file '%s': %s\n",
+                trace_fname, strerror(errno));
+        fclose(d->f);
+        free(d);
+        return NULL;
+    }
+    d->start_ns = iotrace_time_ns();
+    return (struct vdisk*)d;
+}
+
+static int
+iotrace_read_record(FILE *f, struct iotrace_record *r) {
+    uint8_t b[IOTRACE_RECORD_SIZE];
+    if (fread(b, sizeof(b), 1, f) != 1) {
+        return -1;
+    }
+    *r = (struct iotrace_record){.time_ns = get_le(b + 0, 8),
+                                 .sector = get_le(b + 8, 8),
+                                 .cnt = get_le(b + 16, 4),
+                                 .slot = get_le(b + 20, 2),
+                                 .op = b[22],
+                                 .status = b[23]};
+    return 0;
+}
+
+static void
+iotrace_sleep_until(uint64_t deadline_ns) {
+    uint64_t now = iotrace_time_ns();
+    if (now < deadline_ns) {
+        uint64_t ns = deadline_ns - now;
+        struct timespec ts = {.tv_sec = ns / 1000000000,
+                              .tv_nsec = ns % 1000000000};
+        while (nanosleep(&ts, &ts) == -1 && errno == EINTR) {}
+    }
+}
+
+// The disk callbacks switch coverage on when they return
+static int
+iotrace_replay_record(struct vdisk *disk, const struct iotrace_record *r,
+                      uint8_t *buf) {
+    size_t numsectors = r->cnt;
+    int status;
+    switch (r->op) {
+    case IOTRACE_OP_READ:
+        status = disk->diskfunc.read(disk, buf, r->sector, &numsectors);
+        break;
+    case IOTRACE_OP_WRITE:
+        // earlier reads leave their data in the buffer
+        memset(buf, 0, numsectors * disk->sect_size);
+        status = disk->diskfunc.write(disk, buf, r->sector, &numsectors);
+        break;
+    case IOTRACE_OP_DISCARD:
+        return disk->discard(disk, r->sector, r->cnt);
+    default:
+        status = disk->diskfunc.flush(disk);
+        break;
+    }
+    COVERAGE_OFF();
+    return status;
+}
+
+int
+iotrace_replay(struct vdisk *disk, const char *trace_fname, int timed,
+               struct iotrace_replay_stats *stats) {
+    *stats = (struct iotrace_replay_stats){0};
+    FILE *f = fopen(trace_fname, "rb");
+    if (!f) {
+        fprintf(stderr, "[vdisk.iotrace] can't open trace file '%s': %s\n",
+                trace_fname, strerror(errno));
+        return -1;
+    }
+    uint8_t header[IOTRACE_HEADER_SIZE];
+    if (fread(header, sizeof(header), 1, f) != 1
+        || memcmp(header, IOTRACE_MAGIC, 8)
+        || get_le(header + 8, 4) != IOTRACE_VERSION) {
+        fprintf(stderr, "[vdisk.iotrace] '%s' is not a trace\n", trace_fname);
+        fclose(f);
+        return -1;
+    }
+    if (get_le(header + 12, 4) != disk->sect_size) {
+        fprintf(stderr, "[vdisk.iotrace] trace sector size differs\n");
+        fclose(f);
+        return -1;
+    }
+    uint8_t *buf = NULL;
+    size_t buf_sects = 0;
+    int status = 0;
+    struct iotrace_record r;
+    uint64_t first_ns = 0;
+    uint64_t start_ns = iotrace_time_ns();
+    while (!iotrace_read_record(f, &r)) {
+        if (r.op > IOTRACE_OP_DISCARD) {
+            fprintf(stderr, "[vdisk.iotrace] bad record in '%s'\n",
+                    trace_fname);
+            status = -1;
+            break;
+        }
+        if ((r.op != IOTRACE_OP_FLUSH
+             && (r.sector >= disk->sect_cnt
+                 || disk->sect_cnt - r.sector < r.cnt))
+            || (r.op == IOTRACE_OP_DISCARD && !disk->discard)) {
+            stats->skipped++;
+            continue;
+        }
+        if (r.op != IOTRACE_OP_DISCARD && r.cnt > buf_sects) {
+            uint8_t *b = realloc(buf, (size_t)r.cnt * disk->sect_size);
+            if (!b) {
+                fprintf(stderr, "[vdisk.iotrace] can't allocate memory\n");
+                status = -1;
+                break;
+            }
+            buf = b;
+            buf_sects = r.cnt;
+        }
+        if (!stats->cnt) {
+            first_ns = r.time_ns;
+        }
+        if (timed) {
+            iotrace_sleep_until(start_ns + (r.time_ns - first_ns));
+        }
+        if (iotrace_replay_record(disk, &r, buf) != KOS_ERROR_SUCCESS) {
+            stats->errors++;
+        }
+        stats->cnt++;
+        if (r.op != IOTRACE_OP_DISCARD) {
+            stats->bytes += (uint64_t)r.cnt * disk->sect_size;
+        }
+    }
+    stats->time_ns = iotrace_time_ns() - start_ns;
+    free(buf);
+    fclose(f);
+    return status;
+}
@@ -0,0 +1,54 @@
+/*
+    SPDX-License-Identifier: GPL-2.0-or-later
+
+    UMKa - User-Mode KolibriOS developer tools
+    vdisk - virtual disk, block I/O trace recording and replay
+
+    Copyright (C) 2023  Ivan Baravy <dunkaist@gmail.com>
+*/
+
+#ifndef VDISK_IOTRACE_H_INCLUDED
+#define VDISK_IOTRACE_H_INCLUDED
+
+#include <stdint.h>
+#include "vdisk.h"
+#include "umkaio.h"
+
+// A trace is a header followed by records, all numbers are little endian.
+//   header: magic[8], u32 version, u32 sector size, u64 sector count,
+//           u64 reserved
+//   record: u64 time in ns since the disk was added, u64 sector,
+//           u32 sector count, u16 thread slot, u8 op, u8 status
+#define IOTRACE_MAGIC "UMKAIOTR"
+#define IOTRACE_VERSION 1
+#define IOTRACE_HEADER_SIZE 32
+#define IOTRACE_RECORD_SIZE 24
+
+enum {
+    IOTRACE_OP_READ,
+    IOTRACE_OP_WRITE,
+    IOTRACE_OP_FLUSH,
+    IOTRACE_OP_DISCARD,
+};
+
+struct iotrace_replay_stats {
+    uint64_t cnt;
+    uint64_t errors;
+    uint64_t skipped;   // beyond the end of the disk or can't be discarded
+    uint64_t bytes;
+    uint64_t time_ns;
+};
+
+// Takes ownership of base. Every request to the disk is recorded to the
+// trace file, it is created or truncated.
+struct vdisk*
+vdisk_init_iotrace(struct vdisk *base, const char *trace_fname,
+                   const struct umka_io *io);
+
+// Sends the requests of the trace to the disk, as fast as possible or at the
+// recorded times. Writes put zeroes. Returns -1 if the trace can't be read.
+int
+iotrace_replay(struct vdisk *disk, const char *trace_fname, int timed,
+               struct iotrace_replay_stats *stats);
+
+#endif  // VDISK_IOTRACE_H_INCLUDED
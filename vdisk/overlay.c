@@ -0,0 +1,418 @@
+/*
+    SPDX-License-Identifier: GPL-2.0-or-later
+
+    UMKa - User-Mode KolibriOS developer tools
+    vdisk - virtual disk, copy-on-write overlay
+
+    Copyright (C) 2023  Ivan Baravy <dunkaist@gmail.com>
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../trace.h"
+#include "umkaio.h"
+#include "overlay.h"
+
+// In-memory clusters are kept in a two-level table so that untouched parts
+// of a large disk cost nothing
+#define OVERLAY_MAP_L2_BITS 10
+#define OVERLAY_MAP_L2_SIZE (1u << OVERLAY_MAP_L2_BITS)
+#define OVERLAY_MAP_L2_MASK (OVERLAY_MAP_L2_SIZE - 1)
+
+struct vdisk_overlay {
+    struct vdisk vdisk;
+    struct vdisk *base;
+    uint32_t cluster_size;
+    uint32_t cluster_sects;
+    uint64_t cluster_cnt;
+    uint8_t ***map;     // in-memory delta, NULL if delta file is used
+    uint32_t *present;  // delta file: bitmap of clusters written
+    int fd;             // delta file, guest offsets are kept as is
+    char *delta_fname;
+    uint8_t *cluster;   // read-modify-write buffer for delta file
+    int lock;           // see vdisk_lock
+};
+
+static int
+overlay_has_cluster(const struct vdisk_overlay *d, uint64_t idx) {
+    if (d->map) {
+        uint8_t **l2 = d->map[idx >> OVERLAY_MAP_L2_BITS];
+        return l2 && l2[idx & OVERLAY_MAP_L2_MASK];
+    } else {
+        return (d->present[idx / 32] >> (idx % 32)) & 1u;
+    }
+}
+
+static uint8_t *
+overlay_map_get(const struct vdisk_overlay *d, uint64_t idx) {
+    return d->map[idx >> OVERLAY_MAP_L2_BITS][idx & OVERLAY_MAP_L2_MASK];
+}
+
+static int
+overlay_map_set(struct vdisk_overlay *d, uint64_t idx, uint8_t *cluster) {
+    uint8_t ***l2 = d->map + (idx >> OVERLAY_MAP_L2_BITS);
+    if (!*l2) {
+        *l2 = calloc(OVERLAY_MAP_L2_SIZE, sizeof(uint8_t*));
+        if (!*l2) {
+            return -1;
+        }
+    }
+    (*l2)[idx & OVERLAY_MAP_L2_MASK] = cluster;
+    return 0;
+}
+
+// The base disk switches coverage on when it returns
+static int
+overlay_base_read(struct vdisk_overlay *d, void *buf, uint64_t sector,
+                  size_t cnt) {
+    size_t numsectors = cnt;
+    int status = d->base->diskfunc.read(d->base, buf, sector, &numsectors);
+    COVERAGE_OFF();
+    return status;
+}
+
+static int
+overlay_delta_pread(struct vdisk_overlay *d, uint8_t *buf, size_t count,
+                    off_t offset) {
+    size_t done = 0;
+    while (done < count) {
+        ssize_t res = io_pread(d->fd, buf + done, count - done, offset + done,
+                               d->vdisk.io);
+        if (res == -1 && errno == EINTR) {
+            continue;
+        } else if (res <= 0) {
+            fprintf(stderr, "[vdisk.overlay] can't read from delta file: %s\n",
+                    res ? strerror(errno) : "unexpected end of file");
+            return -1;
+        }
+        done += res;
+    }
+    return 0;
+}
+
+static int
+overlay_delta_pwrite(struct vdisk_overlay *d, const uint8_t *buf, size_t count,
+                     off_t offset) {
+    size_t done = 0;
+    while (done < count) {
+        ssize_t res = io_pwrite(d->fd, buf + done, count - done, offset + done,
+                                d->vdisk.io);
+        if (res == -1 && errno == EINTR) {
+            continue;
+        } else if (res <= 0) {
+            fprintf(stderr, "[vdisk.overlay] can't write to delta file: %s\n",
+                    res ? strerror(errno) : "no progress");
+            return -1;
+        }
+        done += res;
+    }
+    return 0;
+}
+
+// Number of sectors of cluster idx, the last one may be cut by the disk end
+static size_t
+overlay_cluster_sects(const struct vdisk_overlay *d, uint64_t idx) {
+    uint64_t first = idx * d->cluster_sects;
+    uint64_t left = d->vdisk.sect_cnt - first;
+    return left < d->cluster_sects ? left : d->cluster_sects;
+}
+
+STDCALL void
+vdisk_overlay_close(void *userdata) {
+    COVERAGE_OFF();
+    struct vdisk_overlay *d = userdata;
+    if (d->map) {
+        uint64_t l1_cnt = (d->cluster_cnt + OVERLAY_MAP_L2_MASK)
+                          >> OVERLAY_MAP_L2_BITS;
+        for (uint64_t i = 0; i < l1_cnt; i++) {
+            if (!d->map[i]) {
+                continue;
+            }
+            for (size_t j = 0; j < OVERLAY_MAP_L2_SIZE; j++) {
+                free(d->map[i][j]);
+            }
+            free(d->map[i]);
+        }
+        free(d->map);
+    } else {
+        close(d->fd);
+        unlink(d->delta_fname);
+        free(d->delta_fname);
+        free(d->present);
+        free(d->cluster);
+    }
+    d->base->diskfunc.close(d->base);
+    COVERAGE_OFF();
+    free(d);
+    COVERAGE_ON();
+}
+
+STDCALL int
+vdisk_overlay_read(void *userdata, void *buffer, off_t startsector,
+                   size_t *numsectors) {
+    COVERAGE_OFF();
+    struct vdisk_overlay *d = userdata;
+    uint8_t *buf = buffer;
+    uint64_t sector = startsector;
+    uint64_t end = sector + *numsectors;
+    uint32_t sect_size = d->vdisk.sect_size;
+    if (end > d->vdisk.sect_cnt) {
+        end = d->vdisk.sect_cnt;
+    }
+    int status = KOS_ERROR_SUCCESS;
+    // a write may yield with a cluster half filled
+    vdisk_lock(&d->lock, d->vdisk.io);
+    while (sector < end) {
+        // find a run of clusters that are all either in the delta or not
+        uint64_t idx = sector / d->cluster_sects;
+        int has = overlay_has_cluster(d, idx);
+        uint64_t run_end = (idx + 1) * d->cluster_sects;
+        while (run_end < end && overlay_has_cluster(d, ++idx) == has) {
+            run_end += d->cluster_sects;
+        }
+        if (run_end > end) {
+            run_end = end;
+        }
+        size_t cnt = run_end - sector;
+        if (!has) {
+            status = overlay_base_read(d, buf, sector, cnt);
+        } else if (d->map) {
+            for (uint64_t s = sector; s < run_end; ) {
+                uint64_t i = s / d->cluster_sects;
+                uint64_t cend = (i + 1) * d->cluster_sects;
+                if (cend > run_end) {
+                    cend = run_end;
+                }
+                size_t off = (s - i * d->cluster_sects) * sect_size;
+                memcpy(buf + (s - sector) * sect_size,
+                       overlay_map_get(d, i) + off, (cend - s) * sect_size);
+                s = cend;
+            }
+        } else if (overlay_delta_pread(d, buf, cnt * sect_size,
+                                       sector * sect_size)) {
+            status = KOS_ERROR_DEVICE;
+        }
+        if (status != KOS_ERROR_SUCCESS) {
+            break;
+        }
+        buf += cnt * sect_size;
+        sector = run_end;
+    }
+    vdisk_unlock(&d->lock);
+    if (status == KOS_ERROR_SUCCESS && sector - startsector != *numsectors) {
+        status = KOS_ERROR_DEVICE;
+    }
+    *numsectors = sector - startsector;
+    COVERAGE_ON();
+    return status;
+}
+
+// Partially written clusters are filled from the base first
+static int
+overlay_write_cluster(struct vdisk_overlay *d, uint64_t idx, size_t off,
+                      const uint8_t *data, size_t len) {
+    int has = overlay_has_cluster(d, idx);
+    size_t csize = overlay_cluster_sects(d, idx) * d->vdisk.sect_size;
+    off_t coffset = (off_t)idx * d->cluster_size;
+    int whole = off == 0 && len == csize;
+    if (d->map) {
+        if (has) {
+            memcpy(overlay_map_get(d, idx) + off, data, len);
+            return KOS_ERROR_SUCCESS;
+        }
+        uint8_t *cluster = malloc(d->cluster_size);
+        if (!cluster) {
+            fprintf(stderr, "[vdisk.overlay] can't allocate cluster\n");
+            return KOS_ERROR_DEVICE;
+        }
+        if (!whole) {
+            int status = overlay_base_read(d, cluster, idx * d->cluster_sects,
+                                           csize / d->vdisk.sect_size);
+            if (status != KOS_ERROR_SUCCESS) {
+                free(cluster);
+                return status;
+            }
+        }
+        memcpy(cluster + off, data, len);
+        if (overlay_map_set(d, idx, cluster)) {
+            fprintf(stderr, "[vdisk.overlay] can't allocate map\n");
+            free(cluster);
+            return KOS_ERROR_DEVICE;
+        }
+        return KOS_ERROR_SUCCESS;
+    }
+    if (has || whole) {
+        if (overlay_delta_pwrite(d, data, len, coffset + off)) {
+            return KOS_ERROR_DEVICE;
+        }
+    } else {
+        int status = overlay_base_read(d, d->cluster, idx * d->cluster_sects,
+                                       csize / d->vdisk.sect_size);
+        if (status != KOS_ERROR_SUCCESS) {
+            return status;
+        }
+        memcpy(d->cluster + off, data, len);
+        if (overlay_delta_pwrite(d, d->cluster, csize, coffset)) {
+            return KOS_ERROR_DEVICE;
+        }
+    }
+    d->present[idx / 32] |= 1u << (idx % 32);
+    return KOS_ERROR_SUCCESS;
+}
+
+STDCALL int
+vdisk_overlay_write(void *userdata, void *buffer, off_t startsector,
+                    size_t *numsectors) {
+    COVERAGE_OFF();
+    struct vdisk_overlay *d = userdata;
+    const uint8_t *buf = buffer;
+    uint64_t sector = startsector;
+    uint64_t end = sector + *numsectors;
+    uint32_t sect_size = d->vdisk.sect_size;
+    if (end > d->vdisk.sect_cnt) {
+        end = d->vdisk.sect_cnt;
+    }
+    int status = KOS_ERROR_SUCCESS;
+    // read-modify-write of a cluster yields in the middle
+    vdisk_lock(&d->lock, d->vdisk.io);
+    while (sector < end) {
+        uint64_t idx = sector / d->cluster_sects;
+        uint64_t cend = (idx + 1) * d->cluster_sects;
+        if (cend > end) {
+            cend = end;
+        }
+        size_t off = (sector - idx * d->cluster_sects) * sect_size;
+        size_t len = (cend - sector) * sect_size;
+        status = overlay_write_cluster(d, idx, off, buf, len);
+        if (status != KOS_ERROR_SUCCESS) {
+            break;
+        }
+        buf += len;
+        sector = cend;
+    }
+    vdisk_unlock(&d->lock);
+    if (status == KOS_ERROR_SUCCESS && sector - startsector != *numsectors) {
+        status = KOS_ERROR_DEVICE;
+    }
+    *numsectors = sector - startsector;
+    COVERAGE_ON();
+    return status;
+}
+
+// Whole clusters in the range are dropped from the delta, they read from the
+// base again. The base is never changed.
+static int
+vdisk_overlay_discard(struct vdisk *vdisk, uint64_t sector, uint64_t cnt) {
+    struct vdisk_overlay *d = (struct vdisk_overlay*)vdisk;
+    uint64_t end = sector + cnt;
+    if (end > vdisk->sect_cnt) {
+        end = vdisk->sect_cnt;
+    }
+    uint64_t first = (sector + d->cluster_sects - 1) / d->cluster_sects;
+    uint64_t last = end / d->cluster_sects;
+    if (end == vdisk->sect_cnt) {
+        last = d->cluster_cnt;
+    }
+    vdisk_lock(&d->lock, vdisk->io);
+    for (uint64_t idx = first; idx < last; idx++) {
+        if (!overlay_has_cluster(d, idx)) {
+            continue;
+        }
+        if (d->map) {
+            free(overlay_map_get(d, idx));
+            overlay_map_set(d, idx, NULL);
+            continue;
+        }
+        d->present[idx / 32] &= ~(1u << (idx % 32));
+        if (io_punch_hole(d->fd, (off_t)idx * d->cluster_size,
+                          d->cluster_size, vdisk->io)) {
+            fprintf(stderr, "[vdisk.overlay] can't punch hole in delta file:"
+                    " %s\n", strerror(errno));
+        }
+    }
+    vdisk_unlock(&d->lock);
+    return KOS_ERROR_SUCCESS;
+}
+
+// The delta is discarded on close, so there is nothing to make durable
+STDCALL int
+vdisk_overlay_flush(void *userdata) {
+    COVERAGE_OFF();
+    (void)userdata;
+    COVERAGE_ON();
+    return KOS_ERROR_SUCCESS;
+}
+
+struct vdisk*
+vdisk_init_overlay(struct vdisk *base, const char *delta_fname,
+                   const struct umka_io *io) {
+    if (OVERLAY_CLUSTER_SIZE % base->sect_size) {
+        fprintf(stderr, "[vdisk.overlay] sector size %" PRIu32 " doesn't"
+                " divide cluster size\n", base->sect_size);
+        return NULL;
+    }
+    struct vdisk_overlay *d = calloc(1, sizeof(struct vdisk_overlay));
+    if (!d) {
+        fprintf(stderr, "[vdisk.overlay] can't allocate memory\n");
+        return NULL;
+    }
+    d->vdisk = (struct vdisk){.diskfunc = {.strucsize = sizeof(diskfunc_t),
+                                           .close = vdisk_overlay_close,
+                                           .read = vdisk_overlay_read,
+                                           .write = vdisk_overlay_write,
+                                           .flush = vdisk_overlay_flush,
+                                          },
+                              .sect_size = base->sect_size,
+                              .sect_cnt = base->sect_cnt,
+                              .io = io,
+                             };
+    d->vdisk.discard = vdisk_overlay_discard;
+    d->base = base;
+    d->cluster_size = OVERLAY_CLUSTER_SIZE;
+    d->cluster_sects = OVERLAY_CLUSTER_SIZE / base->sect_size;
+    d->cluster_cnt = (base->sect_cnt + d->cluster_sects - 1)
+                     / d->cluster_sects;
+    d->fd = -1;
+    if (!delta_fname) {
+        uint64_t l1_cnt = (d->cluster_cnt + OVERLAY_MAP_L2_MASK)
+                          >> OVERLAY_MAP_L2_BITS;
+        d->map = calloc(l1_cnt ? l1_cnt : 1, sizeof(uint8_t**));
+        if (!d->map) {
+            fprintf(stderr, "[vdisk.overlay] can't allocate map\n");
+            free(d);
+            return NULL;
+        }
+        return (struct vdisk*)d;
+    }
+    d->present = calloc((d->cluster_cnt + 31) / 32 + 1, sizeof(uint32_t));
+    d->cluster = malloc(d->cluster_size);
+    d->delta_fname = strdup(delta_fname);
+    if (!d->present || !d->cluster || !d->delta_fname) {
+        fprintf(stderr, "[vdisk.overlay] can't allocate memory\n");
+        goto err;
+    }
+    d->fd = open(delta_fname, O_RDWR | O_CREAT | O_TRUNC | O_BINARY, 0644);
+    if (d->fd == -1) {
+        fprintf(stderr, "[vdisk.overlay] can't open file '%s': %s\n",
+                delta_fname, strerror(errno));
+        goto err;
+    }
+    // holes cost nothing, only written clusters take space
+    if (ftruncate(d->fd, (off_t)d->vdisk.sect_cnt * d->vdisk.sect_size)) {
+        fprintf(stderr, "[vdisk.overlay] can't resize file '%s': %s\n",
+                delta_fname, strerror(errno));
+        close(d->fd);
+        unlink(delta_fname);
+        goto err;
+    }
+    return (struct vdisk*)d;
+err:
+    free(d->present);
+    free(d->cluster);
+    free(d->delta_fname);
+    free(d);
+    return NULL;
+}
@@ -0,0 +1,25 @@
+/*
+    SPDX-License-Identifier: GPL-2.0-or-later
+
+    UMKa - User-Mode KolibriOS developer tools
+    vdisk - virtual disk, copy-on-write overlay
+
+    Copyright (C) 2023  Ivan Baravy <dunkaist@gmail.com>
+*/
+
+#ifndef VDISK_OVERLAY_H_INCLUDED
+#define VDISK_OVERLAY_H_INCLUDED
+
+#include <stdio.h>
+#include "vdisk.h"
+#include "umkaio.h"
+
+#define OVERLAY_CLUSTER_SIZE 0x10000
+
+// Takes ownership of base. Writes go to delta_fname or to memory if it is
+// NULL, the base is never written. The delta is thrown away on close.
+struct vdisk*
+vdisk_init_overlay(struct vdisk *base, const char *delta_fname,
+                   const struct umka_io *io);
+
+#endif  // VDISK_OVERLAY_H_INCLUDED
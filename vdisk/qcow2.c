@@ -14,18 +14,53 @@
 #include "../trace.h"
 #include "qcow2.h"
 #include "umkaio.h"
+#include "cluster_cache.h"
+#include "inflate_pool.h"
 #include "em_inflate/em_inflate.h"
+#define ZSTD_STATIC_LINKING_ONLY    // ZSTD_initStaticDCtx
+#include "zstd/lib/zstd.h"
 
 #define L1_MAX_LEN (32u*1024u*1024u)
 #define L1_MAX_ENTRIES (L1_MAX_LEN / sizeof(uint64_t))
 
+#define QCOW2_INFLATE_JOBS_MAX 32
+// L1 is read and byte-swapped in pages of this many entries, on first use
+#define QCOW2_L1_PAGE_ENTRIES 512
+
+// Metadata clusters, L2 tables and refcount blocks, cached and written back
+struct qcow2_table {
+    uint64_t offset;    // in the image file, 0 if the slot is free
+    uint64_t last_use;
+    int dirty;
+    uint64_t *entries;
+};
+
+struct qcow2_l1_page {
+    uint64_t *entries;  // host byte order, NULL if not read yet
+    int dirty;
+};
+
+struct qcow2_table_cache {
+    struct qcow2_table *tables;
+    size_t size;
+    uint64_t *buf;
+    int swap;   // keep 64-bit entries in host byte order, for L2 tables
+    uint64_t clock;
+    struct cluster_cache_stats stats;
+};
+
 struct vdisk_qcow2 {
     struct vdisk vdisk;
     int fd;
     size_t cluster_bits;
     size_t cluster_size;
-    uint8_t *cluster;
-    uint8_t *cmp_cluster;
+    uint8_t *cmp_cluster;   // compressed data, see qcow2_get_cmp_buf
+    int cmp_cluster_busy;
+    uint8_t *wr_cluster;    // read-modify-write of a partial cluster
+    uint8_t *meta_buf;      // metadata converted to big endian
+    int meta_lock;          // metadata i/o, see qcow2_get_table
+    int write_lock;         // allocation and wr_cluster, across their i/o
+    int writable;
     uint64_t l1_table_offset;
     uint64_t l2_entry_cmp_x;
     uint64_t l2_entry_cmp_offset_mask;
@@ -34,10 +69,26 @@ struct vdisk_qcow2 {
     size_t refcount_order;
     size_t refcount_table_clusters;
     off_t refcount_table_offset;
+    uint64_t *refcount_table;   // host byte order, only if writable
+    size_t refcount_table_size;
+    int refcount_table_dirty;
+    size_t refcount_block_entries;
     size_t l1_size;
+    int l1_dirty;   // some of the pages are
     uint64_t sector_idx_mask;
-    uint64_t *l1;
-    uint64_t prev_cluster_index;
+    struct qcow2_l1_page *l1_pages;
+    size_t l1_page_cnt;
+    off_t file_end;     // new clusters are appended here
+    struct cluster_cache *std_cache;    // standard clusters as read
+    struct cluster_cache *cmp_cache;    // compressed clusters inflated
+    struct qcow2_table_cache l2_cache;
+    struct qcow2_table_cache refcount_cache;
+    struct vdisk *backing;  // unallocated clusters are read from it
+    inflate_func_t inflate;     // of compression_type
+    void *inflate_work;
+    size_t inflate_work_size;
+    size_t inflate_thread_cnt;
+    struct inflate_pool *inflate_pool;  // started on first use
 };
 
 #define QCOW2_MAGIC "QFI\xfb"
@@ -61,11 +112,30 @@ struct qcow2_header {
     uint64_t autoclear_features;
     uint32_t refcount_order;
     uint32_t header_length;
+    uint8_t compression_type;   // only if header_length is greater than 104
+    uint8_t padding[7];
+};
+
+#define QCOW2_INCOMPAT_COMPRESSION 0x8ULL  // compression_type isn't zlib
+#define QCOW2_HEADER_COMPRESSION_TYPE_OFFSET 104
+
+enum {
+    QCOW2_COMPRESSION_ZLIB,
+    QCOW2_COMPRESSION_ZSTD,
 };
 
 #define CLUSTER_FORMAT_STANDARD 0
 #define CLUSTER_FORMAT_COMPRESSED 1
 
+#define QCOW2_READ_RUNS_MAX 16
+
+enum {
+    QCOW2_CLUSTER_ZERO,     // zeroed, or unallocated without backing file
+    QCOW2_CLUSTER_UNALLOCATED,  // read from backing file
+    QCOW2_CLUSTER_STANDARD,
+    QCOW2_CLUSTER_COMPRESSED,
+};
+
 #define L1_ENTRY_OFFSET_MASK 0x00ffffffffffff00ULL
 #define L1_ENTRY_STATUS_MASK 0x8000000000000000ULL
 
@@ -74,6 +144,13 @@ struct qcow2_header {
 #define L2_ENTRY_FORMAT 0x4000000000000000ULL
 #define L2_ENTRY_STATUS 0x8000000000000000ULL
 
+#define REFCOUNT_TABLE_OFFSET_MASK 0xfffffffffffffe00ULL
+
+#define QCOW2_REFCOUNT_CACHE_SIZE 4
+
+#define QCOW2_BACKING_NAME_MAX 1023
+#define QCOW2_BACKING_DEPTH_MAX 16
+
 static inline uint32_t
 be32(void *p) {
     uint8_t *x = p;
@@ -90,114 +167,1204 @@ be64(void *p) {
            + ((uint64_t)x[1] << 48) + ((uint64_t)x[0] << 56);
 }
 
+static inline void
+put_be64(void *p, uint64_t v) {
+    uint8_t *x = p;
+    for (int i = 7; i >= 0; i--, v >>= 8) {
+        x[i] = v & 0xff;
+    }
+}
+
+static int
+qcow2_pwrite_full(struct vdisk_qcow2 *d, const void *buf, size_t count,
+                  off_t offset) {
+    ssize_t res = io_pwrite(d->fd, buf, count, offset, d->vdisk.io);
+    if (res != (ssize_t)count) {
+        fprintf(stderr, "[vdisk.qcow2] can't write to image file: %s\n",
+                res == -1 ? strerror(errno) : "short write");
+        return -1;
+    }
+    return 0;
+}
+
+static int
+qcow2_table_cache_init(struct vdisk_qcow2 *d, struct qcow2_table_cache *c,
+                       size_t size, int swap) {
+    c->swap = swap;
+    c->tables = (struct qcow2_table*)calloc(size, sizeof(struct qcow2_table));
+    c->buf = (uint64_t*)malloc(size * d->cluster_size);
+    if (!c->tables || !c->buf) {
+        fprintf(stderr, "[vdisk.qcow2] can't allocate memory: %s\n",
+                strerror(errno));
+        return -1;
+    }
+    c->size = size;
+    for (size_t i = 0; i < size; i++) {
+        c->tables[i].entries = c->buf
+                               + i * (d->cluster_size / sizeof(uint64_t));
+    }
+    io_register_buffer(d->vdisk.io, c->buf, size * d->cluster_size);
+    return 0;
+}
+
 static void
-qcow2_read_guest_sector(struct vdisk_qcow2 *d, uint64_t sector, uint8_t *buf) {
-    uint64_t cluster_offset;
-    size_t l2_entries = d->cluster_size / sizeof(uint64_t);
-    uint64_t offset = sector * d->vdisk.sect_size;
-    uint64_t cluster_index = offset / d->cluster_size;
-    uint64_t l1_index = (cluster_index) / l2_entries;
-    uint64_t l2_index = (cluster_index) % l2_entries;
-    uint64_t l1_entry = d->l1[l1_index];
-    uint64_t l2_entry;
-
-    if (cluster_index == d->prev_cluster_index) {
-        memcpy(buf,
-               d->cluster + (sector & d->sector_idx_mask) * d->vdisk.sect_size,
-               d->vdisk.sect_size);
-        return;
+qcow2_table_cache_close(struct vdisk_qcow2 *d, struct qcow2_table_cache *c) {
+    if (c->buf) {
+        io_unregister_buffer(d->vdisk.io, c->buf);
     }
-    d->prev_cluster_index = cluster_index;
+    free(c->tables);
+    free(c->buf);
+}
 
-    uint64_t l2_table_offset = l1_entry & L1_ENTRY_OFFSET_MASK;
-    if (!l2_table_offset) {
-        memset(buf, 0, d->vdisk.sect_size);
-        return;
+// The table is copied before it is written so that a slot being evicted can
+// be refilled and a table being flushed can be changed meanwhile
+static int
+qcow2_table_writeback(struct vdisk_qcow2 *d, struct qcow2_table_cache *c,
+                      struct qcow2_table *t, uint64_t offset) {
+    if (!t->dirty) {
+        return 0;
+    }
+    if (c->swap) {
+        size_t cnt = d->cluster_size / sizeof(uint64_t);
+        for (size_t i = 0; i < cnt; i++) {
+            put_be64(d->meta_buf + i * sizeof(uint64_t), t->entries[i]);
+        }
+    } else {
+        memcpy(d->meta_buf, t->entries, d->cluster_size);
+    }
+    t->dirty = 0;
+    if (qcow2_pwrite_full(d, d->meta_buf, d->cluster_size, offset)) {
+        t->dirty = 1;
+        return -1;
     }
-    lseek(d->fd, l2_table_offset + l2_index*sizeof(l2_entry), SEEK_SET);
-    if (!io_read(d->fd, &l2_entry, sizeof(l2_entry), d->vdisk.io)) {
+    return 0;
+}
+
+static int
+qcow2_table_cache_flush(struct vdisk_qcow2 *d, struct qcow2_table_cache *c) {
+    int status = 0;
+    vdisk_lock(&d->meta_lock, d->vdisk.io);
+    for (size_t i = 0; i < c->size; i++) {
+        struct qcow2_table *t = c->tables + i;
+        if (t->offset && qcow2_table_writeback(d, c, t, t->offset)) {
+            status = -1;
+        }
+    }
+    vdisk_unlock(&d->meta_lock);
+    return status;
+}
+
+static struct qcow2_table *
+qcow2_find_table(struct qcow2_table_cache *c, uint64_t offset) {
+    for (size_t i = 0; i < c->size; i++) {
+        struct qcow2_table *t = c->tables + i;
+        if (t->offset == offset) {
+            t->last_use = ++c->clock;
+            c->stats.hits++;
+            return t;
+        }
+    }
+    return NULL;
+}
+
+// Least recently used table is evicted. Reads may run in parallel and yield
+// in i/o, so misses are served one at a time with meta_lock held. The victim
+// slot is taken out of the cache before it is written back and refilled, and
+// the cache is searched again with the lock held as another thread may have
+// read the same table meanwhile. A table that is found stays valid until the
+// caller yields. If create is set the table is new and starts zeroed instead
+// of being read.
+static struct qcow2_table *
+qcow2_get_table(struct vdisk_qcow2 *d, struct qcow2_table_cache *c,
+                uint64_t offset, int create) {
+    struct qcow2_table *t = qcow2_find_table(c, offset);
+    if (t) {
+        return t;
+    }
+    vdisk_lock(&d->meta_lock, d->vdisk.io);
+    t = qcow2_find_table(c, offset);
+    if (t) {
+        vdisk_unlock(&d->meta_lock);
+        return t;
+    }
+    c->stats.misses++;
+    struct qcow2_table *victim = c->tables;
+    for (size_t i = 1; i < c->size; i++) {
+        if (c->tables[i].last_use < victim->last_use) {
+            victim = c->tables + i;
+        }
+    }
+    uint64_t victim_offset = victim->offset;
+    c->stats.evictions += victim_offset != 0;
+    victim->offset = 0;
+    victim->last_use = 0;
+    if (victim_offset && qcow2_table_writeback(d, c, victim, victim_offset)) {
+        victim->offset = victim_offset;
+        vdisk_unlock(&d->meta_lock);
+        return NULL;
+    }
+    if (create) {
+        memset(victim->entries, 0, d->cluster_size);
+        victim->dirty = 1;
+    } else {
+        ssize_t res = io_pread(d->fd, victim->entries, d->cluster_size,
+                               offset, d->vdisk.io);
+        if (res != (ssize_t)d->cluster_size) {
+            fprintf(stderr, "[vdisk.qcow2] can't read metadata: %s\n",
+                    res == -1 ? strerror(errno) : "unexpected end of file");
+            vdisk_unlock(&d->meta_lock);
+            return NULL;
+        }
+        if (c->swap) {
+            size_t cnt = d->cluster_size / sizeof(uint64_t);
+            for (uint64_t *x = victim->entries; x < victim->entries + cnt;
+                 x++) {
+                *x = be64(x);
+            }
+        }
+    }
+    victim->offset = offset;
+    victim->last_use = ++c->clock;
+    vdisk_unlock(&d->meta_lock);
+    return victim;
+}
+
+static uint64_t *
+qcow2_get_l2_table(struct vdisk_qcow2 *d, uint64_t l2_table_offset) {
+    struct qcow2_table *t = qcow2_get_table(d, &d->l2_cache, l2_table_offset,
+                                            0);
+    return t ? t->entries : NULL;
+}
+
+// Sparse images may have huge L1 tables with few entries ever used. The page
+// is read by somebody else meanwhile if another thread got there first.
+static uint64_t *
+qcow2_get_l1_entry(struct vdisk_qcow2 *d, uint64_t l1_index) {
+    struct qcow2_l1_page *page = d->l1_pages
+                                 + l1_index / QCOW2_L1_PAGE_ENTRIES;
+    size_t idx = l1_index % QCOW2_L1_PAGE_ENTRIES;
+    if (page->entries) {
+        return page->entries + idx;
+    }
+    size_t first = l1_index - idx;
+    size_t cnt = d->l1_size - first;
+    if (cnt > QCOW2_L1_PAGE_ENTRIES) {
+        cnt = QCOW2_L1_PAGE_ENTRIES;
+    }
+    uint64_t *entries = (uint64_t*)malloc(cnt * sizeof(uint64_t));
+    if (!entries) {
+        fprintf(stderr, "[vdisk.qcow2] can't allocate memory: %s\n",
+                strerror(errno));
+        return NULL;
+    }
+    ssize_t res = io_pread(d->fd, entries, cnt * sizeof(uint64_t),
+                           d->l1_table_offset + first * sizeof(uint64_t),
+                           d->vdisk.io);
+    if (res != (ssize_t)(cnt * sizeof(uint64_t))) {
+        fprintf(stderr, "[vdisk.qcow2] can't read L1 table: %s\n",
+                res == -1 ? strerror(errno) : "unexpected end of file");
+        free(entries);
+        return NULL;
+    }
+    if (page->entries) {
+        free(entries);
+        return page->entries + idx;
+    }
+    for (uint64_t *x = entries; x < entries + cnt; x++) {
+        *x = be64(x);
+    }
+    page->entries = entries;
+    return entries + idx;
+}
+
+static const uint8_t *
+qcow2_read_std_cluster(struct vdisk_qcow2 *d, uint64_t cluster_index,
+                       uint64_t host_offset) {
+    uint8_t *data = cluster_cache_lookup(d->std_cache, cluster_index);
+    if (data) {
+        return data;
+    }
+    struct cluster_cache_entry *e = cluster_cache_reserve(d->std_cache);
+    if (!e) {
+        fprintf(stderr, "[vdisk.qcow2] cluster cache is exhausted\n");
+        return NULL;
+    }
+    ssize_t res = io_pread(d->fd, e->data, d->cluster_size, host_offset,
+                           d->vdisk.io);
+    if (res == -1) {
         fprintf(stderr, "[vdisk.qcow2] can't read from image file: %s\n",
                 strerror(errno));
+        cluster_cache_release(d->std_cache, e);
+        return NULL;
+    }
+    // the last cluster of the image file may be cut
+    memset(e->data + res, 0, d->cluster_size - res);
+    cluster_cache_insert(d->std_cache, e, cluster_index);
+    return e->data;
+}
+
+// Compressed data ends somewhere in the last sector
+static int
+qcow2_cmp_extent(const struct vdisk_qcow2 *d, uint64_t l2_entry,
+                 off_t *cmp_offset, size_t *cmp_size) {
+    *cmp_offset = d->l2_entry_cmp_offset_mask & l2_entry;
+    size_t additional_sectors = (l2_entry & d->l2_entry_cmp_sect_cnt_mask)
+                                >> d->l2_entry_cmp_x;
+    *cmp_size = 512 - (*cmp_offset & 511) + additional_sectors*512;
+    if (*cmp_size > d->cluster_size*2) {
+        fprintf(stderr, "[vdisk.qcow2] bad compressed cluster size: %zu\n",
+                *cmp_size);
+        return -1;
+    }
+    return 0;
+}
+
+static size_t
+qcow2_inflate_zlib(void *work, const void *src, size_t src_len, uint8_t *dst,
+                   size_t dst_len) {
+    (void)work;
+    return em_inflate(src, src_len, dst, dst_len);
+}
+
+// A cluster is a single zstd frame, the rest of the last sector isn't a part
+// of it. The decoder context lives in the work area.
+static size_t
+qcow2_inflate_zstd(void *work, const void *src, size_t src_len, uint8_t *dst,
+                   size_t dst_len) {
+    size_t frame_len = ZSTD_findFrameCompressedSize(src, src_len);
+    if (ZSTD_isError(frame_len)) {
+        return (size_t)-1;
+    }
+    ZSTD_DCtx *dctx = ZSTD_initStaticDCtx(work, ZSTD_estimateDCtxSize());
+    size_t out = ZSTD_decompressDCtx(dctx, dst, dst_len, src, frame_len);
+    return ZSTD_isError(out) ? (size_t)-1 : out;
+}
+
+// Compressed data stays in the buffer while its read waits, so every request
+// inflating on the calling thread needs its own one. The registered buffer of
+// the disk is used if it's free, requests that overlap it get a new one.
+static uint8_t *
+qcow2_get_cmp_buf(struct vdisk_qcow2 *d) {
+    if (!d->cmp_cluster_busy) {
+        d->cmp_cluster_busy = 1;
+        return d->cmp_cluster;
+    }
+    uint8_t *buf = (uint8_t*)malloc(d->cluster_size*2);
+    if (!buf) {
+        fprintf(stderr, "[vdisk.qcow2] can't allocate memory: %s\n",
+                strerror(errno));
+    }
+    return buf;
+}
+
+static void
+qcow2_put_cmp_buf(struct vdisk_qcow2 *d, uint8_t *buf) {
+    if (buf == d->cmp_cluster) {
+        d->cmp_cluster_busy = 0;
+    } else {
+        free(buf);
+    }
+}
+
+// Inflates on the calling thread, src is a buffer of qcow2_get_cmp_buf. The
+// decoder doesn't wait, so its work area is shared by all the requests.
+static void
+qcow2_inflate_job(struct vdisk_qcow2 *d, struct inflate_job *job,
+                  uint8_t *src) {
+    ssize_t res = io_pread(job->fd, src, job->src_len, job->offset,
+                           d->vdisk.io);
+    size_t out = (size_t)-1;
+    if (res > 0) {
+        out = d->inflate(d->inflate_work, src, res, job->dst, job->dst_len);
+    }
+    if (out == (size_t)-1) {
+        job->res = -1;
+        job->err = res == -1 ? errno : 0;
         return;
     }
-    l2_entry = be64(&l2_entry);
-    if ((l2_entry & L2_ENTRY_FORMAT) == CLUSTER_FORMAT_STANDARD) {
-        if (l2_entry & L2_ENTRY_STD_ZEROED) {
-            printf("[vdisk.qcow2] cluster 0x%" PRIx64 " is zeroed\n",
-                   cluster_index);
-            memset(buf, 0, d->vdisk.sect_size);
-            return;
-        }
-        cluster_offset = l2_entry & L2_ENTRY_STD_OFFSET;
-        lseek(d->fd, cluster_offset, SEEK_SET);
-        if (!io_read(d->fd, d->cluster, d->cluster_size, d->vdisk.io)) {
-            fprintf(stderr, "[vdisk.qcow2] can't read from image file: %s\n",
-                    strerror(errno));
-            return;
+    memset(job->dst + out, 0, job->dst_len - out);
+    job->res = out;
+    job->err = 0;
+}
+
+static int
+qcow2_inflate_status(const struct inflate_job *job, uint64_t cluster_index) {
+    if (job->res != -1) {
+        return 0;
+    }
+    if (job->err) {
+        fprintf(stderr, "[vdisk.qcow2] can't read from image file: %s\n",
+                strerror(job->err));
+    } else {
+        fprintf(stderr, "[vdisk.qcow2] can't inflate cluster 0x%" PRIx64 "\n",
+                cluster_index);
+    }
+    return -1;
+}
+
+static const uint8_t *
+qcow2_read_cmp_cluster(struct vdisk_qcow2 *d, uint64_t cluster_index,
+                       uint64_t l2_entry) {
+    uint8_t *data = cluster_cache_lookup(d->cmp_cache, cluster_index);
+    if (data) {
+        return data;
+    }
+    struct inflate_job job = {.fd = d->fd, .dst_len = d->cluster_size};
+    if (qcow2_cmp_extent(d, l2_entry, &job.offset, &job.src_len)) {
+        return NULL;
+    }
+    uint8_t *src = qcow2_get_cmp_buf(d);
+    if (!src) {
+        return NULL;
+    }
+    struct cluster_cache_entry *e = cluster_cache_reserve(d->cmp_cache);
+    if (!e) {
+        fprintf(stderr, "[vdisk.qcow2] cluster cache is exhausted\n");
+        qcow2_put_cmp_buf(d, src);
+        return NULL;
+    }
+    job.dst = e->data;
+    qcow2_inflate_job(d, &job, src);
+    qcow2_put_cmp_buf(d, src);
+    if (qcow2_inflate_status(&job, cluster_index)) {
+        cluster_cache_release(d->cmp_cache, e);
+        return NULL;
+    }
+    cluster_cache_insert(d->cmp_cache, e, cluster_index);
+    return e->data;
+}
+
+// Whole compressed clusters are inflated straight into the buffer by the pool
+// threads, each job writes its own part of the buffer. The pool is started
+// when there is more than one cluster to inflate at once for the first time.
+static int
+qcow2_inflate_clusters(struct vdisk_qcow2 *d, struct inflate_job *jobs,
+                       const uint64_t *cluster_indices, size_t cnt) {
+    if (cnt > 1 && d->inflate_thread_cnt > 1 && !d->inflate_pool) {
+        d->inflate_pool = inflate_pool_init(d->inflate_thread_cnt,
+                                            d->cluster_size*2,
+                                            d->inflate_work_size, d->inflate,
+                                            d->vdisk.io);
+        if (!d->inflate_pool) {
+            d->inflate_thread_cnt = 1;
         }
+    }
+    if (cnt > 1 && d->inflate_pool) {
+        inflate_pool_run(d->inflate_pool, jobs, cnt);
     } else {
-        off_t cmp_offset = d->l2_entry_cmp_offset_mask & l2_entry;
-        printf("cmp_offset: 0x%" PRIx64 "\n", cmp_offset);
-        lseek(d->fd, cmp_offset, SEEK_SET);
-        size_t additional_sectors = (l2_entry & d->l2_entry_cmp_sect_cnt_mask)
-                                    >> d->l2_entry_cmp_x;
-        size_t cmp_size = 512 - (cmp_offset & 511) + additional_sectors*512;
-        if (!io_read(d->fd, d->cmp_cluster, d->cluster_size, d->vdisk.io)) {
+        uint8_t *src = qcow2_get_cmp_buf(d);
+        if (!src) {
+            return -1;
+        }
+        for (size_t i = 0; i < cnt; i++) {
+            qcow2_inflate_job(d, jobs + i, src);
+        }
+        qcow2_put_cmp_buf(d, src);
+    }
+    int status = 0;
+    for (size_t i = 0; i < cnt; i++) {
+        if (qcow2_inflate_status(jobs + i, cluster_indices[i])) {
+            status = -1;
+        }
+    }
+    return status;
+}
+
+// Finds where guest cluster lives, returns one of QCOW2_CLUSTER_* or -1
+static int
+qcow2_translate(struct vdisk_qcow2 *d, uint64_t cluster_index,
+                uint64_t *l2_entry) {
+    size_t l2_entries = d->cluster_size / sizeof(uint64_t);
+    uint64_t l1_index = cluster_index / l2_entries;
+    uint64_t l2_index = cluster_index % l2_entries;
+    int unallocated = d->backing ? QCOW2_CLUSTER_UNALLOCATED
+                                 : QCOW2_CLUSTER_ZERO;
+    if (l1_index >= d->l1_size) {
+        return unallocated;
+    }
+    uint64_t *l1_entry = qcow2_get_l1_entry(d, l1_index);
+    if (!l1_entry) {
+        return -1;
+    }
+    uint64_t l2_table_offset = *l1_entry & L1_ENTRY_OFFSET_MASK;
+    if (!l2_table_offset) {
+        return unallocated;
+    }
+    uint64_t *l2_table = qcow2_get_l2_table(d, l2_table_offset);
+    if (!l2_table) {
+        return -1;
+    }
+    *l2_entry = l2_table[l2_index];
+    if ((*l2_entry & L2_ENTRY_FORMAT) != CLUSTER_FORMAT_STANDARD) {
+        return QCOW2_CLUSTER_COMPRESSED;
+    } else if (*l2_entry & L2_ENTRY_STD_ZEROED) {
+        return QCOW2_CLUSTER_ZERO;
+    } else if (!(*l2_entry & L2_ENTRY_STD_OFFSET)) {
+        return unallocated;
+    } else {
+        return QCOW2_CLUSTER_STANDARD;
+    }
+}
+
+// The backing file may be smaller, the rest reads as zeroes. The backing disk
+// switches coverage on when it returns.
+static int
+qcow2_read_backing(struct vdisk_qcow2 *d, uint8_t *buf, uint64_t sector,
+                   uint64_t cnt) {
+    struct vdisk *b = d->backing;
+    uint64_t avail = sector < b->sect_cnt ? b->sect_cnt - sector : 0;
+    if (avail > cnt) {
+        avail = cnt;
+    }
+    memset(buf + avail * d->vdisk.sect_size, 0,
+           (cnt - avail) * d->vdisk.sect_size);
+    if (!avail) {
+        return 0;
+    }
+    size_t numsectors = avail;
+    int status = b->diskfunc.read(b, buf, sector, &numsectors);
+    COVERAGE_OFF();
+    return status == KOS_ERROR_SUCCESS ? 0 : -1;
+}
+
+// Short reads mean the image file ends in the middle of the last cluster
+static int
+qcow2_read_runs(struct vdisk_qcow2 *d, struct io_req *reqs, size_t cnt) {
+    io_pread_batch(reqs, cnt, d->vdisk.io);
+    int status = 0;
+    for (size_t i = 0; i < cnt; i++) {
+        if (reqs[i].res == -1) {
             fprintf(stderr, "[vdisk.qcow2] can't read from image file: %s\n",
-                    strerror(errno));
-            return;
+                    strerror(reqs[i].err));
+            status = -1;
+        } else {
+            memset((uint8_t*)reqs[i].buf + reqs[i].res, 0,
+                   reqs[i].count - reqs[i].res);
+        }
+    }
+    return status;
+}
+
+// Refcount entries are kept in big endian as they are on disk
+static uint64_t
+qcow2_refcount_get(const struct vdisk_qcow2 *d, uint64_t *block, size_t idx) {
+    uint8_t *p = (uint8_t*)block;
+    switch (d->refcount_order) {
+    case 4:
+        return ((uint64_t)p[idx*2] << 8) + p[idx*2 + 1];
+    case 5:
+        return be32(p + idx*4);
+    default:
+        return be64(p + idx*8);
+    }
+}
+
+static void
+qcow2_refcount_put(const struct vdisk_qcow2 *d, uint64_t *block, size_t idx,
+                   uint64_t refcount) {
+    uint8_t *p = (uint8_t*)block;
+    switch (d->refcount_order) {
+    case 4:
+        p[idx*2] = refcount >> 8;
+        p[idx*2 + 1] = refcount & 0xff;
+        break;
+    case 5:
+        p[idx*4] = refcount >> 24;
+        p[idx*4 + 1] = (refcount >> 16) & 0xff;
+        p[idx*4 + 2] = (refcount >> 8) & 0xff;
+        p[idx*4 + 3] = refcount & 0xff;
+        break;
+    default:
+        put_be64(p + idx*8, refcount);
+        break;
+    }
+}
+
+// A missing refcount block is allocated at the end of the file and counts
+// itself. The refcount table is never grown.
+static int
+qcow2_update_refcount(struct vdisk_qcow2 *d, uint64_t offset, int delta) {
+    uint64_t cluster = offset >> d->cluster_bits;
+    uint64_t table_index = cluster / d->refcount_block_entries;
+    size_t block_index = cluster % d->refcount_block_entries;
+    if (table_index >= d->refcount_table_size) {
+        fprintf(stderr, "[vdisk.qcow2] refcount table is full\n");
+        return -1;
+    }
+    uint64_t block_offset = d->refcount_table[table_index]
+                            & REFCOUNT_TABLE_OFFSET_MASK;
+    if (!block_offset) {
+        block_offset = d->file_end;
+        d->file_end += d->cluster_size;
+        if (!qcow2_get_table(d, &d->refcount_cache, block_offset, 1)) {
+            return -1;
+        }
+        d->refcount_table[table_index] = block_offset;
+        d->refcount_table_dirty = 1;
+        if (qcow2_update_refcount(d, block_offset, 1)) {
+            return -1;
+        }
+    }
+    struct qcow2_table *t = qcow2_get_table(d, &d->refcount_cache,
+                                            block_offset, 0);
+    if (!t) {
+        return -1;
+    }
+    uint64_t refcount = qcow2_refcount_get(d, t->entries, block_index);
+    if (delta < 0 && !refcount) {
+        fprintf(stderr, "[vdisk.qcow2] refcount of cluster 0x%" PRIx64
+                " is already zero\n", offset);
+        return -1;
+    }
+    qcow2_refcount_put(d, t->entries, block_index, refcount + delta);
+    t->dirty = 1;
+    return 0;
+}
+
+// Freed clusters are not reused, new ones are always appended
+static off_t
+qcow2_alloc_cluster(struct vdisk_qcow2 *d) {
+    off_t offset = d->file_end;
+    d->file_end += d->cluster_size;
+    if (qcow2_update_refcount(d, offset, 1)) {
+        return -1;
+    }
+    return offset;
+}
+
+// Compressed data may span several host clusters, each one is counted
+static int
+qcow2_free_cmp_cluster(struct vdisk_qcow2 *d, uint64_t l2_entry) {
+    uint64_t cmp_offset = (d->l2_entry_cmp_offset_mask & l2_entry) & ~511ULL;
+    uint64_t sectors = ((l2_entry & d->l2_entry_cmp_sect_cnt_mask)
+                        >> d->l2_entry_cmp_x) + 1;
+    uint64_t last = (cmp_offset + sectors*512 - 1) >> d->cluster_bits;
+    for (uint64_t c = cmp_offset >> d->cluster_bits; c <= last; c++) {
+        if (qcow2_update_refcount(d, c << d->cluster_bits, -1)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static struct qcow2_table *
+qcow2_get_l2_table_for_write(struct vdisk_qcow2 *d, uint64_t cluster_index) {
+    uint64_t l1_index = cluster_index / (d->cluster_size / sizeof(uint64_t));
+    if (l1_index >= d->l1_size) {
+        fprintf(stderr, "[vdisk.qcow2] cluster 0x%" PRIx64 " is out of L1\n",
+                cluster_index);
+        return NULL;
+    }
+    uint64_t *l1_entry = qcow2_get_l1_entry(d, l1_index);
+    if (!l1_entry) {
+        return NULL;
+    }
+    uint64_t l2_table_offset = *l1_entry & L1_ENTRY_OFFSET_MASK;
+    if (l2_table_offset) {
+        return qcow2_get_table(d, &d->l2_cache, l2_table_offset, 0);
+    }
+    off_t offset = qcow2_alloc_cluster(d);
+    if (offset == -1) {
+        return NULL;
+    }
+    struct qcow2_table *t = qcow2_get_table(d, &d->l2_cache, offset, 1);
+    if (!t) {
+        return NULL;
+    }
+    *l1_entry = offset | L1_ENTRY_STATUS_MASK;
+    d->l1_pages[l1_index / QCOW2_L1_PAGE_ENTRIES].dirty = 1;
+    d->l1_dirty = 1;
+    return t;
+}
+
+// Allocated standard clusters are written in place, they can't be shared as
+// images with snapshots are opened read-only. Other clusters get a new host
+// cluster, a partial write fills it from the old content first.
+static int
+qcow2_write_cluster(struct vdisk_qcow2 *d, uint64_t cluster_index, size_t off,
+                    const uint8_t *data, size_t len) {
+    size_t l2_index = cluster_index % (d->cluster_size / sizeof(uint64_t));
+    struct qcow2_table *t = qcow2_get_l2_table_for_write(d, cluster_index);
+    if (!t) {
+        return -1;
+    }
+    uint64_t l2_entry = t->entries[l2_index];
+    int compressed = (l2_entry & L2_ENTRY_FORMAT) != CLUSTER_FORMAT_STANDARD;
+    uint64_t host_offset = compressed ? 0 : l2_entry & L2_ENTRY_STD_OFFSET;
+    if (host_offset && !(l2_entry & L2_ENTRY_STD_ZEROED)) {
+        cluster_cache_invalidate(d->std_cache, cluster_index);
+        return qcow2_pwrite_full(d, data, len, host_offset + off);
+    }
+    const uint8_t *src = data;
+    if (len != d->cluster_size) {
+        if (compressed) {
+            const uint8_t *cluster = qcow2_read_cmp_cluster(d, cluster_index,
+                                                            l2_entry);
+            if (!cluster) {
+                return -1;
+            }
+            memcpy(d->wr_cluster, cluster, d->cluster_size);
+        } else if (d->backing && !l2_entry) {
+            uint64_t cluster_sects = d->cluster_size / d->vdisk.sect_size;
+            if (qcow2_read_backing(d, d->wr_cluster,
+                                   cluster_index * cluster_sects,
+                                   cluster_sects)) {
+                return -1;
+            }
+        } else {
+            memset(d->wr_cluster, 0, d->cluster_size);
+        }
+        memcpy(d->wr_cluster + off, data, len);
+        src = d->wr_cluster;
+    }
+    if (!host_offset) {
+        off_t offset = qcow2_alloc_cluster(d);
+        if (offset == -1) {
+            return -1;
+        }
+        host_offset = offset;
+    }
+    if (qcow2_pwrite_full(d, src, d->cluster_size, host_offset)) {
+        return -1;
+    }
+    if (compressed && qcow2_free_cmp_cluster(d, l2_entry)) {
+        return -1;
+    }
+    // the table may have been evicted meanwhile
+    t = qcow2_get_l2_table_for_write(d, cluster_index);
+    if (!t) {
+        return -1;
+    }
+    t->entries[l2_index] = host_offset | L2_ENTRY_STATUS;
+    t->dirty = 1;
+    cluster_cache_invalidate(d->std_cache, cluster_index);
+    cluster_cache_invalidate(d->cmp_cache, cluster_index);
+    return 0;
+}
+
+static int
+qcow2_write_be64_array(struct vdisk_qcow2 *d, const uint64_t *a, size_t cnt,
+                       off_t offset) {
+    size_t per_cluster = d->cluster_size / sizeof(uint64_t);
+    int status = 0;
+    vdisk_lock(&d->meta_lock, d->vdisk.io);
+    for (size_t i = 0; i < cnt; i += per_cluster) {
+        size_t n = cnt - i < per_cluster ? cnt - i : per_cluster;
+        for (size_t j = 0; j < n; j++) {
+            put_be64(d->meta_buf + j * sizeof(uint64_t), a[i + j]);
+        }
+        if (qcow2_pwrite_full(d, d->meta_buf, n * sizeof(uint64_t),
+                              offset + i * sizeof(uint64_t))) {
+            status = -1;
+            break;
         }
-        unsigned long dest_size = d->cluster_size;
-        em_inflate(d->cluster, dest_size, d->cmp_cluster, cmp_size);
     }
-    memcpy(buf,
-           d->cluster + (sector & d->sector_idx_mask) * d->vdisk.sect_size,
-           d->vdisk.sect_size);
+    vdisk_unlock(&d->meta_lock);
+    return status;
+}
+
+// Metadata updates are accumulated in memory until flush. Refcounts go
+// first so that a cluster referenced by L2 is never seen as free.
+static int
+qcow2_flush_metadata(struct vdisk_qcow2 *d) {
+    if (!d->writable) {
+        return 0;
+    }
+    if (qcow2_table_cache_flush(d, &d->refcount_cache)) {
+        return -1;
+    }
+    if (d->refcount_table_dirty) {
+        if (qcow2_write_be64_array(d, d->refcount_table,
+                                   d->refcount_table_size,
+                                   d->refcount_table_offset)) {
+            return -1;
+        }
+        d->refcount_table_dirty = 0;
+    }
+    if (qcow2_table_cache_flush(d, &d->l2_cache)) {
+        return -1;
+    }
+    if (d->l1_dirty) {
+        for (size_t i = 0; i < d->l1_page_cnt; i++) {
+            struct qcow2_l1_page *page = d->l1_pages + i;
+            if (!page->dirty) {
+                continue;
+            }
+            size_t first = i * QCOW2_L1_PAGE_ENTRIES;
+            size_t cnt = d->l1_size - first;
+            if (cnt > QCOW2_L1_PAGE_ENTRIES) {
+                cnt = QCOW2_L1_PAGE_ENTRIES;
+            }
+            if (qcow2_write_be64_array(d, page->entries, cnt,
+                                       d->l1_table_offset
+                                       + first * sizeof(uint64_t))) {
+                return -1;
+            }
+            page->dirty = 0;
+        }
+        d->l1_dirty = 0;
+    }
+    return 0;
 }
 
 STDCALL void
 vdisk_qcow2_close(void *userdata) {
     COVERAGE_OFF();
     struct vdisk_qcow2 *d = userdata;
-    if (d->fd) {
+    if (d->fd > 0) {
+        qcow2_flush_metadata(d);
         close(d->fd);
     }
-    free(d->cluster);
+    if (d->std_cache) {
+        io_unregister_buffer(d->vdisk.io, d->std_cache->buf);
+        cluster_cache_close(d->std_cache);
+    }
+    if (d->inflate_pool) {
+        inflate_pool_close(d->inflate_pool);
+    }
+    if (d->cmp_cache) {
+        cluster_cache_close(d->cmp_cache);
+    }
+    if (d->cmp_cluster) {
+        io_unregister_buffer(d->vdisk.io, d->cmp_cluster);
+    }
+    qcow2_table_cache_close(d, &d->l2_cache);
+    qcow2_table_cache_close(d, &d->refcount_cache);
+    if (d->backing) {
+        d->backing->diskfunc.close(d->backing);
+        COVERAGE_OFF();
+    }
     free(d->cmp_cluster);
-    free(d->l1);
+    free(d->inflate_work);
+    free(d->wr_cluster);
+    free(d->meta_buf);
+    free(d->refcount_table);
+    if (d->l1_pages) {
+        for (size_t i = 0; i < d->l1_page_cnt; i++) {
+            free(d->l1_pages[i].entries);
+        }
+        free(d->l1_pages);
+    }
     free(d);
     COVERAGE_ON();
 }
 
+// The request is cut at cluster boundaries. Whole standard clusters that are
+// contiguous in the image file and in the buffer are merged into runs read
+// straight into the buffer, all the runs are submitted at once. Zeroes are
+// filled in bulk. Whole compressed clusters that aren't cached are inflated in
+// parallel straight into the buffer. Only partial clusters go through the
+// cluster caches.
 STDCALL int
 vdisk_qcow2_read(void *userdata, void *buffer, off_t startsector,
                  size_t *numsectors) {
     COVERAGE_OFF();
     struct vdisk_qcow2 *d = userdata;
-    for (size_t i = 0; i < *numsectors; i++) {
-        qcow2_read_guest_sector(d, startsector + i, buffer);
-        buffer = (uint8_t*)buffer + d->vdisk.sect_size;
+    uint32_t sect_size = d->vdisk.sect_size;
+    uint64_t cluster_sects = d->cluster_size / sect_size;
+    uint64_t sector = startsector;
+    uint64_t end = sector + *numsectors;
+    struct io_req runs[QCOW2_READ_RUNS_MAX];
+    size_t run_cnt = 0;
+    struct inflate_job jobs[QCOW2_INFLATE_JOBS_MAX];
+    uint64_t job_clusters[QCOW2_INFLATE_JOBS_MAX];
+    uint8_t *zero_start = buffer;
+    size_t zero_len = 0;
+    uint8_t *back_buf = buffer;     // run of sectors read from backing file
+    uint64_t back_start = sector;
+    uint64_t back_cnt = 0;
+    size_t job_cnt = 0;
+    int status = 0;
+    while (sector < end) {
+        uint64_t cluster_index = sector / cluster_sects;
+        uint64_t cend = (cluster_index + 1) * cluster_sects;
+        if (cend > end) {
+            cend = end;
+        }
+        uint8_t *dst = (uint8_t*)buffer + (sector - startsector) * sect_size;
+        size_t off = (sector % cluster_sects) * sect_size;
+        size_t len = (cend - sector) * sect_size;
+        uint64_t l2_entry = 0;
+        int type = qcow2_translate(d, cluster_index, &l2_entry);
+        if (type == -1) {
+            status = -1;
+            break;
+        } else if (type == QCOW2_CLUSTER_ZERO) {
+            if (zero_start + zero_len != dst) {
+                memset(zero_start, 0, zero_len);
+                zero_start = dst;
+                zero_len = 0;
+            }
+            zero_len += len;
+        } else if (type == QCOW2_CLUSTER_UNALLOCATED) {
+            if (back_start + back_cnt != sector) {
+                if (back_cnt && qcow2_read_backing(d, back_buf, back_start,
+                                                   back_cnt)) {
+                    sector = startsector;
+                    back_cnt = 0;
+                    status = -1;
+                    break;
+                }
+                back_buf = dst;
+                back_start = sector;
+                back_cnt = 0;
+            }
+            back_cnt += cend - sector;
+        } else if (type == QCOW2_CLUSTER_COMPRESSED
+                   && len == d->cluster_size) {
+            const uint8_t *cluster = cluster_cache_lookup(d->cmp_cache,
+                                                          cluster_index);
+            if (cluster) {
+                memcpy(dst, cluster, len);
+            } else {
+                if (job_cnt == QCOW2_INFLATE_JOBS_MAX) {
+                    if (qcow2_inflate_clusters(d, jobs, job_clusters,
+                                               job_cnt)) {
+                        sector = startsector;
+                        job_cnt = 0;
+                        status = -1;
+                        break;
+                    }
+                    job_cnt = 0;
+                }
+                struct inflate_job *job = jobs + job_cnt;
+                *job = (struct inflate_job){.fd = d->fd, .dst = dst,
+                                            .dst_len = len};
+                if (qcow2_cmp_extent(d, l2_entry, &job->offset,
+                                     &job->src_len)) {
+                    status = -1;
+                    break;
+                }
+                job_clusters[job_cnt++] = cluster_index;
+            }
+        } else if (type == QCOW2_CLUSTER_COMPRESSED
+                   || len != d->cluster_size) {
+            const uint8_t *cluster;
+            if (type == QCOW2_CLUSTER_COMPRESSED) {
+                cluster = qcow2_read_cmp_cluster(d, cluster_index, l2_entry);
+            } else {
+                cluster = qcow2_read_std_cluster(d, cluster_index,
+                                                 l2_entry & L2_ENTRY_STD_OFFSET);
+            }
+            if (!cluster) {
+                status = -1;
+                break;
+            }
+            memcpy(dst, cluster + off, len);
+        } else {
+            off_t host_offset = l2_entry & L2_ENTRY_STD_OFFSET;
+            struct io_req *run = run_cnt ? runs + run_cnt - 1 : NULL;
+            if (run && run->offset + (off_t)run->count == host_offset
+                && (uint8_t*)run->buf + run->count == dst) {
+                run->count += len;
+            } else {
+                if (run_cnt == QCOW2_READ_RUNS_MAX) {
+                    if (qcow2_read_runs(d, runs, run_cnt)) {
+                        sector = startsector;
+                        run_cnt = 0;
+                        status = -1;
+                        break;
+                    }
+                    run_cnt = 0;
+                }
+                runs[run_cnt++] = (struct io_req){.fd = d->fd, .buf = dst,
+                                                  .count = len,
+                                                  .offset = host_offset};
+            }
+        }
+        sector = cend;
+    }
+    memset(zero_start, 0, zero_len);
+    int flush_status = 0;
+    if (back_cnt && qcow2_read_backing(d, back_buf, back_start, back_cnt)) {
+        flush_status = -1;
+    }
+    if (run_cnt && qcow2_read_runs(d, runs, run_cnt)) {
+        flush_status = -1;
+    }
+    if (job_cnt && qcow2_inflate_clusters(d, jobs, job_clusters, job_cnt)) {
+        flush_status = -1;
+    }
+    if (flush_status) {
+        // the runs can't be told apart, nothing is done
+        sector = startsector;
+        status = -1;
+    }
+    if (status) {
+        *numsectors = sector - startsector;
+        COVERAGE_ON();
+        return KOS_ERROR_DEVICE;
     }
     COVERAGE_ON();
     return KOS_ERROR_SUCCESS;
 }
 
+// Only standard clusters that follow each other in the image file are read in
+// the background, the read stops before the first cluster that doesn't
+static uint64_t
+vdisk_qcow2_read_start(struct vdisk *vdisk, struct io_async *a, void *buf,
+                       uint64_t sector, uint64_t cnt) {
+    struct vdisk_qcow2 *d = (struct vdisk_qcow2*)vdisk;
+    uint32_t sect_size = vdisk->sect_size;
+    uint64_t cluster_sects = d->cluster_size / sect_size;
+    uint64_t end = sector + cnt;
+    uint64_t run_end = sector;
+    off_t host_start = 0;
+    while (run_end < end) {
+        uint64_t cluster_index = run_end / cluster_sects;
+        uint64_t l2_entry = 0;
+        if (qcow2_translate(d, cluster_index, &l2_entry)
+            != QCOW2_CLUSTER_STANDARD) {
+            break;
+        }
+        off_t host_offset = (l2_entry & L2_ENTRY_STD_OFFSET)
+                            + (run_end % cluster_sects) * sect_size;
+        if (run_end == sector) {
+            host_start = host_offset;
+        } else if (host_offset != host_start
+                                  + (off_t)((run_end - sector) * sect_size)) {
+            break;
+        }
+        run_end = (cluster_index + 1) * cluster_sects;
+    }
+    if (run_end > end) {
+        run_end = end;
+    }
+    if (run_end != sector) {
+        io_pread_start(a, d->fd, buf, (run_end - sector) * sect_size,
+                       host_start, vdisk->io);
+    }
+    return run_end - sector;
+}
+
 STDCALL int
 vdisk_qcow2_write(void *userdata, void *buffer, off_t startsector,
                   size_t *numsectors) {
     COVERAGE_OFF();
     struct vdisk_qcow2 *d = userdata;
-    (void)d;
-    (void)buffer;
-    (void)startsector;
-    (void)numsectors;
-    fprintf(stderr, "[vdisk.qcow2] writing is not implemented");
+    if (!d->writable) {
+        fprintf(stderr, "[vdisk.qcow2] image is opened read-only\n");
+        COVERAGE_ON();
+        return KOS_ERROR_UNSUPPORTED_FS;
+    }
+    uint32_t sect_size = d->vdisk.sect_size;
+    uint64_t cluster_sects = d->cluster_size / sect_size;
+    uint64_t sector = startsector;
+    uint64_t end = sector + *numsectors;
+    const uint8_t *buf = buffer;
+    vdisk_lock(&d->write_lock, d->vdisk.io);
+    while (sector < end) {
+        uint64_t cluster_index = sector / cluster_sects;
+        uint64_t cend = (cluster_index + 1) * cluster_sects;
+        if (cend > end) {
+            cend = end;
+        }
+        size_t off = (sector % cluster_sects) * sect_size;
+        size_t len = (cend - sector) * sect_size;
+        if (qcow2_write_cluster(d, cluster_index, off, buf, len)) {
+            vdisk_unlock(&d->write_lock);
+            *numsectors = sector - startsector;
+            COVERAGE_ON();
+            return KOS_ERROR_DEVICE;
+        }
+        buf += len;
+        sector = cend;
+    }
+    vdisk_unlock(&d->write_lock);
     COVERAGE_ON();
-    return KOS_ERROR_UNSUPPORTED_FS;
+    return KOS_ERROR_SUCCESS;
+}
+
+// The cluster is marked zeroed and its host clusters lose a reference. A freed
+// standard cluster is punched out of the file as it is never reused, so it
+// reads as zeroes even if the L2 update doesn't reach the file.
+static int
+qcow2_discard_cluster(struct vdisk_qcow2 *d, uint64_t cluster_index) {
+    uint64_t l2_entry = 0;
+    int type = qcow2_translate(d, cluster_index, &l2_entry);
+    if (type == -1) {
+        return -1;
+    } else if (type == QCOW2_CLUSTER_ZERO
+               || type == QCOW2_CLUSTER_UNALLOCATED) {
+        return 0;
+    }
+    if (type == QCOW2_CLUSTER_COMPRESSED) {
+        if (qcow2_free_cmp_cluster(d, l2_entry)) {
+            return -1;
+        }
+    } else {
+        uint64_t host_offset = l2_entry & L2_ENTRY_STD_OFFSET;
+        if (qcow2_update_refcount(d, host_offset, -1)) {
+            return -1;
+        }
+        if (io_punch_hole(d->fd, host_offset, d->cluster_size, d->vdisk.io)) {
+            fprintf(stderr, "[vdisk.qcow2] can't punch hole in image file:"
+                    " %s\n", strerror(errno));
+        }
+    }
+    struct qcow2_table *t = qcow2_get_l2_table_for_write(d, cluster_index);
+    if (!t) {
+        return -1;
+    }
+    t->entries[cluster_index % (d->cluster_size / sizeof(uint64_t))]
+        = L2_ENTRY_STD_ZEROED;
+    t->dirty = 1;
+    cluster_cache_invalidate(d->std_cache, cluster_index);
+    cluster_cache_invalidate(d->cmp_cache, cluster_index);
+    return 0;
+}
+
+// Only whole clusters are discarded, the rest of the range is kept as is
+static int
+vdisk_qcow2_discard(struct vdisk *vdisk, uint64_t sector, uint64_t cnt) {
+    struct vdisk_qcow2 *d = (struct vdisk_qcow2*)vdisk;
+    uint64_t cluster_sects = d->cluster_size / vdisk->sect_size;
+    uint64_t end = sector + cnt;
+    if (end > vdisk->sect_cnt) {
+        end = vdisk->sect_cnt;
+    }
+    uint64_t first = (sector + cluster_sects - 1) / cluster_sects;
+    uint64_t last = end / cluster_sects;
+    if (end == vdisk->sect_cnt) {
+        // the disk may end in the middle of the last cluster
+        last = (end + cluster_sects - 1) / cluster_sects;
+    }
+    int status = KOS_ERROR_SUCCESS;
+    vdisk_lock(&d->write_lock, d->vdisk.io);
+    for (uint64_t c = first; c < last; c++) {
+        if (qcow2_discard_cluster(d, c)) {
+            status = KOS_ERROR_DEVICE;
+            break;
+        }
+    }
+    vdisk_unlock(&d->write_lock);
+    return status;
+}
+
+STDCALL int
+vdisk_qcow2_flush(void *userdata) {
+    COVERAGE_OFF();
+    struct vdisk_qcow2 *d = userdata;
+    int status = KOS_ERROR_SUCCESS;
+    if (d->writable) {
+        // the refcount table may grow while it is written otherwise
+        vdisk_lock(&d->write_lock, d->vdisk.io);
+        if (qcow2_flush_metadata(d) || io_fsync(d->fd, d->vdisk.io)) {
+            status = KOS_ERROR_DEVICE;
+        }
+        vdisk_unlock(&d->write_lock);
+    }
+    COVERAGE_ON();
+    return status;
+}
+
+// Relative names are resolved against the directory of the image, the
+// format is told by the suffix like for any other disk
+static int
+qcow2_open_backing(struct vdisk_qcow2 *d, const char *fname,
+                   struct qcow2_header *header,
+                   const struct vdisk_params *params) {
+    uint64_t name_offset = be64(&header->back_file_offset);
+    uint32_t name_len = be32(&header->back_file_size);
+    if (params->backing_depth >= QCOW2_BACKING_DEPTH_MAX) {
+        fprintf(stderr, "[vdisk.qcow2] backing chain is too long\n");
+        return -1;
+    }
+    if (!name_len || name_len > QCOW2_BACKING_NAME_MAX) {
+        fprintf(stderr, "[vdisk.qcow2] bad backing file name length: %"
+                PRIu32 "\n", name_len);
+        return -1;
+    }
+    const char *slash = strrchr(fname, '/');
+    size_t dir_len = slash ? (size_t)(slash - fname) + 1 : 0;
+    char *path = (char*)malloc(dir_len + name_len + 1);
+    if (!path) {
+        fprintf(stderr, "[vdisk.qcow2] can't allocate memory: %s\n",
+                strerror(errno));
+        return -1;
+    }
+    ssize_t res = io_pread(d->fd, path + dir_len, name_len, name_offset,
+                           d->vdisk.io);
+    if (res != (ssize_t)name_len) {
+        fprintf(stderr, "[vdisk.qcow2] can't read backing file name: %s\n",
+                res == -1 ? strerror(errno) : "unexpected end of file");
+        free(path);
+        return -1;
+    }
+    path[dir_len + name_len] = '\0';
+    if (path[dir_len] == '/') {
+        memmove(path, path + dir_len, name_len + 1);
+    } else {
+        memcpy(path, fname, dir_len);
+    }
+    // the backing file is never written to
+    struct vdisk_params backing_params = *params;
+    backing_params.flags = 0;
+    backing_params.delta_fname = NULL;
+    backing_params.backing_depth++;
+    d->backing = vdisk_init(path, &backing_params, d->vdisk.io);
+    if (!d->backing) {
+        fprintf(stderr, "[vdisk.qcow2] can't open backing file '%s'\n", path);
+        free(path);
+        return -1;
+    }
+    free(path);
+    if (d->backing->sect_size != d->vdisk.sect_size) {
+        fprintf(stderr, "[vdisk.qcow2] backing file sector size differs\n");
+        return -1;
+    }
+    return 0;
+}
+
+static int
+qcow2_init_write(struct vdisk_qcow2 *d, struct qcow2_header *header) {
+    uint32_t nb_snapshots = be32(&header->nb_snapshots);
+    if (nb_snapshots) {
+        fprintf(stderr, "[vdisk.qcow2] can't write to image with snapshots\n");
+        return -1;
+    }
+    d->refcount_block_entries = (d->cluster_size * 8) >> d->refcount_order;
+    d->refcount_table_size = d->refcount_table_clusters * d->cluster_size
+                             / sizeof(uint64_t);
+    d->refcount_table = (uint64_t*)malloc(d->refcount_table_size
+                                          * sizeof(uint64_t));
+    d->wr_cluster = (uint8_t*)malloc(d->cluster_size);
+    d->meta_buf = (uint8_t*)malloc(d->cluster_size);
+    if (!d->refcount_table || !d->wr_cluster || !d->meta_buf) {
+        fprintf(stderr, "[vdisk.qcow2] can't allocate memory: %s\n",
+                strerror(errno));
+        return -1;
+    }
+    size_t len = d->refcount_table_size * sizeof(uint64_t);
+    ssize_t res = io_pread(d->fd, d->refcount_table, len,
+                           d->refcount_table_offset, d->vdisk.io);
+    if (res != (ssize_t)len) {
+        fprintf(stderr, "[vdisk.qcow2] can't read refcount table: %s\n",
+                res == -1 ? strerror(errno) : "unexpected end of file");
+        return -1;
+    }
+    for (uint64_t *x = d->refcount_table;
+         x < d->refcount_table + d->refcount_table_size; x++) {
+        *x = be64(x);
+    }
+    if (qcow2_table_cache_init(d, &d->refcount_cache,
+                               QCOW2_REFCOUNT_CACHE_SIZE, 0)) {
+        return -1;
+    }
+    off_t file_size = lseek(d->fd, 0, SEEK_END);
+    if (file_size == -1) {
+        fprintf(stderr, "[vdisk.qcow2] can't get file size: %s\n",
+                strerror(errno));
+        return -1;
+    }
+    d->file_end = (file_size + d->cluster_size - 1)
+                  & ~(off_t)(d->cluster_size - 1);
+    return 0;
 }
 
 struct vdisk*
-vdisk_init_qcow2(const char *fname, const struct umka_io *io) {
+vdisk_init_qcow2(const char *fname, const struct vdisk_params *params,
+                 const struct umka_io *io) {
     struct vdisk_qcow2 *d =
         (struct vdisk_qcow2*)calloc(1, sizeof(struct vdisk_qcow2));
     if (!d) {
@@ -210,10 +1377,12 @@ vdisk_init_qcow2(const char *fname, const struct umka_io *io) {
                                       .close = vdisk_qcow2_close,
                                       .read = vdisk_qcow2_read,
                                       .write = vdisk_qcow2_write,
+                                      .flush = vdisk_qcow2_flush,
                                      };
     d->vdisk.io = io;
-    d->prev_cluster_index = ~(uint64_t)0;
-    if ((d->fd = open(fname, O_RDONLY | O_BINARY)) == -1) {
+    d->writable = params->flags & VDISK_WRITABLE;
+    int flags = d->writable ? O_RDWR : O_RDONLY;
+    if ((d->fd = open(fname, flags | O_BINARY)) == -1) {
         fprintf(stderr, "[vdisk.qcow2] can't open file '%s': %s\n", fname,
                 strerror(errno));
         vdisk_qcow2_close(d);
@@ -227,7 +1396,8 @@ vdisk_init_qcow2(const char *fname, const struct umka_io *io) {
     }
 
     struct qcow2_header header;
-    if (!io_read(d->fd, &header, sizeof(struct qcow2_header), d->vdisk.io)) {
+    if (!io_pread(d->fd, &header, sizeof(struct qcow2_header), 0,
+                  d->vdisk.io)) {
         fprintf(stderr, "[vdisk.qcow2] can't read from image file: %s\n",
                 strerror(errno));
         vdisk_qcow2_close(d);
@@ -279,7 +1449,15 @@ vdisk_init_qcow2(const char *fname, const struct umka_io *io) {
     d->refcount_table_offset = be64(&header.refcount_table_offset);
     d->refcount_table_clusters = be32(&header.refcount_table_clusters);
 
+    d->header_length = be32(&header.header_length);
     uint64_t incompatible_features = be64(&header.incompatible_features);
+    uint8_t compression_type = QCOW2_COMPRESSION_ZLIB;
+    if (d->header_length > QCOW2_HEADER_COMPRESSION_TYPE_OFFSET) {
+        compression_type = header.compression_type;
+    }
+    if (compression_type != QCOW2_COMPRESSION_ZLIB) {
+        incompatible_features &= ~QCOW2_INCOMPAT_COMPRESSION;
+    }
     if (incompatible_features) {
         fprintf(stderr, "[vdisk.qcow2] unsupported incompatible_feature(s): 0x%"
                 PRIx64 "\n", incompatible_features);
@@ -295,14 +1473,67 @@ vdisk_init_qcow2(const char *fname, const struct umka_io *io) {
         return NULL;
     }
 
-    d->header_length = be32(&header.header_length);
-    d->cluster = (uint8_t*)malloc(d->cluster_size);
-    if (!d->cluster) {
-        fprintf(stderr, "[vdisk.qcow2] can't allocate memory: %s\n",
-                strerror(errno));
+    switch (compression_type) {
+    case QCOW2_COMPRESSION_ZLIB:
+        d->inflate = qcow2_inflate_zlib;
+        break;
+    case QCOW2_COMPRESSION_ZSTD:
+        d->inflate = qcow2_inflate_zstd;
+        d->inflate_work_size = ZSTD_estimateDCtxSize();
+        break;
+    default:
+        fprintf(stderr, "[vdisk.qcow2] unsupported compression_type: %u\n",
+                compression_type);
         vdisk_qcow2_close(d);
         return NULL;
     }
+    if (d->inflate_work_size) {
+        d->inflate_work = malloc(d->inflate_work_size);
+        if (!d->inflate_work) {
+            fprintf(stderr, "[vdisk.qcow2] can't allocate memory: %s\n",
+                    strerror(errno));
+            vdisk_qcow2_close(d);
+            return NULL;
+        }
+    }
+
+    const struct cluster_cache_policy *policy = &cluster_cache_lru;
+    if (params->qcow2_cache_policy) {
+        policy = cluster_cache_policy_find(params->qcow2_cache_policy);
+        if (!policy) {
+            fprintf(stderr, "[vdisk.qcow2] unknown cache policy: %s\n",
+                    params->qcow2_cache_policy);
+            vdisk_qcow2_close(d);
+            return NULL;
+        }
+    }
+    size_t std_cache_size = params->qcow2_std_cache_size;
+    if (!std_cache_size) {
+        std_cache_size = QCOW2_STD_CACHE_SIZE_DEFAULT;
+    }
+    size_t cmp_cache_size = params->qcow2_cmp_cache_size;
+    if (!cmp_cache_size) {
+        cmp_cache_size = QCOW2_CMP_CACHE_SIZE_DEFAULT;
+    }
+    d->std_cache = cluster_cache_init(std_cache_size, d->cluster_size, policy);
+    d->cmp_cache = cluster_cache_init(cmp_cache_size, d->cluster_size, policy);
+    if (!d->std_cache || !d->cmp_cache) {
+        vdisk_qcow2_close(d);
+        return NULL;
+    }
+
+    d->inflate_thread_cnt = params->qcow2_inflate_thread_cnt;
+    if (!d->inflate_thread_cnt) {
+#ifdef _SC_NPROCESSORS_ONLN
+        long cpu_cnt = sysconf(_SC_NPROCESSORS_ONLN);
+        d->inflate_thread_cnt = cpu_cnt > 0 ? cpu_cnt : 1;
+#else
+        d->inflate_thread_cnt = 1;
+#endif
+    }
+    if (d->inflate_thread_cnt > QCOW2_INFLATE_JOBS_MAX) {
+        d->inflate_thread_cnt = QCOW2_INFLATE_JOBS_MAX;
+    }
 
     d->cmp_cluster = (uint8_t*)malloc(d->cluster_size*2);
     if (!d->cmp_cluster) {
@@ -312,25 +1543,56 @@ vdisk_init_qcow2(const char *fname, const struct umka_io *io) {
         return NULL;
     }
 
-    d->l1 = (uint64_t*)malloc(d->l1_size * sizeof(uint64_t));
-    if (!d->l1) {
+    size_t l2_cache_size = params->qcow2_l2_cache_size;
+    if (!l2_cache_size) {
+        l2_cache_size = QCOW2_L2_CACHE_SIZE_DEFAULT;
+    }
+    if (qcow2_table_cache_init(d, &d->l2_cache, l2_cache_size, 1)) {
+        vdisk_qcow2_close(d);
+        return NULL;
+    }
+    d->vdisk.caches[0] = (struct vdisk_cache){.name = "l2",
+                                              .stats = &d->l2_cache.stats};
+    d->vdisk.caches[1] = (struct vdisk_cache){.name = "std",
+                                              .stats = &d->std_cache->stats};
+    d->vdisk.caches[2] = (struct vdisk_cache){.name = "cmp",
+                                              .stats = &d->cmp_cache->stats};
+
+    io_register_buffer(d->vdisk.io, d->std_cache->buf,
+                       std_cache_size * d->cluster_size);
+    io_register_buffer(d->vdisk.io, d->cmp_cluster, d->cluster_size*2);
+
+    if (d->l1_size > L1_MAX_ENTRIES) {
+        fprintf(stderr, "[vdisk.qcow2] L1 table is too large: %zu entries\n",
+                d->l1_size);
+        vdisk_qcow2_close(d);
+        return NULL;
+    }
+    d->l1_page_cnt = (d->l1_size + QCOW2_L1_PAGE_ENTRIES - 1)
+                     / QCOW2_L1_PAGE_ENTRIES;
+    d->l1_pages = (struct qcow2_l1_page*)calloc(d->l1_page_cnt,
+                                                sizeof(struct qcow2_l1_page));
+    if (!d->l1_pages && d->l1_page_cnt) {
         fprintf(stderr, "[vdisk.qcow2] can't allocate memory: %s\n",
                 strerror(errno));
         vdisk_qcow2_close(d);
         return NULL;
     }
 
-    lseek(d->fd, d->l1_table_offset, SEEK_SET);
-    if (!io_read(d->fd, d->l1, d->l1_size * sizeof(uint64_t), d->vdisk.io)) {
-        fprintf(stderr, "[vdisk.qcow2] can't read from image file: %s\n",
-                strerror(errno));
+    if (be64(&header.back_file_offset)
+        && qcow2_open_backing(d, fname, &header, params)) {
         vdisk_qcow2_close(d);
         return NULL;
     }
 
-    for (uint64_t *x = d->l1; x < d->l1 + d->l1_size; x++) {
-        *x = be64(x);
+    if (d->writable && qcow2_init_write(d, &header)) {
+        vdisk_qcow2_close(d);
+        return NULL;
+    }
+    if (d->writable) {
+        d->vdisk.discard = vdisk_qcow2_discard;
     }
+    d->vdisk.read_start = vdisk_qcow2_read_start;
 
     return (struct vdisk*)d;
 }
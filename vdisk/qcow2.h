@@ -15,8 +15,14 @@
 #include "umkaio.h"
 
 #define QCOW2_SUFFIX ".qcow2"
+#define QCOW2_L2_CACHE_SIZE_DEFAULT 16  // L2 tables, one cluster each
+#define QCOW2_STD_CACHE_SIZE_DEFAULT 8  // clusters
+#define QCOW2_CMP_CACHE_SIZE_DEFAULT 16 // clusters
+// Bytes, only standard clusters contiguous in the image file are read ahead
+#define QCOW2_READAHEAD_MAX 0x200000
 
 struct vdisk*
-vdisk_init_qcow2(const char *fname, const struct umka_io *io);
+vdisk_init_qcow2(const char *fname, const struct vdisk_params *params,
+                 const struct umka_io *io);
 
 #endif  // VDISK_QCOW2_H_INCLUDED
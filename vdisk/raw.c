@@ -10,76 +10,525 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
 #include "../trace.h"
 #include "umkaio.h"
 #include "raw.h"
 
+// Consecutive requests needed to switch madvise hint to the other pattern
+#define RAW_MAP_PATTERN_STREAK 4
+// How far ahead of a sequential reader pages are requested to be read in
+#define RAW_MAP_READAHEAD (1u << 20)
+// Images more fragmented than this are read as if they had no holes
+#define RAW_EXTENTS_MAX (1u << 20)
+
+enum {
+    RAW_MAP_ADVICE_RANDOM,
+    RAW_MAP_ADVICE_SEQUENTIAL,
+};
+
+// Part of the image file that has data, the rest are holes
+struct raw_extent {
+    off_t start;
+    off_t end;
+};
+
 struct vdisk_raw {
     struct vdisk vdisk;
     int fd;
+    uint8_t *map;   // whole image mapped read-only, NULL if not mapped
+    size_t map_size;
+    off_t map_next; // where the previous read ended
+    int map_advice;
+    unsigned map_streak;    // requests that contradict the current advice
+    struct raw_extent *extents; // sorted, NULL if holes are unknown
+    size_t extent_cnt;
+    size_t extent_cap;
 };
 
 STDCALL void
 vdisk_raw_close(void *userdata) {
     COVERAGE_OFF();
     struct vdisk_raw *disk = userdata;
+#ifndef _WIN32
+    if (disk->map) {
+        munmap(disk->map, disk->map_size);
+    }
+#endif
     close(disk->fd);
+    free(disk->extents);
     free(disk);
     COVERAGE_ON();
 }
 
+// Returns the index of the first extent that ends after offset
+static size_t
+vdisk_raw_find_extent(const struct vdisk_raw *disk, off_t offset) {
+    size_t lo = 0, hi = disk->extent_cnt;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (disk->extents[mid].end <= offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static void
+vdisk_raw_drop_extents(struct vdisk_raw *disk) {
+    free(disk->extents);
+    disk->extents = NULL;
+    disk->extent_cnt = 0;
+    disk->extent_cap = 0;
+}
+
+// Extents that overlap or touch the new one are merged with it. If the map
+// can't grow it is dropped, holes are then read from the file.
+static void
+vdisk_raw_add_extent(struct vdisk_raw *disk, off_t start, off_t end) {
+    size_t first = vdisk_raw_find_extent(disk, start - 1);
+    size_t last = first;
+    while (last < disk->extent_cnt && disk->extents[last].start <= end) {
+        last++;
+    }
+    if (first < last) {
+        if (disk->extents[first].start < start) {
+            start = disk->extents[first].start;
+        }
+        if (disk->extents[last-1].end > end) {
+            end = disk->extents[last-1].end;
+        }
+    } else if (disk->extent_cnt == disk->extent_cap) {
+        size_t cap = disk->extent_cap ? disk->extent_cap * 2 : 16;
+        struct raw_extent *extents = NULL;
+        if (cap <= RAW_EXTENTS_MAX) {
+            extents = realloc(disk->extents, cap * sizeof(struct raw_extent));
+        }
+        if (!extents) {
+            vdisk_raw_drop_extents(disk);
+            return;
+        }
+        disk->extents = extents;
+        disk->extent_cap = cap;
+    }
+    // [first, last) are replaced with a single extent
+    memmove(disk->extents + first + 1, disk->extents + last,
+            (disk->extent_cnt - last) * sizeof(struct raw_extent));
+    disk->extent_cnt -= last - first;
+    disk->extent_cnt++;
+    disk->extents[first] = (struct raw_extent){.start = start, .end = end};
+}
+
+// The range becomes a hole. An extent that contains it is split in two.
+static void
+vdisk_raw_remove_extent(struct vdisk_raw *disk, off_t start, off_t end) {
+    size_t first = vdisk_raw_find_extent(disk, start);
+    if (first == disk->extent_cnt || disk->extents[first].start >= end) {
+        return;
+    }
+    struct raw_extent *e = disk->extents + first;
+    if (e->start < start && e->end > end) {
+        off_t tail_end = e->end;
+        e->end = start;
+        vdisk_raw_add_extent(disk, end, tail_end);
+        return;
+    }
+    if (e->start < start) {
+        e->end = start;
+        first++;
+    }
+    size_t last = first;
+    while (last < disk->extent_cnt && disk->extents[last].end <= end) {
+        last++;
+    }
+    if (last < disk->extent_cnt && disk->extents[last].start < end) {
+        disk->extents[last].start = end;
+    }
+    // [first, last) are inside the range
+    memmove(disk->extents + first, disk->extents + last,
+            (disk->extent_cnt - last) * sizeof(struct raw_extent));
+    disk->extent_cnt -= last - first;
+}
+
+// File systems that don't track holes report the whole file as data, so the
+// map is correct anyway
+static void
+vdisk_raw_scan_extents(struct vdisk_raw *disk, off_t fsize) {
+#ifdef SEEK_DATA
+    disk->extents = malloc(16 * sizeof(struct raw_extent));
+    if (!disk->extents) {
+        return;
+    }
+    disk->extent_cap = 16;
+    off_t pos = 0;
+    while (pos < fsize) {
+        off_t data = lseek(disk->fd, pos, SEEK_DATA);
+        if (data == -1 && errno == ENXIO) {
+            break;  // only a hole is left
+        }
+        off_t hole = data == -1 ? -1 : lseek(disk->fd, data, SEEK_HOLE);
+        if (hole == -1) {
+            vdisk_raw_drop_extents(disk);
+            return;
+        }
+        vdisk_raw_add_extent(disk, data, hole);
+        if (!disk->extents) {
+            return;
+        }
+        pos = hole;
+    }
+#else
+    (void)disk;
+    (void)fsize;
+#endif
+}
+
+static int
+vdisk_raw_block_status(struct vdisk *vdisk, uint64_t sector, uint64_t *cnt) {
+    struct vdisk_raw *disk = (struct vdisk_raw*)vdisk;
+    uint64_t sect_size = vdisk->sect_size;
+    off_t pos = sector * sect_size;
+    off_t end = vdisk->sect_cnt * sect_size;
+    if (!disk->extents) {
+        *cnt = vdisk->sect_cnt - sector;
+        return 1;
+    }
+    size_t i = vdisk_raw_find_extent(disk, pos);
+    const struct raw_extent *e = disk->extents + i;
+    if (i < disk->extent_cnt && e->start < pos + (off_t)sect_size) {
+        // partially allocated sectors count as allocated
+        off_t data_end = e->end < end ? e->end : end;
+        *cnt = (data_end - pos + sect_size - 1) / sect_size;
+        return 1;
+    }
+    off_t hole_end = i < disk->extent_cnt && e->start < end ? e->start : end;
+    *cnt = (hole_end - pos) / sect_size;
+    return 0;
+}
+
+// Positional i/o keeps no shared file offset, so requests from several kernel
+// threads may be in flight at once. Short transfers are continued, reading
+// past the end of the image yields zeroes.
+static size_t
+vdisk_raw_pread_full(struct vdisk_raw *disk, uint8_t *buf, size_t count,
+                     off_t offset) {
+    size_t done = 0;
+    while (done < count) {
+        ssize_t res = io_pread(disk->fd, buf + done, count - done,
+                               offset + done, disk->vdisk.io);
+        if (res == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "[vdisk.raw] can't read from image file: %s\n",
+                    strerror(errno));
+            break;
+        } else if (res == 0) {
+            memset(buf + done, 0, count - done);
+            done = count;
+            break;
+        }
+        done += res;
+    }
+    return done;
+}
+
+static size_t
+vdisk_raw_pwrite_full(struct vdisk_raw *disk, const uint8_t *buf, size_t count,
+                      off_t offset) {
+    size_t done = 0;
+    while (done < count) {
+        ssize_t res = io_pwrite(disk->fd, buf + done, count - done,
+                                offset + done, disk->vdisk.io);
+        if (res == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "[vdisk.raw] can't write to image file: %s\n",
+                    strerror(errno));
+            break;
+        } else if (res == 0) {
+            fprintf(stderr, "[vdisk.raw] can't write to image file: %s\n",
+                    "no progress");
+            break;
+        }
+        done += res;
+    }
+    return done;
+}
+
+#ifndef _WIN32
+// The kernel is told whether the guest reads the image sequentially or not so
+// that it reads ahead aggressively or not at all. The hint applies to the
+// whole mapping and is only changed after a streak of contradicting requests.
+static void
+vdisk_raw_map_advise(struct vdisk_raw *disk, off_t offset, size_t count) {
+    int advice = offset == disk->map_next ? RAW_MAP_ADVICE_SEQUENTIAL
+                                          : RAW_MAP_ADVICE_RANDOM;
+    disk->map_next = offset + count;
+    if (advice == disk->map_advice) {
+        disk->map_streak = 0;
+    } else if (++disk->map_streak == RAW_MAP_PATTERN_STREAK) {
+        disk->map_streak = 0;
+        disk->map_advice = advice;
+        madvise(disk->map, disk->map_size,
+                advice == RAW_MAP_ADVICE_SEQUENTIAL ? MADV_SEQUENTIAL
+                                                    : MADV_RANDOM);
+    }
+    if (disk->map_advice == RAW_MAP_ADVICE_SEQUENTIAL
+        && disk->map_next < (off_t)disk->map_size) {
+        // madvise wants a page aligned address
+        size_t page_mask = (size_t)sysconf(_SC_PAGESIZE) - 1;
+        size_t start = (size_t)disk->map_next & ~page_mask;
+        size_t len = disk->map_size - start;
+        if (len > RAW_MAP_READAHEAD) {
+            len = RAW_MAP_READAHEAD;
+        }
+        madvise(disk->map + start, len, MADV_WILLNEED);
+    }
+}
+#endif
+
+// Reads are served straight from the page cache without a syscall
+static size_t
+vdisk_raw_map_read(struct vdisk_raw *disk, uint8_t *buf, size_t count,
+                   off_t offset) {
+    size_t avail = 0;
+    if (offset < (off_t)disk->map_size) {
+        avail = disk->map_size - offset;
+        if (avail > count) {
+            avail = count;
+        }
+        memcpy(buf, disk->map + offset, avail);
+    }
+    memset(buf + avail, 0, count - avail);
+    return count;
+}
+
+static size_t
+vdisk_raw_read_data(struct vdisk_raw *disk, uint8_t *buf, size_t count,
+                    off_t offset) {
+    if (disk->map) {
+        return vdisk_raw_map_read(disk, buf, count, offset);
+    } else {
+        return vdisk_raw_pread_full(disk, buf, count, offset);
+    }
+}
+
+// Holes are zeroed without i/o. The map is searched anew for every piece as
+// it may change while another kernel thread writes.
+static size_t
+vdisk_raw_read_sparse(struct vdisk_raw *disk, uint8_t *buf, size_t count,
+                      off_t offset) {
+    size_t done = 0;
+    while (done < count && disk->extents) {
+        off_t pos = offset + done;
+        size_t len = count - done;
+        size_t i = vdisk_raw_find_extent(disk, pos);
+        const struct raw_extent *e = disk->extents + i;
+        if (i < disk->extent_cnt && e->start <= pos) {
+            if ((uint64_t)(e->end - pos) < len) {
+                len = e->end - pos;
+            }
+            size_t res = vdisk_raw_read_data(disk, buf + done, len, pos);
+            done += res;
+            if (res != len) {
+                return done;
+            }
+        } else {
+            if (i < disk->extent_cnt && (uint64_t)(e->start - pos) < len) {
+                len = e->start - pos;
+            }
+            memset(buf + done, 0, len);
+            done += len;
+        }
+    }
+    if (done < count) {
+        done += vdisk_raw_read_data(disk, buf + done, count - done,
+                                    offset + done);
+    }
+    return done;
+}
+
 STDCALL int
 vdisk_raw_read(void *userdata, void *buffer, off_t startsector,
                size_t *numsectors) {
     COVERAGE_OFF();
     struct vdisk_raw *disk = userdata;
-    lseek(disk->fd, startsector * disk->vdisk.sect_size, SEEK_SET);
-    io_read(disk->fd, buffer, *numsectors * disk->vdisk.sect_size,
-            disk->vdisk.io);
+    size_t count = *numsectors * disk->vdisk.sect_size;
+    off_t offset = startsector * disk->vdisk.sect_size;
+#ifndef _WIN32
+    if (disk->map) {
+        vdisk_raw_map_advise(disk, offset, count);
+    }
+#endif
+    size_t done = vdisk_raw_read_sparse(disk, buffer, count, offset);
+    if (done != count) {
+        *numsectors = done / disk->vdisk.sect_size;
+        COVERAGE_ON();
+        return KOS_ERROR_DEVICE;
+    }
     COVERAGE_ON();
     return KOS_ERROR_SUCCESS;
 }
 
+// Holes read as they are, the file is never shorter than the disk
+static uint64_t
+vdisk_raw_read_start(struct vdisk *vdisk, struct io_async *a, void *buf,
+                     uint64_t sector, uint64_t cnt) {
+    struct vdisk_raw *disk = (struct vdisk_raw*)vdisk;
+    io_pread_start(a, disk->fd, buf, cnt * vdisk->sect_size,
+                   sector * vdisk->sect_size, vdisk->io);
+    return cnt;
+}
+
 STDCALL int
 vdisk_raw_write(void *userdata, void *buffer, off_t startsector,
                 size_t *numsectors) {
     COVERAGE_OFF();
     struct vdisk_raw *disk = userdata;
-    lseek(disk->fd, startsector * disk->vdisk.sect_size, SEEK_SET);
-    io_write(disk->fd, buffer, *numsectors * disk->vdisk.sect_size,
-             disk->vdisk.io);
+    size_t count = *numsectors * disk->vdisk.sect_size;
+    off_t offset = startsector * disk->vdisk.sect_size;
+    size_t done = vdisk_raw_pwrite_full(disk, buffer, count, offset);
+    if (disk->extents && done) {
+        vdisk_raw_add_extent(disk, offset, offset + done);
+    }
+    if (done != count) {
+        *numsectors = done / disk->vdisk.sect_size;
+        COVERAGE_ON();
+        return KOS_ERROR_DEVICE;
+    }
+    COVERAGE_ON();
+    return KOS_ERROR_SUCCESS;
+}
+
+STDCALL int
+vdisk_raw_flush(void *userdata) {
+    COVERAGE_OFF();
+    struct vdisk_raw *disk = userdata;
+    if (io_fsync(disk->fd, disk->vdisk.io)) {
+        fprintf(stderr, "[vdisk.raw] can't flush image file: %s\n",
+                strerror(errno));
+        COVERAGE_ON();
+        return KOS_ERROR_DEVICE;
+    }
     COVERAGE_ON();
     return KOS_ERROR_SUCCESS;
 }
 
-struct vdisk*
-vdisk_init_raw(const char *fname, const struct umka_io *io) {
-    int fd = open(fname, O_RDONLY | O_BINARY);
-    if (!fd) {
-        printf("[vdisk.raw]: can't open file '%s': %s\n", fname, strerror(errno));
+// Parts of file system blocks are zeroed rather than freed, they are holes in
+// the map anyway as they read as zeroes
+static int
+vdisk_raw_discard(struct vdisk *vdisk, uint64_t sector, uint64_t cnt) {
+    struct vdisk_raw *disk = (struct vdisk_raw*)vdisk;
+    if (sector >= vdisk->sect_cnt) {
+        return KOS_ERROR_SUCCESS;
+    }
+    if (cnt > vdisk->sect_cnt - sector) {
+        cnt = vdisk->sect_cnt - sector;
+    }
+    off_t offset = sector * vdisk->sect_size;
+    off_t len = cnt * vdisk->sect_size;
+    if (io_punch_hole(disk->fd, offset, len, vdisk->io)) {
+        fprintf(stderr, "[vdisk.raw] can't punch hole in image file: %s\n",
+                strerror(errno));
+        return KOS_ERROR_DEVICE;
+    }
+    if (disk->extents) {
+        vdisk_raw_remove_extent(disk, offset, offset + len);
+    }
+    return KOS_ERROR_SUCCESS;
+}
+
+// Mapping may fail for images that don't fit the 32-bit address space, the
+// disk falls back to regular reads then
+static uint8_t *
+vdisk_raw_map(const char *fname, int fd, off_t size) {
+#ifndef _WIN32
+    if (size <= 0 || (uint64_t)size > SIZE_MAX) {
+        fprintf(stderr, "[vdisk.raw] can't map file '%s': %s\n", fname,
+                "bad size");
         return NULL;
     }
-    off_t fsize = lseek(fd, 0, SEEK_END);
-    lseek(fd, 0, SEEK_SET);
-    size_t sect_size = 512;
+    void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "[vdisk.raw] can't map file '%s': %s\n", fname,
+                strerror(errno));
+        return NULL;
+    }
+    madvise(map, size, MADV_RANDOM);
+    return map;
+#else
+    (void)fd;
+    (void)size;
+    fprintf(stderr, "[vdisk.raw] can't map file '%s': %s\n", fname,
+            "not implemented for windows");
+    return NULL;
+#endif
+}
+
+size_t
+vdisk_raw_sect_size(const char *fname) {
     if (strstr(fname, "s4096") != NULL || strstr(fname, "s4k") != NULL) {
-        sect_size = 4096;
+        return 4096;
     } else if (strstr(fname, "s2048") != NULL || strstr(fname, "s2k") != NULL) {
-        sect_size = 2048;
+        return 2048;
+    } else {
+        return 512;
     }
+}
+
+struct vdisk*
+vdisk_init_raw(const char *fname, unsigned flags, const struct umka_io *io) {
+    int fd = open(fname, (flags & VDISK_WRITABLE ? O_RDWR : O_RDONLY)
+                         | O_BINARY);
+    if (fd == -1) {
+        printf("[vdisk.raw]: can't open file '%s': %s\n", fname, strerror(errno));
+        return NULL;
+    }
+    off_t fsize = lseek(fd, 0, SEEK_END);
+    size_t sect_size = vdisk_raw_sect_size(fname);
     struct vdisk_raw *disk = (struct vdisk_raw*)malloc(sizeof(struct vdisk_raw));
     *disk = (struct vdisk_raw){
             .vdisk = {.diskfunc = {.strucsize = sizeof(diskfunc_t),
                                    .close = vdisk_raw_close,
                                    .read = vdisk_raw_read,
                                    .write = vdisk_raw_write,
+                                   .flush = vdisk_raw_flush,
                                   },
                       .sect_size = sect_size,
                       .sect_cnt = (uint64_t)fsize / sect_size,
                       .io = io,
+                      .block_status = vdisk_raw_block_status,
                      },
             .fd = fd,
+            .map = NULL,
+            .map_size = 0,
+            .map_next = 0,
+            .map_advice = RAW_MAP_ADVICE_RANDOM,
+            .map_streak = 0,
+            .extents = NULL,
+            .extent_cnt = 0,
+            .extent_cap = 0,
             };
+    if (flags & VDISK_WRITABLE) {
+        disk->vdisk.discard = vdisk_raw_discard;
+    }
+    vdisk_raw_scan_extents(disk, fsize);
+    if (flags & VDISK_MMAP) {
+        disk->map = vdisk_raw_map(fname, fd, fsize);
+        if (disk->map) {
+            disk->map_size = fsize;
+        }
+    }
+    if (!disk->map) {
+        disk->vdisk.read_start = vdisk_raw_read_start;
+    }
     return (struct vdisk*)disk;
 }
@@ -16,8 +16,13 @@
 
 #define RAW_SUFFIX ".raw"
 #define ISO_SUFFIX ".iso"
+#define RAW_READAHEAD_MAX 0x100000  // bytes
+
+// Sector size is told by the file name, e.g. disk_s4k.raw, 512 by default
+size_t
+vdisk_raw_sect_size(const char *fname);
 
 struct vdisk*
-vdisk_init_raw(const char *fname, const struct umka_io *io);
+vdisk_init_raw(const char *fname, unsigned flags, const struct umka_io *io);
 
 #endif  // VDISK_RAW_H_INCLUDED
@@ -0,0 +1,286 @@
+/*
+    SPDX-License-Identifier: GPL-2.0-or-later
+
+    UMKa - User-Mode KolibriOS developer tools
+    vdisk - virtual disk, sequential readahead
+
+    Copyright (C) 2023  Ivan Baravy <dunkaist@gmail.com>
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../trace.h"
+#include "readahead.h"
+
+// A read that starts where the previous one ended continues the stream. When
+// less than a window of the stream is staged ahead of the read, the next
+// window is read from the base in the background to the spare buffer. It
+// becomes the staged one when a read gets to it, so the base gets few large
+// requests and they overlap the work of the reader.
+//
+// Kernel threads run in turns while they wait for i/o, so the stream and the
+// buffers are only changed with the lock held. The part of a read that isn't
+// staged goes to the base without the lock. A write or a discard drops the
+// background read it overlaps as the read may have got older data.
+struct vdisk_readahead {
+    struct vdisk vdisk;
+    struct vdisk *base;
+    uint64_t window_min;    // sectors
+    uint64_t window_max;
+    uint64_t window;        // zero if there is no stream
+    uint64_t next;          // sector that continues the stream
+    uint64_t staged_start;
+    uint64_t staged_end;
+    uint8_t *staged;        // window_max sectors
+    uint8_t *spare;         // window_max sectors, the next window goes here
+    struct io_async fill;
+    uint64_t fill_start;
+    uint64_t fill_end;      // equal to fill_start if nothing is in flight
+    int fill_stale;
+    int lock;               // see vdisk_lock
+};
+
+// The base disk switches coverage on when it returns
+static int
+readahead_base_read(struct vdisk_readahead *d, void *buf, uint64_t sector,
+                    size_t cnt) {
+    size_t numsectors = cnt;
+    int status = d->base->diskfunc.read(d->base, buf, sector, &numsectors);
+    COVERAGE_OFF();
+    return status;
+}
+
+// Waits for the background read, its window becomes staged if it is intact
+static void
+readahead_finish(struct vdisk_readahead *d) {
+    ssize_t res = io_wait(&d->fill, d->vdisk.io);
+    uint64_t cnt = d->fill_end - d->fill_start;
+    if (res == (ssize_t)(cnt * d->vdisk.sect_size) && !d->fill_stale) {
+        uint8_t *staged = d->staged;
+        d->staged = d->spare;
+        d->spare = staged;
+        d->staged_start = d->fill_start;
+        d->staged_end = d->fill_end;
+    }
+    d->fill_end = d->fill_start;
+}
+
+static void
+readahead_start(struct vdisk_readahead *d, uint64_t sector) {
+    uint64_t cnt = d->window;
+    if (cnt > d->vdisk.sect_cnt - sector) {
+        cnt = d->vdisk.sect_cnt - sector;
+    }
+    if (!cnt) {
+        return;
+    }
+    d->fill_start = sector;
+    d->fill_stale = 0;
+    d->fill_end = sector + d->base->read_start(d->base, &d->fill, d->spare,
+                                               sector, cnt);
+}
+
+// Copies the staged sectors the read starts with, returns the first sector
+// that is left
+static uint64_t
+readahead_copy(struct vdisk_readahead *d, uint8_t *buf, uint64_t start,
+               uint64_t sector, uint64_t end) {
+    if (sector < d->staged_start || sector >= d->staged_end) {
+        return sector;
+    }
+    uint64_t staged_end = end < d->staged_end ? end : d->staged_end;
+    memcpy(buf + (sector - start) * d->vdisk.sect_size,
+           d->staged + (sector - d->staged_start) * d->vdisk.sect_size,
+           (staged_end - sector) * d->vdisk.sect_size);
+    return staged_end;
+}
+
+// Staged data is dropped and the data read in the background is ignored if
+// the range overlaps them
+static void
+readahead_drop(struct vdisk_readahead *d, uint64_t start, uint64_t end) {
+    if (start < d->staged_end && end > d->staged_start) {
+        d->staged_end = d->staged_start;
+    }
+    if (start < d->fill_end && end > d->fill_start) {
+        d->fill_stale = 1;
+    }
+}
+
+STDCALL void
+vdisk_readahead_close(void *userdata) {
+    COVERAGE_OFF();
+    struct vdisk_readahead *d = userdata;
+    if (d->fill_end != d->fill_start) {
+        io_wait(&d->fill, d->vdisk.io);
+    }
+    d->base->diskfunc.close(d->base);
+    COVERAGE_OFF();
+    free(d->staged);
+    free(d->spare);
+    free(d);
+    COVERAGE_ON();
+}
+
+STDCALL int
+vdisk_readahead_read(void *userdata, void *buffer, off_t startsector,
+                     size_t *numsectors) {
+    COVERAGE_OFF();
+    struct vdisk_readahead *d = userdata;
+    uint8_t *buf = buffer;
+    uint64_t sector = startsector;
+    uint64_t end = sector + *numsectors;
+    if (end > d->vdisk.sect_cnt) {
+        end = d->vdisk.sect_cnt;
+    }
+    vdisk_lock(&d->lock, d->vdisk.io);
+    if (sector != d->next) {
+        d->window = 0;
+    } else if (!d->window) {
+        d->window = d->window_min;
+    } else if (d->window * 2 <= d->window_max) {
+        d->window *= 2;
+    } else {
+        d->window = d->window_max;
+    }
+    d->next = end;
+    sector = readahead_copy(d, buf, startsector, sector, end);
+    int busy = d->fill_end != d->fill_start;
+    if (busy && ((sector < d->fill_end && end > d->fill_start)
+                 || io_done(&d->fill, d->vdisk.io))) {
+        readahead_finish(d);
+        sector = readahead_copy(d, buf, startsector, sector, end);
+        busy = 0;
+    }
+    if (d->window && !busy) {
+        uint64_t ahead = end;
+        if (end >= d->staged_start && end < d->staged_end) {
+            ahead = d->staged_end;
+        }
+        if (ahead - end < d->window) {
+            readahead_start(d, ahead);
+        }
+    }
+    vdisk_unlock(&d->lock);
+    int status = KOS_ERROR_SUCCESS;
+    if (sector < end) {
+        status = readahead_base_read(d, buf + (sector - startsector)
+                                     * d->vdisk.sect_size, sector,
+                                     end - sector);
+        if (status == KOS_ERROR_SUCCESS) {
+            sector = end;
+        }
+    }
+    if (status == KOS_ERROR_SUCCESS && sector - startsector < *numsectors) {
+        status = KOS_ERROR_DEVICE;
+    }
+    if (status != KOS_ERROR_SUCCESS) {
+        d->window = 0;
+        *numsectors = sector - startsector;
+    }
+    COVERAGE_ON();
+    return status;
+}
+
+// Staged sectors are updated by writes, dropped if a write fails
+STDCALL int
+vdisk_readahead_write(void *userdata, void *buffer, off_t startsector,
+                      size_t *numsectors) {
+    COVERAGE_OFF();
+    struct vdisk_readahead *d = userdata;
+    uint64_t start = startsector;
+    uint64_t end = start + *numsectors;
+    int status = d->base->diskfunc.write(d->base, buffer, startsector,
+                                         numsectors);
+    COVERAGE_OFF();
+    if (start < d->fill_end && end > d->fill_start) {
+        d->fill_stale = 1;
+    }
+    if (start < d->staged_end && end > d->staged_start) {
+        if (status != KOS_ERROR_SUCCESS) {
+            d->staged_end = d->staged_start;
+        } else {
+            uint64_t from = start > d->staged_start ? start : d->staged_start;
+            uint64_t to = end < d->staged_end ? end : d->staged_end;
+            memcpy(d->staged + (from - d->staged_start) * d->vdisk.sect_size,
+                   (uint8_t*)buffer + (from - start) * d->vdisk.sect_size,
+                   (to - from) * d->vdisk.sect_size);
+        }
+    }
+    COVERAGE_ON();
+    return status;
+}
+
+STDCALL int
+vdisk_readahead_flush(void *userdata) {
+    COVERAGE_OFF();
+    struct vdisk_readahead *d = userdata;
+    // the base switches coverage on when it returns
+    return d->base->diskfunc.flush(d->base);
+}
+
+static int
+vdisk_readahead_block_status(struct vdisk *vdisk, uint64_t sector,
+                             uint64_t *cnt) {
+    struct vdisk_readahead *d = (struct vdisk_readahead*)vdisk;
+    return d->base->block_status(d->base, sector, cnt);
+}
+
+// The range is dropped once more when the base is done, a read in the
+// background may have started meanwhile
+static int
+vdisk_readahead_discard(struct vdisk *vdisk, uint64_t sector, uint64_t cnt) {
+    struct vdisk_readahead *d = (struct vdisk_readahead*)vdisk;
+    readahead_drop(d, sector, sector + cnt);
+    int status = d->base->discard(d->base, sector, cnt);
+    readahead_drop(d, sector, sector + cnt);
+    return status;
+}
+
+struct vdisk*
+vdisk_init_readahead(struct vdisk *base, size_t window_max,
+                     const struct umka_io *io) {
+    struct vdisk_readahead *d = calloc(1, sizeof(struct vdisk_readahead));
+    if (!d) {
+        fprintf(stderr, "[vdisk.readahead] can't allocate memory\n");
+        return NULL;
+    }
+    d->vdisk = (struct vdisk){.diskfunc = {.strucsize = sizeof(diskfunc_t),
+                                           .close = vdisk_readahead_close,
+                                           .read = vdisk_readahead_read,
+                                           .write = vdisk_readahead_write,
+                                           .flush = vdisk_readahead_flush,
+                                          },
+                              .sect_size = base->sect_size,
+                              .sect_cnt = base->sect_cnt,
+                              .io = io,
+                             };
+    if (base->block_status) {
+        d->vdisk.block_status = vdisk_readahead_block_status;
+    }
+    if (base->discard) {
+        d->vdisk.discard = vdisk_readahead_discard;
+    }
+    d->base = base;
+    d->window_max = window_max / base->sect_size;
+    d->window_min = READAHEAD_WINDOW_MIN / base->sect_size;
+    if (!d->window_max) {
+        d->window_max = 1;
+    }
+    if (d->window_min > d->window_max) {
+        d->window_min = d->window_max;
+    }
+    d->staged = malloc(d->window_max * base->sect_size);
+    d->spare = malloc(d->window_max * base->sect_size);
+    if (!d->staged || !d->spare) {
+        fprintf(stderr, "[vdisk.readahead] can't allocate memory\n");
+        free(d->staged);
+        free(d->spare);
+        free(d);
+        return NULL;
+    }
+    // the first read at sector zero doesn't start a stream
+    d->next = UINT64_MAX;
+    return (struct vdisk*)d;
+}
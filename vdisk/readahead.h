@@ -0,0 +1,26 @@
+/*
+    SPDX-License-Identifier: GPL-2.0-or-later
+
+    UMKa - User-Mode KolibriOS developer tools
+    vdisk - virtual disk, sequential readahead
+
+    Copyright (C) 2023  Ivan Baravy <dunkaist@gmail.com>
+*/
+
+#ifndef VDISK_READAHEAD_H_INCLUDED
+#define VDISK_READAHEAD_H_INCLUDED
+
+#include <stddef.h>
+#include "vdisk.h"
+#include "umkaio.h"
+
+#define READAHEAD_WINDOW_MIN 0x20000    // first window of a stream, bytes
+
+// Takes ownership of base, it must have read_start. Sequential reads are
+// detected and the window read ahead of them in the background grows twice on
+// every request of the stream up to window_max bytes.
+struct vdisk*
+vdisk_init_readahead(struct vdisk *base, size_t window_max,
+                     const struct umka_io *io);
+
+#endif  // VDISK_READAHEAD_H_INCLUDED
@@ -0,0 +1,211 @@
+/*
+    SPDX-License-Identifier: GPL-2.0-or-later
+
+    UMKa - User-Mode KolibriOS developer tools
+    vdisk - virtual disk, device latency and bandwidth model
+
+    Copyright (C) 2023  Ivan Baravy <dunkaist@gmail.com>
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "umka.h"
+#include "../trace.h"
+#include "throttle.h"
+
+struct throttle_preset {
+    const char *name;
+    uint32_t latency_us;
+    uint32_t seek_us;
+    uint64_t bandwidth;
+};
+
+// A 7200 rpm drive, its seek is an average one plus half a revolution, and a
+// SATA SSD
+static const struct throttle_preset throttle_presets[] = {
+    {"hdd", 100, 8000, 150000000},
+    {"ssd", 80, 0, 500000000},
+};
+
+struct vdisk_throttle {
+    struct vdisk vdisk;
+    struct vdisk *base;
+    uint64_t latency_ns;
+    uint64_t seek_ns;
+    uint64_t bandwidth;
+    uint64_t next;          // sector that doesn't need a seek
+    uint64_t busy_until;    // ns, when the previous request completes
+};
+
+static uint64_t
+throttle_time_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint32_t
+throttle_wait_test(void /* struct appdata * with wait_param is in ebx */) {
+    appdata_t *app;
+    __asm__ __volatile__ __inline__ ("":"=b"(app)::);
+    const uint64_t *deadline_ns = app->wait_param;
+    return throttle_time_ns() >= *deadline_ns;
+}
+
+// A kernel thread waits in the scheduler as it does for i/o, so other threads
+// run meanwhile. The host thread sleeps only if the kernel doesn't run.
+static void
+throttle_sleep_until(struct vdisk_throttle *d, uint64_t deadline_ns) {
+    uint64_t now = throttle_time_ns();
+    if (now >= deadline_ns) {
+        return;
+    }
+    const struct umka_io *io = d->vdisk.io;
+    if (*io->running == UMKA_RUNNING_YES) {
+        kos_wait_events(throttle_wait_test, &deadline_ns);
+    } else {
+        uint64_t ns = deadline_ns - now;
+        struct timespec ts = {.tv_sec = ns / 1000000000,
+                              .tv_nsec = ns % 1000000000};
+        while (nanosleep(&ts, &ts) == -1 && errno == EINTR) {}
+    }
+}
+
+// Returns when the request that started at start_ns completes in the model
+static uint64_t
+throttle_complete_ns(struct vdisk_throttle *d, uint64_t start_ns,
+                     uint64_t sector, uint64_t cnt) {
+    uint64_t t = start_ns > d->busy_until ? start_ns : d->busy_until;
+    t += d->latency_ns;
+    if (cnt) {
+        if (sector != d->next) {
+            t += d->seek_ns;
+        }
+        if (d->bandwidth) {
+            t += cnt * d->vdisk.sect_size * 1000000000 / d->bandwidth;
+        }
+        d->next = sector + cnt;
+    }
+    d->busy_until = t;
+    return t;
+}
+
+STDCALL void
+vdisk_throttle_close(void *userdata) {
+    COVERAGE_OFF();
+    struct vdisk_throttle *d = userdata;
+    d->base->diskfunc.close(d->base);
+    COVERAGE_OFF();
+    free(d);
+    COVERAGE_ON();
+}
+
+STDCALL int
+vdisk_throttle_read(void *userdata, void *buffer, off_t startsector,
+                    size_t *numsectors) {
+    COVERAGE_OFF();
+    struct vdisk_throttle *d = userdata;
+    uint64_t start_ns = throttle_time_ns();
+    int status = d->base->diskfunc.read(d->base, buffer, startsector,
+                                        numsectors);
+    COVERAGE_OFF();
+    throttle_sleep_until(d, throttle_complete_ns(d, start_ns, startsector,
+                                                 *numsectors));
+    COVERAGE_ON();
+    return status;
+}
+
+STDCALL int
+vdisk_throttle_write(void *userdata, void *buffer, off_t startsector,
+                     size_t *numsectors) {
+    COVERAGE_OFF();
+    struct vdisk_throttle *d = userdata;
+    uint64_t start_ns = throttle_time_ns();
+    int status = d->base->diskfunc.write(d->base, buffer, startsector,
+                                         numsectors);
+    COVERAGE_OFF();
+    throttle_sleep_until(d, throttle_complete_ns(d, start_ns, startsector,
+                                                 *numsectors));
+    COVERAGE_ON();
+    return status;
+}
+
+STDCALL int
+vdisk_throttle_flush(void *userdata) {
+    COVERAGE_OFF();
+    struct vdisk_throttle *d = userdata;
+    uint64_t start_ns = throttle_time_ns();
+    int status = d->base->diskfunc.flush(d->base);
+    COVERAGE_OFF();
+    throttle_sleep_until(d, throttle_complete_ns(d, start_ns, 0, 0));
+    COVERAGE_ON();
+    return status;
+}
+
+static int
+vdisk_throttle_block_status(struct vdisk *vdisk, uint64_t sector,
+                            uint64_t *cnt) {
+    struct vdisk_throttle *d = (struct vdisk_throttle*)vdisk;
+    return d->base->block_status(d->base, sector, cnt);
+}
+
+// The device is told about unused sectors, it doesn't move any data
+static int
+vdisk_throttle_discard(struct vdisk *vdisk, uint64_t sector, uint64_t cnt) {
+    struct vdisk_throttle *d = (struct vdisk_throttle*)vdisk;
+    uint64_t start_ns = throttle_time_ns();
+    int status = d->base->discard(d->base, sector, cnt);
+    throttle_sleep_until(d, throttle_complete_ns(d, start_ns, 0, 0));
+    return status;
+}
+
+int
+vdisk_throttle_preset(const char *name, struct vdisk_params *params) {
+    size_t cnt = sizeof(throttle_presets) / sizeof(*throttle_presets);
+    for (size_t i = 0; i < cnt; i++) {
+        const struct throttle_preset *p = throttle_presets + i;
+        if (!strcmp(name, p->name)) {
+            params->latency_us = p->latency_us;
+            params->seek_us = p->seek_us;
+            params->bandwidth = p->bandwidth;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+struct vdisk*
+vdisk_init_throttle(struct vdisk *base, uint32_t latency_us, uint32_t seek_us,
+                    uint64_t bandwidth, const struct umka_io *io) {
+    struct vdisk_throttle *d = calloc(1, sizeof(struct vdisk_throttle));
+    if (!d) {
+        fprintf(stderr, "[vdisk.throttle] can't allocate memory\n");
+        return NULL;
+    }
+    d->vdisk = (struct vdisk){.diskfunc = {.strucsize = sizeof(diskfunc_t),
+                                           .close = vdisk_throttle_close,
+                                           .read = vdisk_throttle_read,
+                                           .write = vdisk_throttle_write,
+                                           .flush = vdisk_throttle_flush,
+                                          },
+                              .sect_size = base->sect_size,
+                              .sect_cnt = base->sect_cnt,
+                              .io = io,
+                             };
+    if (base->block_status) {
+        d->vdisk.block_status = vdisk_throttle_block_status;
+    }
+    if (base->discard) {
+        d->vdisk.discard = vdisk_throttle_discard;
+    }
+    d->base = base;
+    d->latency_ns = (uint64_t)latency_us * 1000;
+    d->seek_ns = (uint64_t)seek_us * 1000;
+    d->bandwidth = bandwidth;
+    // the first request needs a seek
+    d->next = UINT64_MAX;
+    return (struct vdisk*)d;
+}
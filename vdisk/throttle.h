@@ -0,0 +1,30 @@
+/*
+    SPDX-License-Identifier: GPL-2.0-or-later
+
+    UMKa - User-Mode KolibriOS developer tools
+    vdisk - virtual disk, device latency and bandwidth model
+
+    Copyright (C) 2023  Ivan Baravy <dunkaist@gmail.com>
+*/
+
+#ifndef VDISK_THROTTLE_H_INCLUDED
+#define VDISK_THROTTLE_H_INCLUDED
+
+#include <stdint.h>
+#include "vdisk.h"
+#include "umkaio.h"
+
+// Sets latency, seek and bandwidth of params to those of a typical device:
+// hdd or ssd. Returns -1 if the name is unknown.
+int
+vdisk_throttle_preset(const char *name, struct vdisk_params *params);
+
+// Takes ownership of base. Every request completes no earlier than the model
+// says: it takes latency_us, seek_us more if it doesn't start where the
+// previous one ended, and its size at bandwidth bytes per second, unlimited if
+// zero. Requests are served one after another as by a single head.
+struct vdisk*
+vdisk_init_throttle(struct vdisk *base, uint32_t latency_us, uint32_t seek_us,
+                    uint64_t bandwidth, const struct umka_io *io);
+
+#endif  // VDISK_THROTTLE_H_INCLUDED
@@ -0,0 +1,203 @@
+/*
+    SPDX-License-Identifier: GPL-2.0-or-later
+
+    UMKa - User-Mode KolibriOS developer tools
+    vdisk - virtual disk, working set estimation
+
+    Copyright (C) 2023  Ivan Baravy <dunkaist@gmail.com>
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "working_set.h"
+
+#define WORKING_SET_SLOTS (WORKING_SET_TRACKED_MAX * 2)
+#define WORKING_SET_BUCKETS (WORKING_SET_TRACKED_MAX * 2)
+#define WORKING_SET_NONE UINT32_MAX
+
+// The kernel only asks for sectors its disk cache misses. A sector that is
+// missed again after d other distinct sectors were missed would have been a
+// hit if the cache was about d sectors larger, like a hit in a ghost list.
+// Reuse distances are measured on a spatially hashed sample of sectors and
+// scaled back, so that few sectors are tracked.
+//
+// Every access takes the next time slot. A tracked sector is found by hash
+// and marks the slot of its last access in a Fenwick tree, so its reuse
+// distance is the number of marks after that slot. The least recent sector is
+// forgotten when too many are tracked. When the slots run out, the tracked
+// sectors are moved to the first ones in the same order.
+struct working_set_entry {
+    uint64_t sector;
+    uint32_t slot;
+    uint32_t next;      // in the bucket or in the free list
+};
+
+struct working_set {
+    struct working_set_entry entries[WORKING_SET_TRACKED_MAX];
+    uint32_t buckets[WORKING_SET_BUCKETS];
+    uint32_t free;
+    uint32_t slot_entry[WORKING_SET_SLOTS];     // NONE if the slot is unused
+    uint16_t marks[WORKING_SET_SLOTS + 1];      // Fenwick tree, 1-based
+    uint32_t now;       // next slot
+    uint32_t oldest;    // no used slots before it
+    uint32_t cnt;       // tracked sectors
+    // reuses by distance in sampled sectors
+    uint64_t hist[WORKING_SET_TRACKED_MAX];
+};
+
+static uint64_t
+working_set_hash(uint64_t sector) {
+    return sector * 0x9e3779b97f4a7c15ull;
+}
+
+static int
+working_set_sampled(uint64_t sector) {
+    return !(working_set_hash(sector) >> (64 - WORKING_SET_SAMPLE_SHIFT));
+}
+
+// Sampled sectors share the top bits of the hash, the low ones spread them
+static uint32_t *
+working_set_bucket(struct working_set *ws, uint64_t sector) {
+    return ws->buckets + (working_set_hash(sector) >> 16)
+                         % WORKING_SET_BUCKETS;
+}
+
+static void
+working_set_mark(struct working_set *ws, uint32_t slot, int delta) {
+    for (uint32_t i = slot + 1; i <= WORKING_SET_SLOTS; i += i & -i) {
+        ws->marks[i] += delta;
+    }
+}
+
+// Marks in slots up to the given one, inclusive
+static uint32_t
+working_set_marked(const struct working_set *ws, uint32_t slot) {
+    uint32_t sum = 0;
+    for (uint32_t i = slot + 1; i; i -= i & -i) {
+        sum += ws->marks[i];
+    }
+    return sum;
+}
+
+static void
+working_set_compact(struct working_set *ws) {
+    uint32_t now = 0;
+    for (uint32_t slot = ws->oldest; slot < ws->now; slot++) {
+        uint32_t e = ws->slot_entry[slot];
+        if (e != WORKING_SET_NONE) {
+            ws->slot_entry[slot] = WORKING_SET_NONE;
+            ws->slot_entry[now] = e;
+            ws->entries[e].slot = now++;
+        }
+    }
+    // a node counts the marked slots of the range it covers
+    for (uint32_t i = 1; i <= WORKING_SET_SLOTS; i++) {
+        uint32_t first = i - (i & -i);
+        ws->marks[i] = now <= first ? 0 : (now < i ? now : i) - first;
+    }
+    ws->oldest = 0;
+    ws->now = now;
+}
+
+static void
+working_set_forget_oldest(struct working_set *ws) {
+    while (ws->slot_entry[ws->oldest] == WORKING_SET_NONE) {
+        ws->oldest++;
+    }
+    uint32_t e = ws->slot_entry[ws->oldest];
+    uint32_t *link = working_set_bucket(ws, ws->entries[e].sector);
+    while (*link != e) {
+        link = &ws->entries[*link].next;
+    }
+    *link = ws->entries[e].next;
+    ws->entries[e].next = ws->free;
+    ws->free = e;
+    ws->slot_entry[ws->oldest] = WORKING_SET_NONE;
+    working_set_mark(ws, ws->oldest, -1);
+    ws->cnt--;
+}
+
+static void
+working_set_access_sampled(struct working_set *ws, uint64_t sector) {
+    if (ws->now == WORKING_SET_SLOTS) {
+        working_set_compact(ws);
+    }
+    uint32_t *bucket = working_set_bucket(ws, sector);
+    uint32_t e = *bucket;
+    while (e != WORKING_SET_NONE && ws->entries[e].sector != sector) {
+        e = ws->entries[e].next;
+    }
+    if (e != WORKING_SET_NONE) {
+        uint32_t slot = ws->entries[e].slot;
+        ws->hist[ws->cnt - working_set_marked(ws, slot)]++;
+        ws->slot_entry[slot] = WORKING_SET_NONE;
+        working_set_mark(ws, slot, -1);
+    } else {
+        if (ws->cnt == WORKING_SET_TRACKED_MAX) {
+            working_set_forget_oldest(ws);
+        }
+        e = ws->free;
+        ws->free = ws->entries[e].next;
+        ws->entries[e].sector = sector;
+        ws->entries[e].next = *bucket;
+        *bucket = e;
+        ws->cnt++;
+    }
+    ws->entries[e].slot = ws->now;
+    ws->slot_entry[ws->now] = e;
+    working_set_mark(ws, ws->now, 1);
+    ws->now++;
+}
+
+struct working_set *
+working_set_init(void) {
+    struct working_set *ws = calloc(1, sizeof(struct working_set));
+    if (!ws) {
+        return NULL;
+    }
+    for (uint32_t i = 0; i < WORKING_SET_TRACKED_MAX; i++) {
+        ws->entries[i].next = i + 1 < WORKING_SET_TRACKED_MAX
+                              ? i + 1 : WORKING_SET_NONE;
+    }
+    memset(ws->buckets, 0xff, sizeof(ws->buckets));
+    memset(ws->slot_entry, 0xff, sizeof(ws->slot_entry));
+    return ws;
+}
+
+void
+working_set_free(struct working_set *ws) {
+    free(ws);
+}
+
+void
+working_set_access(struct working_set *ws, uint64_t sector, uint64_t cnt) {
+    for (uint64_t end = sector + cnt; sector < end; sector++) {
+        if (working_set_sampled(sector)) {
+            working_set_access_sampled(ws, sector);
+        }
+    }
+}
+
+size_t
+working_set_recommend(const struct working_set *ws, size_t cache_size,
+                      uint32_t sect_size) {
+    uint64_t reuses = 0;
+    for (size_t i = 0; i < WORKING_SET_TRACKED_MAX; i++) {
+        reuses += ws->hist[i];
+    }
+    if (!reuses) {
+        return cache_size;
+    }
+    uint64_t target = (reuses * WORKING_SET_REUSE_PERCENT + 99) / 100;
+    uint64_t sum = 0;
+    size_t pos = 0;
+    while ((sum += ws->hist[pos]) < target) {
+        pos++;
+    }
+    return cache_size + ((pos + 1) << WORKING_SET_SAMPLE_SHIFT) * sect_size;
+}
+
+void
+working_set_reset(struct working_set *ws) {
+    memset(ws->hist, 0, sizeof(ws->hist));
+}
@@ -0,0 +1,42 @@
+/*
+    SPDX-License-Identifier: GPL-2.0-or-later
+
+    UMKa - User-Mode KolibriOS developer tools
+    vdisk - virtual disk, working set estimation
+
+    Copyright (C) 2023  Ivan Baravy <dunkaist@gmail.com>
+*/
+
+#ifndef VDISK_WORKING_SET_H_INCLUDED
+#define VDISK_WORKING_SET_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define WORKING_SET_SAMPLE_SHIFT 6      // one sector of 64 is tracked
+#define WORKING_SET_TRACKED_MAX 4096    // sampled sectors
+#define WORKING_SET_REUSE_PERCENT 90    // of reuses the recommendation catches
+
+struct working_set;
+
+struct working_set *
+working_set_init(void);
+
+void
+working_set_free(struct working_set *ws);
+
+// Sectors read by the kernel, i.e. misses of its disk cache
+void
+working_set_access(struct working_set *ws, uint64_t sector, uint64_t cnt);
+
+// Returns the disk cache size in bytes that would have caught most of the
+// misses if the cache was cache_size bytes when they happened
+size_t
+working_set_recommend(const struct working_set *ws, size_t cache_size,
+                      uint32_t sect_size);
+
+// Forgets reuse distances, they are relative to the previous cache size
+void
+working_set_reset(struct working_set *ws);
+
+#endif  // VDISK_WORKING_SET_H_INCLUDED
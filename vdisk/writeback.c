@@ -0,0 +1,354 @@
+/*
+    SPDX-License-Identifier: GPL-2.0-or-later
+
+    UMKa - User-Mode KolibriOS developer tools
+    vdisk - virtual disk, write-back buffer
+
+    Copyright (C) 2023  Ivan Baravy <dunkaist@gmail.com>
+*/
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../trace.h"
+#include "writeback.h"
+
+#define WRITEBACK_PAGES_MIN 16
+
+// Dirty sectors are kept in pages sorted by their index, so that they are
+// written back in disk order and adjacent ones are joined into large writes.
+// Reads are served by the base and then patched with dirty sectors. Requests
+// are served one at a time: the pages and the run buffer are used across
+// waits for the base, and a read must not miss a page written back meanwhile.
+struct writeback_page {
+    uint64_t index;
+    uint32_t dirty;     // bitmap of sectors
+    uint8_t *data;
+};
+
+struct vdisk_writeback {
+    struct vdisk vdisk;
+    struct vdisk *base;
+    uint32_t page_sects;
+    size_t dirty_max;   // pages
+    struct writeback_page *pages;
+    size_t page_cnt;
+    size_t page_cap;
+    uint8_t *run;       // dirty sectors are joined here, WRITEBACK_WRITE_MAX
+    int unsynced;       // the base was written to since the last flush
+    int lock;           // see vdisk_lock
+};
+
+// Returns the position of the first page with index not less than the given
+static size_t
+writeback_find(const struct vdisk_writeback *d, uint64_t index) {
+    size_t lo = 0, hi = d->page_cnt;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (d->pages[mid].index < index) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static struct writeback_page *
+writeback_get_page(struct vdisk_writeback *d, uint64_t index) {
+    size_t pos = writeback_find(d, index);
+    if (pos < d->page_cnt && d->pages[pos].index == index) {
+        return d->pages + pos;
+    }
+    if (d->page_cnt == d->page_cap) {
+        size_t cap = d->page_cap ? d->page_cap * 2 : WRITEBACK_PAGES_MIN;
+        struct writeback_page *pages = realloc(d->pages,
+                                               cap * sizeof(*pages));
+        if (!pages) {
+            return NULL;
+        }
+        d->pages = pages;
+        d->page_cap = cap;
+    }
+    uint8_t *data = malloc(WRITEBACK_PAGE_SIZE);
+    if (!data) {
+        return NULL;
+    }
+    memmove(d->pages + pos + 1, d->pages + pos,
+            (d->page_cnt - pos) * sizeof(*d->pages));
+    d->pages[pos] = (struct writeback_page){.index = index, .dirty = 0,
+                                            .data = data};
+    d->page_cnt++;
+    return d->pages + pos;
+}
+
+// The base disk switches coverage on when it returns
+static int
+writeback_base_write(struct vdisk_writeback *d, void *buf, uint64_t sector,
+                     size_t cnt) {
+    size_t numsectors = cnt;
+    int status = d->base->diskfunc.write(d->base, buf, sector, &numsectors);
+    COVERAGE_OFF();
+    d->unsynced = 1;
+    return status;
+}
+
+// Drops the first cnt pages, they are written back
+static void
+writeback_drop(struct vdisk_writeback *d, size_t cnt) {
+    for (size_t i = 0; i < cnt; i++) {
+        free(d->pages[i].data);
+    }
+    memmove(d->pages, d->pages + cnt, (d->page_cnt - cnt) * sizeof(*d->pages));
+    d->page_cnt -= cnt;
+}
+
+// A page is dropped only when all its sectors are written, so on failure the
+// rest stays dirty and is written again by the next try
+static int
+writeback_all(struct vdisk_writeback *d) {
+    uint32_t sect_size = d->vdisk.sect_size;
+    size_t run_max = WRITEBACK_WRITE_MAX / sect_size;
+    uint64_t run_start = 0;
+    size_t run_cnt = 0;
+    size_t written = 0;     // pages before the one the run ends in
+    for (size_t i = 0; i < d->page_cnt; i++) {
+        const struct writeback_page *p = d->pages + i;
+        for (uint32_t s = 0; s < d->page_sects; s++) {
+            if (!(p->dirty & (1u << s))) {
+                continue;
+            }
+            uint64_t sector = p->index * d->page_sects + s;
+            if (run_cnt && (sector != run_start + run_cnt
+                            || run_cnt == run_max)) {
+                int status = writeback_base_write(d, d->run, run_start,
+                                                  run_cnt);
+                if (status != KOS_ERROR_SUCCESS) {
+                    writeback_drop(d, written);
+                    return status;
+                }
+                written = i;
+                run_cnt = 0;
+            }
+            if (!run_cnt) {
+                run_start = sector;
+            }
+            memcpy(d->run + run_cnt * sect_size, p->data + s * sect_size,
+                   sect_size);
+            run_cnt++;
+        }
+    }
+    if (run_cnt) {
+        int status = writeback_base_write(d, d->run, run_start, run_cnt);
+        if (status != KOS_ERROR_SUCCESS) {
+            writeback_drop(d, written);
+            return status;
+        }
+    }
+    writeback_drop(d, d->page_cnt);
+    return KOS_ERROR_SUCCESS;
+}
+
+STDCALL void
+vdisk_writeback_close(void *userdata) {
+    COVERAGE_OFF();
+    struct vdisk_writeback *d = userdata;
+    if (d->page_cnt && writeback_all(d) != KOS_ERROR_SUCCESS) {
+        fprintf(stderr, "[vdisk.writeback] can't write back %zu pages, they"
+                " are lost\n", d->page_cnt);
+    }
+    d->base->diskfunc.close(d->base);
+    COVERAGE_OFF();
+    for (size_t i = 0; i < d->page_cnt; i++) {
+        free(d->pages[i].data);
+    }
+    free(d->pages);
+    free(d->run);
+    free(d);
+    COVERAGE_ON();
+}
+
+STDCALL int
+vdisk_writeback_read(void *userdata, void *buffer, off_t startsector,
+                     size_t *numsectors) {
+    COVERAGE_OFF();
+    struct vdisk_writeback *d = userdata;
+    uint8_t *buf = buffer;
+    uint32_t sect_size = d->vdisk.sect_size;
+    vdisk_lock(&d->lock, d->vdisk.io);
+    int status = d->base->diskfunc.read(d->base, buffer, startsector,
+                                        numsectors);
+    COVERAGE_OFF();
+    uint64_t start = startsector;
+    uint64_t end = start + *numsectors;
+    for (size_t i = writeback_find(d, start / d->page_sects);
+         i < d->page_cnt && d->pages[i].index * d->page_sects < end; i++) {
+        const struct writeback_page *p = d->pages + i;
+        for (uint32_t s = 0; s < d->page_sects; s++) {
+            uint64_t sector = p->index * d->page_sects + s;
+            if (sector >= start && sector < end && (p->dirty & (1u << s))) {
+                memcpy(buf + (sector - start) * sect_size,
+                       p->data + s * sect_size, sect_size);
+            }
+        }
+    }
+    vdisk_unlock(&d->lock);
+    COVERAGE_ON();
+    return status;
+}
+
+// Writes larger than the buffer go straight to the base after the buffer is
+// written back, so that they are never overwritten by older data
+STDCALL int
+vdisk_writeback_write(void *userdata, void *buffer, off_t startsector,
+                      size_t *numsectors) {
+    COVERAGE_OFF();
+    struct vdisk_writeback *d = userdata;
+    const uint8_t *buf = buffer;
+    uint32_t sect_size = d->vdisk.sect_size;
+    uint64_t sector = startsector;
+    uint64_t end = sector + *numsectors;
+    if (end > d->vdisk.sect_cnt) {
+        end = d->vdisk.sect_cnt;
+    }
+    int direct = end - sector > d->dirty_max * d->page_sects;
+    vdisk_lock(&d->lock, d->vdisk.io);
+    while (sector < end && !direct) {
+        uint64_t index = sector / d->page_sects;
+        uint64_t page_end = (index + 1) * d->page_sects;
+        if (page_end > end) {
+            page_end = end;
+        }
+        struct writeback_page *p = writeback_get_page(d, index);
+        if (!p) {
+            direct = 1;
+            break;
+        }
+        for (; sector < page_end; sector++) {
+            uint32_t s = sector % d->page_sects;
+            p->dirty |= 1u << s;
+            memcpy(p->data + s * sect_size,
+                   buf + (sector - startsector) * sect_size, sect_size);
+        }
+    }
+    int status = KOS_ERROR_SUCCESS;
+    if (direct || d->page_cnt > d->dirty_max) {
+        status = writeback_all(d);
+    }
+    if (direct && status == KOS_ERROR_SUCCESS) {
+        sector = startsector;
+        status = writeback_base_write(d, buffer, sector, end - sector);
+        if (status == KOS_ERROR_SUCCESS) {
+            sector = end;
+        }
+    }
+    if (status == KOS_ERROR_SUCCESS && sector - startsector < *numsectors) {
+        status = KOS_ERROR_DEVICE;
+    }
+    vdisk_unlock(&d->lock);
+    if (status != KOS_ERROR_SUCCESS) {
+        *numsectors = direct ? 0 : sector - startsector;
+    }
+    COVERAGE_ON();
+    return status;
+}
+
+// All the writes buffered before are made durable by a single flush of the
+// base, which is skipped if nothing was written since the last one
+STDCALL int
+vdisk_writeback_flush(void *userdata) {
+    COVERAGE_OFF();
+    struct vdisk_writeback *d = userdata;
+    vdisk_lock(&d->lock, d->vdisk.io);
+    int status = writeback_all(d);
+    if (status == KOS_ERROR_SUCCESS && d->unsynced) {
+        status = d->base->diskfunc.flush(d->base);
+        COVERAGE_OFF();
+        if (status == KOS_ERROR_SUCCESS) {
+            d->unsynced = 0;
+        }
+    }
+    vdisk_unlock(&d->lock);
+    COVERAGE_ON();
+    return status;
+}
+
+static int
+vdisk_writeback_block_status(struct vdisk *vdisk, uint64_t sector,
+                             uint64_t *cnt) {
+    struct vdisk_writeback *d = (struct vdisk_writeback*)vdisk;
+    return d->base->block_status(d->base, sector, cnt);
+}
+
+// Buffered writes to the range are dropped, pages left clean are freed
+static int
+vdisk_writeback_discard(struct vdisk *vdisk, uint64_t sector, uint64_t cnt) {
+    struct vdisk_writeback *d = (struct vdisk_writeback*)vdisk;
+    uint64_t end = sector + cnt;
+    vdisk_lock(&d->lock, d->vdisk.io);
+    size_t kept = writeback_find(d, sector / d->page_sects);
+    for (size_t i = kept; i < d->page_cnt; i++) {
+        struct writeback_page *p = d->pages + i;
+        for (uint32_t s = 0; s < d->page_sects; s++) {
+            uint64_t x = p->index * d->page_sects + s;
+            if (x >= sector && x < end) {
+                p->dirty &= ~(1u << s);
+            }
+        }
+        if (p->dirty) {
+            d->pages[kept++] = *p;
+        } else {
+            free(p->data);
+        }
+    }
+    d->page_cnt = kept;
+    int status = d->base->discard(d->base, sector, cnt);
+    vdisk_unlock(&d->lock);
+    return status;
+}
+
+struct vdisk*
+vdisk_init_writeback(struct vdisk *base, size_t dirty_max,
+                     const struct umka_io *io) {
+    if (WRITEBACK_PAGE_SIZE % base->sect_size) {
+        fprintf(stderr, "[vdisk.writeback] sector size %" PRIu32 " doesn't"
+                " divide page size, writes aren't buffered\n",
+                base->sect_size);
+        return base;
+    }
+    struct vdisk_writeback *d = calloc(1, sizeof(struct vdisk_writeback));
+    if (!d) {
+        fprintf(stderr, "[vdisk.writeback] can't allocate memory\n");
+        return NULL;
+    }
+    d->vdisk = (struct vdisk){.diskfunc = {.strucsize = sizeof(diskfunc_t),
+                                           .close = vdisk_writeback_close,
+                                           .read = vdisk_writeback_read,
+                                           .write = vdisk_writeback_write,
+                                           .flush = vdisk_writeback_flush,
+                                          },
+                              .sect_size = base->sect_size,
+                              .sect_cnt = base->sect_cnt,
+                              .io = io,
+                             };
+    if (base->block_status) {
+        d->vdisk.block_status = vdisk_writeback_block_status;
+    }
+    if (base->discard) {
+        d->vdisk.discard = vdisk_writeback_discard;
+    }
+    d->base = base;
+    d->page_sects = WRITEBACK_PAGE_SIZE / base->sect_size;
+    d->dirty_max = dirty_max / WRITEBACK_PAGE_SIZE;
+    if (!d->dirty_max) {
+        d->dirty_max = 1;
+    }
+    d->run = malloc(WRITEBACK_WRITE_MAX);
+    if (!d->run) {
+        fprintf(stderr, "[vdisk.writeback] can't allocate memory\n");
+        free(d);
+        return NULL;
+    }
+    return (struct vdisk*)d;
+}
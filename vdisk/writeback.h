@@ -0,0 +1,27 @@
+/*
+    SPDX-License-Identifier: GPL-2.0-or-later
+
+    UMKa - User-Mode KolibriOS developer tools
+    vdisk - virtual disk, write-back buffer
+
+    Copyright (C) 2023  Ivan Baravy <dunkaist@gmail.com>
+*/
+
+#ifndef VDISK_WRITEBACK_H_INCLUDED
+#define VDISK_WRITEBACK_H_INCLUDED
+
+#include <stddef.h>
+#include "vdisk.h"
+#include "umkaio.h"
+
+#define WRITEBACK_PAGE_SIZE 4096
+#define WRITEBACK_WRITE_MAX 0x100000    // bytes written to the base at once
+
+// Takes ownership of base. Writes are kept in memory until flush, close or
+// until there are more than dirty_max bytes of them. The base is returned as
+// is, with a warning, if its sector size doesn't divide the page size.
+struct vdisk*
+vdisk_init_writeback(struct vdisk *base, size_t dirty_max,
+                     const struct umka_io *io);
+
+#endif  // VDISK_WRITEBACK_H_INCLUDED
@@ -0,0 +1,490 @@
+/*
+    SPDX-License-Identifier: GPL-2.0-or-later
+
+    UMKa - User-Mode KolibriOS developer tools
+    vdisk - virtual disk, seekable zstd compressed raw format
+
+    Copyright (C) 2023  Ivan Baravy <dunkaist@gmail.com>
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../trace.h"
+#include "zst.h"
+#include "raw.h"
+#include "cluster_cache.h"
+#include "inflate_pool.h"
+#define ZSTD_STATIC_LINKING_ONLY    // ZSTD_initStaticDCtx
+#include "zstd/lib/zstd.h"
+
+// The image is a raw disk image cut into frames of the same size, the last
+// one may be shorter, compressed independently of each other. The frames are
+// followed by a seek table in a skippable frame, as in the zstd seekable
+// format. All the numbers are little endian.
+//   u32 skippable frame magic
+//   u32 size of the rest of the skippable frame
+//   per frame: u32 compressed size, u32 decompressed size, [u32 checksum]
+//   u32 number of frames
+//   u8 descriptor
+//   u32 seekable magic
+#define ZST_SKIPPABLE_MAGIC 0x184d2a5eu
+#define ZST_SEEKABLE_MAGIC 0x8f92eab1u
+#define ZST_SKIPPABLE_HEADER_SIZE 8
+#define ZST_FOOTER_SIZE 9
+#define ZST_DESCRIPTOR_CHECKSUM 0x80    // entries have checksums
+#define ZST_DESCRIPTOR_RESERVED 0x7c
+#define ZST_FRAME_SIZE_MAX (16u << 20)
+
+#define ZST_INFLATE_JOBS_MAX 32
+
+struct vdisk_zst {
+    struct vdisk vdisk;
+    int fd;
+    size_t frame_size;  // decompressed, of every frame but the last one
+    size_t last_frame_size;
+    size_t frame_cnt;
+    uint64_t *frame_offsets;    // in the file, one more than frames
+    size_t cmp_size_max;
+    uint8_t *cmp_frame; // for frames inflated on the calling thread
+    int cmp_frame_busy;
+    void *inflate_work;
+    struct cluster_cache *cache;    // inflated frames
+    size_t inflate_thread_cnt;
+    struct inflate_pool *inflate_pool;  // started on first use
+};
+
+static inline uint32_t
+le32(const uint8_t *x) {
+    return ((uint32_t)x[0] << 0) + ((uint32_t)x[1] << 8)
+           + ((uint32_t)x[2] << 16) + ((uint32_t)x[3] << 24);
+}
+
+static size_t
+zst_inflate(void *work, const void *src, size_t src_len, uint8_t *dst,
+            size_t dst_len) {
+    ZSTD_DCtx *dctx = ZSTD_initStaticDCtx(work, ZSTD_estimateDCtxSize());
+    size_t out = ZSTD_decompressDCtx(dctx, dst, dst_len, src, src_len);
+    return ZSTD_isError(out) ? (size_t)-1 : out;
+}
+
+static size_t
+zst_frame_len(const struct vdisk_zst *d, uint64_t frame) {
+    return frame + 1 == d->frame_cnt ? d->last_frame_size : d->frame_size;
+}
+
+static struct inflate_job
+zst_frame_job(const struct vdisk_zst *d, uint64_t frame, uint8_t *dst) {
+    return (struct inflate_job){.fd = d->fd,
+                                .offset = d->frame_offsets[frame],
+                                .src_len = d->frame_offsets[frame+1]
+                                           - d->frame_offsets[frame],
+                                .dst = dst,
+                                .dst_len = zst_frame_len(d, frame)};
+}
+
+// A frame stays in the buffer while its read waits, a request that overlaps
+// another one using cmp_frame gets a buffer of its own
+static uint8_t *
+zst_get_cmp_buf(struct vdisk_zst *d) {
+    if (!d->cmp_frame_busy) {
+        d->cmp_frame_busy = 1;
+        return d->cmp_frame;
+    }
+    uint8_t *buf = malloc(d->cmp_size_max);
+    if (!buf) {
+        fprintf(stderr, "[vdisk.zst] can't allocate memory: %s\n",
+                strerror(errno));
+    }
+    return buf;
+}
+
+static void
+zst_put_cmp_buf(struct vdisk_zst *d, uint8_t *buf) {
+    if (buf == d->cmp_frame) {
+        d->cmp_frame_busy = 0;
+    } else {
+        free(buf);
+    }
+}
+
+// Inflates on the calling thread, the decoder doesn't wait so its work area
+// is shared
+static void
+zst_inflate_job(struct vdisk_zst *d, struct inflate_job *job, uint8_t *src) {
+    ssize_t res = io_pread(job->fd, src, job->src_len, job->offset,
+                           d->vdisk.io);
+    size_t out = (size_t)-1;
+    if (res == (ssize_t)job->src_len) {
+        out = zst_inflate(d->inflate_work, src, res, job->dst, job->dst_len);
+    }
+    if (out == (size_t)-1) {
+        job->res = -1;
+        job->err = res == -1 ? errno : 0;
+        return;
+    }
+    memset(job->dst + out, 0, job->dst_len - out);
+    job->res = out;
+    job->err = 0;
+}
+
+static int
+zst_inflate_status(const struct inflate_job *job, uint64_t frame) {
+    if (job->res != -1) {
+        return 0;
+    }
+    if (job->err) {
+        fprintf(stderr, "[vdisk.zst] can't read from image file: %s\n",
+                strerror(job->err));
+    } else {
+        fprintf(stderr, "[vdisk.zst] can't inflate frame %" PRIu64 "\n",
+                frame);
+    }
+    return -1;
+}
+
+static const uint8_t *
+zst_read_frame(struct vdisk_zst *d, uint64_t frame) {
+    uint8_t *data = cluster_cache_lookup(d->cache, frame);
+    if (data) {
+        return data;
+    }
+    uint8_t *src = zst_get_cmp_buf(d);
+    if (!src) {
+        return NULL;
+    }
+    struct cluster_cache_entry *e = cluster_cache_reserve(d->cache);
+    if (!e) {
+        fprintf(stderr, "[vdisk.zst] frame cache is exhausted\n");
+        zst_put_cmp_buf(d, src);
+        return NULL;
+    }
+    struct inflate_job job = zst_frame_job(d, frame, e->data);
+    zst_inflate_job(d, &job, src);
+    zst_put_cmp_buf(d, src);
+    if (zst_inflate_status(&job, frame)) {
+        cluster_cache_release(d->cache, e);
+        return NULL;
+    }
+    cluster_cache_insert(d->cache, e, frame);
+    return e->data;
+}
+
+// Whole frames are inflated straight into the buffer by the pool threads, the
+// pool is started when there is more than one frame to inflate at once for
+// the first time
+static int
+zst_inflate_frames(struct vdisk_zst *d, struct inflate_job *jobs,
+                   const uint64_t *frames, size_t cnt) {
+    if (cnt > 1 && d->inflate_thread_cnt > 1 && !d->inflate_pool) {
+        d->inflate_pool = inflate_pool_init(d->inflate_thread_cnt,
+                                            d->cmp_size_max,
+                                            ZSTD_estimateDCtxSize(),
+                                            zst_inflate, d->vdisk.io);
+        if (!d->inflate_pool) {
+            d->inflate_thread_cnt = 1;
+        }
+    }
+    if (cnt > 1 && d->inflate_pool) {
+        inflate_pool_run(d->inflate_pool, jobs, cnt);
+    } else {
+        uint8_t *src = zst_get_cmp_buf(d);
+        if (!src) {
+            return -1;
+        }
+        for (size_t i = 0; i < cnt; i++) {
+            zst_inflate_job(d, jobs + i, src);
+        }
+        zst_put_cmp_buf(d, src);
+    }
+    int status = 0;
+    for (size_t i = 0; i < cnt; i++) {
+        if (zst_inflate_status(jobs + i, frames[i])) {
+            status = -1;
+        }
+    }
+    return status;
+}
+
+STDCALL void
+vdisk_zst_close(void *userdata) {
+    COVERAGE_OFF();
+    struct vdisk_zst *d = userdata;
+    if (d->inflate_pool) {
+        inflate_pool_close(d->inflate_pool);
+    }
+    if (d->cache) {
+        cluster_cache_close(d->cache);
+    }
+    if (d->fd != -1) {
+        close(d->fd);
+    }
+    free(d->frame_offsets);
+    free(d->cmp_frame);
+    free(d->inflate_work);
+    free(d);
+    COVERAGE_ON();
+}
+
+// The request is cut at frame boundaries. Whole frames that aren't cached are
+// inflated in parallel straight into the buffer, partial frames go through the
+// cache.
+STDCALL int
+vdisk_zst_read(void *userdata, void *buffer, off_t startsector,
+               size_t *numsectors) {
+    COVERAGE_OFF();
+    struct vdisk_zst *d = userdata;
+    uint32_t sect_size = d->vdisk.sect_size;
+    uint64_t frame_sects = d->frame_size / sect_size;
+    uint64_t sector = startsector;
+    uint64_t end = sector + *numsectors;
+    struct inflate_job jobs[ZST_INFLATE_JOBS_MAX];
+    uint64_t job_frames[ZST_INFLATE_JOBS_MAX];
+    size_t job_cnt = 0;
+    int status = 0;
+    while (sector < end) {
+        uint64_t frame = sector / frame_sects;
+        uint64_t fend = (frame + 1) * frame_sects;
+        if (fend > end) {
+            fend = end;
+        }
+        uint8_t *dst = (uint8_t*)buffer + (sector - startsector) * sect_size;
+        size_t off = (sector % frame_sects) * sect_size;
+        size_t len = (fend - sector) * sect_size;
+        const uint8_t *data = NULL;
+        if (len == zst_frame_len(d, frame)
+            && !(data = cluster_cache_lookup(d->cache, frame))) {
+            if (job_cnt == ZST_INFLATE_JOBS_MAX) {
+                if (zst_inflate_frames(d, jobs, job_frames, job_cnt)) {
+                    sector = startsector;
+                    job_cnt = 0;
+                    status = -1;
+                    break;
+                }
+                job_cnt = 0;
+            }
+            jobs[job_cnt] = zst_frame_job(d, frame, dst);
+            job_frames[job_cnt++] = frame;
+        } else {
+            if (!data) {
+                data = zst_read_frame(d, frame);
+            }
+            if (!data) {
+                status = -1;
+                break;
+            }
+            memcpy(dst, data + off, len);
+        }
+        sector = fend;
+    }
+    if (job_cnt && zst_inflate_frames(d, jobs, job_frames, job_cnt)) {
+        // the frames can't be told apart, nothing is done
+        sector = startsector;
+        status = -1;
+    }
+    if (status) {
+        *numsectors = sector - startsector;
+        COVERAGE_ON();
+        return KOS_ERROR_DEVICE;
+    }
+    COVERAGE_ON();
+    return KOS_ERROR_SUCCESS;
+}
+
+STDCALL int
+vdisk_zst_write(void *userdata, void *buffer, off_t startsector,
+                size_t *numsectors) {
+    COVERAGE_OFF();
+    (void)userdata;
+    (void)buffer;
+    (void)startsector;
+    (void)numsectors;
+    fprintf(stderr, "[vdisk.zst] image is read-only\n");
+    COVERAGE_ON();
+    return KOS_ERROR_UNSUPPORTED_FS;
+}
+
+STDCALL int
+vdisk_zst_flush(void *userdata) {
+    COVERAGE_OFF();
+    (void)userdata;
+    COVERAGE_ON();
+    return KOS_ERROR_SUCCESS;
+}
+
+static int
+zst_read_footer(int fd, off_t fsize, uint8_t *footer) {
+    if (fsize < ZST_SKIPPABLE_HEADER_SIZE + ZST_FOOTER_SIZE) {
+        return -1;
+    }
+    ssize_t res = pread(fd, footer, ZST_FOOTER_SIZE, fsize - ZST_FOOTER_SIZE);
+    if (res != ZST_FOOTER_SIZE
+        || le32(footer + ZST_FOOTER_SIZE - 4) != ZST_SEEKABLE_MAGIC) {
+        return -1;
+    }
+    return 0;
+}
+
+int
+vdisk_zst_probe(const char *fname) {
+    int fd = open(fname, O_RDONLY | O_BINARY);
+    if (fd == -1) {
+        return 0;
+    }
+    uint8_t footer[ZST_FOOTER_SIZE];
+    int found = !zst_read_footer(fd, lseek(fd, 0, SEEK_END), footer);
+    close(fd);
+    return found;
+}
+
+// Frames are checked to fit the file one after another and to be of the same
+// size, so that the frame of a sector is found without search
+static int
+zst_read_seek_table(struct vdisk_zst *d) {
+    off_t fsize = lseek(d->fd, 0, SEEK_END);
+    uint8_t footer[ZST_FOOTER_SIZE];
+    if (zst_read_footer(d->fd, fsize, footer)) {
+        fprintf(stderr, "[vdisk.zst] no seek table at the end of file\n");
+        return -1;
+    }
+    d->frame_cnt = le32(footer);
+    uint8_t descriptor = footer[4];
+    size_t entry_size = descriptor & ZST_DESCRIPTOR_CHECKSUM ? 12 : 8;
+    uint64_t table_size = (uint64_t)d->frame_cnt * entry_size
+                          + ZST_SKIPPABLE_HEADER_SIZE + ZST_FOOTER_SIZE;
+    if (descriptor & ZST_DESCRIPTOR_RESERVED || !d->frame_cnt
+        || table_size > (uint64_t)fsize) {
+        fprintf(stderr, "[vdisk.zst] bad seek table\n");
+        return -1;
+    }
+    uint8_t *table = malloc(table_size);
+    d->frame_offsets = malloc((d->frame_cnt + 1) * sizeof(uint64_t));
+    if (!table || !d->frame_offsets) {
+        fprintf(stderr, "[vdisk.zst] can't allocate memory: %s\n",
+                strerror(errno));
+        free(table);
+        return -1;
+    }
+    off_t table_offset = fsize - table_size;
+    ssize_t res = io_pread(d->fd, table, table_size, table_offset,
+                           d->vdisk.io);
+    if (res != (ssize_t)table_size) {
+        fprintf(stderr, "[vdisk.zst] can't read seek table: %s\n",
+                res == -1 ? strerror(errno) : "unexpected end of file");
+        free(table);
+        return -1;
+    }
+    int status = 0;
+    if (le32(table) != ZST_SKIPPABLE_MAGIC
+        || le32(table + 4) != table_size - ZST_SKIPPABLE_HEADER_SIZE) {
+        status = -1;
+    }
+    d->frame_size = le32(table + ZST_SKIPPABLE_HEADER_SIZE + 4);
+    uint64_t offset = 0;
+    for (size_t i = 0; i < d->frame_cnt && !status; i++) {
+        const uint8_t *entry = table + ZST_SKIPPABLE_HEADER_SIZE
+                               + i * entry_size;
+        size_t cmp_size = le32(entry);
+        size_t frame_size = le32(entry + 4);
+        if (frame_size > d->frame_size
+            || (frame_size != d->frame_size && i + 1 != d->frame_cnt)) {
+            status = -1;
+        }
+        d->frame_offsets[i] = offset;
+        offset += cmp_size;
+        if (cmp_size > d->cmp_size_max) {
+            d->cmp_size_max = cmp_size;
+        }
+        d->last_frame_size = frame_size;
+    }
+    d->frame_offsets[d->frame_cnt] = offset;
+    free(table);
+    if (status || offset != (uint64_t)table_offset || !d->frame_size
+        || d->frame_size > ZST_FRAME_SIZE_MAX
+        || d->frame_size % d->vdisk.sect_size
+        || d->last_frame_size % d->vdisk.sect_size) {
+        fprintf(stderr, "[vdisk.zst] bad seek table\n");
+        return -1;
+    }
+    d->vdisk.sect_cnt = ((uint64_t)(d->frame_cnt - 1) * d->frame_size
+                         + d->last_frame_size) / d->vdisk.sect_size;
+    return 0;
+}
+
+struct vdisk*
+vdisk_init_zst(const char *fname, const struct vdisk_params *params,
+               const struct umka_io *io) {
+    if (params->flags & VDISK_WRITABLE) {
+        fprintf(stderr, "[vdisk.zst] can't write to compressed image\n");
+        return NULL;
+    }
+    struct vdisk_zst *d = calloc(1, sizeof(struct vdisk_zst));
+    if (!d) {
+        fprintf(stderr, "[vdisk.zst] can't allocate memory: %s\n",
+                strerror(errno));
+        return NULL;
+    }
+    d->vdisk = (struct vdisk){.diskfunc = {.strucsize = sizeof(diskfunc_t),
+                                           .close = vdisk_zst_close,
+                                           .read = vdisk_zst_read,
+                                           .write = vdisk_zst_write,
+                                           .flush = vdisk_zst_flush,
+                                          },
+                              .sect_size = vdisk_raw_sect_size(fname),
+                              .io = io,
+                             };
+    d->fd = open(fname, O_RDONLY | O_BINARY);
+    if (d->fd == -1) {
+        fprintf(stderr, "[vdisk.zst] can't open file '%s': %s\n", fname,
+                strerror(errno));
+        vdisk_zst_close(d);
+        return NULL;
+    }
+    if (zst_read_seek_table(d)) {
+        vdisk_zst_close(d);
+        return NULL;
+    }
+
+    const struct cluster_cache_policy *policy = &cluster_cache_lru;
+    if (params->qcow2_cache_policy) {
+        policy = cluster_cache_policy_find(params->qcow2_cache_policy);
+        if (!policy) {
+            fprintf(stderr, "[vdisk.zst] unknown cache policy: %s\n",
+                    params->qcow2_cache_policy);
+            vdisk_zst_close(d);
+            return NULL;
+        }
+    }
+    size_t cache_size = params->qcow2_cmp_cache_size;
+    if (!cache_size) {
+        cache_size = ZST_CACHE_SIZE_DEFAULT;
+    }
+    d->cache = cluster_cache_init(cache_size, d->frame_size, policy);
+    d->cmp_frame = malloc(d->cmp_size_max);
+    d->inflate_work = malloc(ZSTD_estimateDCtxSize());
+    if (!d->cache || !d->cmp_frame || !d->inflate_work) {
+        fprintf(stderr, "[vdisk.zst] can't allocate memory: %s\n",
+                strerror(errno));
+        vdisk_zst_close(d);
+        return NULL;
+    }
+    d->vdisk.caches[0] = (struct vdisk_cache){.name = "frame",
+                                              .stats = &d->cache->stats};
+
+    d->inflate_thread_cnt = params->qcow2_inflate_thread_cnt;
+    if (!d->inflate_thread_cnt) {
+#ifdef _SC_NPROCESSORS_ONLN
+        long cpu_cnt = sysconf(_SC_NPROCESSORS_ONLN);
+        d->inflate_thread_cnt = cpu_cnt > 0 ? cpu_cnt : 1;
+#else
+        d->inflate_thread_cnt = 1;
+#endif
+    }
+    if (d->inflate_thread_cnt > ZST_INFLATE_JOBS_MAX) {
+        d->inflate_thread_cnt = ZST_INFLATE_JOBS_MAX;
+    }
+    return (struct vdisk*)d;
+}
@@ -0,0 +1,28 @@
+/*
+    SPDX-License-Identifier: GPL-2.0-or-later
+
+    UMKa - User-Mode KolibriOS developer tools
+    vdisk - virtual disk, seekable zstd compressed raw format
+
+    Copyright (C) 2023  Ivan Baravy <dunkaist@gmail.com>
+*/
+
+#ifndef VDISK_ZST_H_INCLUDED
+#define VDISK_ZST_H_INCLUDED
+
+#include <stdio.h>
+#include "vdisk.h"
+#include "umkaio.h"
+
+#define ZST_SUFFIX ".zst"
+#define ZST_CACHE_SIZE_DEFAULT 8    // decompressed frames
+
+// Tells if the file ends with a seek table, whatever its name is
+int
+vdisk_zst_probe(const char *fname);
+
+struct vdisk*
+vdisk_init_zst(const char *fname, const struct vdisk_params *params,
+               const struct umka_io *io);
+
+#endif  // VDISK_ZST_H_INCLUDED
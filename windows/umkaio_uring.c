@@ -0,0 +1,70 @@
+/*
+    SPDX-License-Identifier: GPL-2.0-or-later
+
+    UMKa - User-Mode KolibriOS developer tools
+    io_uring - input/output platform specific code, io_uring backend
+
+    Copyright (C) 2023  Ivan Baravy <dunkaist@gmail.com>
+*/
+
+#include <stdio.h>
+#include "umkaio_uring.h"
+
+struct iou *
+iou_init(size_t entries) {
+    (void)entries;
+    fprintf(stderr, "[io_uring] not implemented for windows\n");
+    return NULL;
+}
+
+void
+iou_close(struct iou *iou) {
+    (void)iou;
+}
+
+int
+iou_register_buffer(struct iou *iou, void *buf, size_t len) {
+    (void)iou;
+    (void)buf;
+    (void)len;
+    return -1;
+}
+
+int
+iou_unregister_buffer(struct iou *iou, void *buf) {
+    (void)iou;
+    (void)buf;
+    return 0;
+}
+
+void
+iou_prep(struct iou *iou, int op, int fd, void *buf, size_t count,
+         off_t offset, uint64_t tag) {
+    (void)iou;
+    (void)op;
+    (void)fd;
+    (void)buf;
+    (void)count;
+    (void)offset;
+    (void)tag;
+}
+
+int
+iou_submit(struct iou *iou) {
+    (void)iou;
+    return -1;
+}
+
+size_t
+iou_discard(struct iou *iou) {
+    (void)iou;
+    return 0;
+}
+
+size_t
+iou_reap(struct iou *iou, iou_complete_t complete, void *arg) {
+    (void)iou;
+    (void)complete;
+    (void)arg;
+    return 0;
+}